@@ -0,0 +1,466 @@
+/** \file
+ * Benchmarks for the tree support library and generated code, operating on
+ * randomly generated synthetic trees.
+ */
+
+#include <benchmark/benchmark.h>
+#include <sstream>
+#include <string>
+#include "random_tree.hpp"
+
+namespace bench {
+
+/**
+ * Registers the tree shapes that each benchmark is run for, as (width,
+ * depth, link percentage) argument triples.
+ */
+static void shapes(benchmark::internal::Benchmark *b) {
+    b->ArgNames({"width", "depth", "links"});
+    b->Args({2, 12, 0});        // narrow and deep
+    b->Args({2, 12, 50});       // narrow and deep, with many links
+    b->Args({8, 5, 10});        // bushy
+    b->Args({64, 2, 10});       // wide and shallow
+    b->Args({1, 256, 10});      // degenerate chain
+}
+
+/**
+ * Returns the tree shape for the current benchmark run.
+ */
+static Shape get_shape(const benchmark::State &state) {
+    return Shape{
+        static_cast<size_t>(state.range(0)),
+        static_cast<size_t>(state.range(1)),
+        static_cast<size_t>(state.range(2))
+    };
+}
+
+/**
+ * Reports the throughput of the benchmark in items per second.
+ */
+static void set_items_processed(benchmark::State &state, const Shape &shape) {
+    auto items = count_items(shape);
+    state.counters["items"] = static_cast<double>(items);
+    state.SetItemsProcessed(static_cast<int64_t>(state.iterations() * items));
+}
+
+/**
+ * Annotation type used for the annotation benchmark.
+ */
+struct Mark {
+    int64_t value;
+};
+
+/**
+ * Visitor that counts the nodes in a tree recursively.
+ */
+class RecursiveCounter : public synth::RecursiveVisitor {
+public:
+    size_t count = 0;
+
+    void visit_node(synth::Node &node) override {
+        (void) node;
+        count++;
+    }
+};
+
+/**
+ * Visitor that counts the nodes in a tree using a work stack.
+ */
+class WalkCounter : public synth::Walker {
+public:
+    size_t count = 0;
+
+protected:
+    synth::WalkAction pre(synth::Node &node) override {
+        (void) node;
+        count++;
+        return synth::WalkAction::CONTINUE;
+    }
+};
+
+/**
+ * Visitor that counts the nodes in a tree recursively, dispatched at compile
+ * time.
+ */
+class StaticCounter : public synth::StaticVisitor<StaticCounter> {
+public:
+    size_t count = 0;
+
+    void visit_node(synth::Node &node) {
+        (void) node;
+        count++;
+    }
+
+    void visit_root(synth::Root &node) {
+        count++;
+        visit(*node.item);
+    }
+
+    void visit_branch(synth::Branch &node) {
+        count++;
+        for (auto &child : node.children) {
+            visit(*child);
+        }
+    }
+};
+
+/**
+ * Visitor that counts the nodes in a flattened tree recursively.
+ */
+class FlatCounter : public synth::FlatVisitor<FlatCounter> {
+public:
+    size_t count = 0;
+
+    void visit_node(const synth::FlatTree &tree, uint32_t index) {
+        (void) tree;
+        (void) index;
+        count++;
+    }
+
+    void visit_root(const synth::FlatTree &tree, uint32_t index) {
+        count++;
+        visit(tree, tree.root_rows.item[tree.records[index].row]);
+    }
+
+    void visit_branch(const synth::FlatTree &tree, uint32_t index) {
+        count++;
+        auto range = tree.branch_rows.children[tree.records[index].row];
+        for (uint32_t i = range.begin; i < range.begin + range.size; i++) {
+            visit(tree, tree.lists[i]);
+        }
+    }
+};
+
+/**
+ * Visitor that sums the values of the leaves of a flattened tree with a
+ * linear scan.
+ */
+class FlatSummer : public synth::FlatVisitor<FlatSummer> {
+public:
+    int64_t sum = 0;
+
+    void visit_node(const synth::FlatTree &tree, uint32_t index) {
+        (void) tree;
+        (void) index;
+    }
+
+    void visit_leaf(const synth::FlatTree &tree, uint32_t index) {
+        sum += tree.leaf_rows.value[tree.records[index].row];
+    }
+};
+
+/**
+ * Visitor that sets an annotation on each node and reads it back.
+ */
+class Annotator : public synth::RecursiveVisitor {
+public:
+    int64_t sum = 0;
+
+    void visit_node(synth::Node &node) override {
+        node.set_annotation(Mark{sum});
+        sum += node.get_annotation<Mark>().value + 1;
+    }
+};
+
+/**
+ * Constructs a tree.
+ */
+static void make(benchmark::State &state) {
+    auto shape = get_shape(state);
+    for (auto _ : state) {
+        auto tree = make_tree(shape);
+        benchmark::DoNotOptimize(tree);
+    }
+    set_items_processed(state, shape);
+}
+BENCHMARK(make)->Apply(shapes);
+
+/**
+ * Deep-copies a tree.
+ */
+static void clone(benchmark::State &state) {
+    auto shape = get_shape(state);
+    auto tree = make_tree(shape);
+    for (auto _ : state) {
+        auto copy = tree.clone();
+        benchmark::DoNotOptimize(copy);
+    }
+    set_items_processed(state, shape);
+}
+BENCHMARK(clone)->Apply(shapes);
+
+/**
+ * Deep-copies a tree with the parallel implementation.
+ */
+static void clone_parallel(benchmark::State &state) {
+    auto shape = get_shape(state);
+    auto tree = make_tree(shape);
+    for (auto _ : state) {
+        auto copy = tree.clone_parallel();
+        benchmark::DoNotOptimize(copy);
+    }
+    set_items_processed(state, shape);
+}
+BENCHMARK(clone_parallel)->Apply(shapes)->UseRealTime();
+
+/**
+ * Compares a tree with an identical copy of itself.
+ */
+static void equals(benchmark::State &state) {
+    auto shape = get_shape(state);
+    auto tree = make_tree(shape);
+    auto copy = tree.clone();
+    for (auto _ : state) {
+        auto equal = tree.equals(copy);
+        benchmark::DoNotOptimize(equal);
+    }
+    set_items_processed(state, shape);
+}
+BENCHMARK(equals)->Apply(shapes);
+
+/**
+ * Computes the structural hash of a tree.
+ */
+static void hash(benchmark::State &state) {
+    auto shape = get_shape(state);
+    auto tree = make_tree(shape);
+    for (auto _ : state) {
+        auto value = tree.hash();
+        benchmark::DoNotOptimize(value);
+    }
+    set_items_processed(state, shape);
+}
+BENCHMARK(hash)->Apply(shapes);
+
+/**
+ * Visits all nodes in a tree with a RecursiveVisitor.
+ */
+static void visit_recursive(benchmark::State &state) {
+    auto shape = get_shape(state);
+    auto tree = make_tree(shape);
+    for (auto _ : state) {
+        RecursiveCounter counter{};
+        tree->visit(counter);
+        benchmark::DoNotOptimize(counter.count);
+    }
+    set_items_processed(state, shape);
+}
+BENCHMARK(visit_recursive)->Apply(shapes);
+
+/**
+ * Visits all nodes in a tree recursively with a StaticVisitor.
+ */
+static void visit_static(benchmark::State &state) {
+    auto shape = get_shape(state);
+    auto tree = make_tree(shape);
+    for (auto _ : state) {
+        StaticCounter counter{};
+        counter.visit(*tree);
+        benchmark::DoNotOptimize(counter.count);
+    }
+    set_items_processed(state, shape);
+}
+BENCHMARK(visit_static)->Apply(shapes);
+
+/**
+ * Visits all nodes in a tree with a Walker.
+ */
+static void visit_walker(benchmark::State &state) {
+    auto shape = get_shape(state);
+    auto tree = make_tree(shape);
+    for (auto _ : state) {
+        WalkCounter counter{};
+        counter.walk(*tree);
+        benchmark::DoNotOptimize(counter.count);
+    }
+    set_items_processed(state, shape);
+}
+BENCHMARK(visit_walker)->Apply(shapes);
+
+/**
+ * Converts a tree to its flattened representation.
+ */
+static void flatten(benchmark::State &state) {
+    auto shape = get_shape(state);
+    auto tree = make_tree(shape);
+    for (auto _ : state) {
+        auto flat = synth::FlatTree::flatten(tree);
+        benchmark::DoNotOptimize(flat.records.data());
+    }
+    set_items_processed(state, shape);
+}
+BENCHMARK(flatten)->Apply(shapes);
+
+/**
+ * Converts a flattened tree back to the pointer-based representation.
+ */
+static void unflatten(benchmark::State &state) {
+    auto shape = get_shape(state);
+    auto flat = synth::FlatTree::flatten(make_tree(shape));
+    for (auto _ : state) {
+        auto tree = flat.unflatten();
+        benchmark::DoNotOptimize(tree);
+    }
+    set_items_processed(state, shape);
+}
+BENCHMARK(unflatten)->Apply(shapes);
+
+/**
+ * Visits all nodes in a flattened tree recursively.
+ */
+static void visit_flat(benchmark::State &state) {
+    auto shape = get_shape(state);
+    auto flat = synth::FlatTree::flatten(make_tree(shape));
+    for (auto _ : state) {
+        FlatCounter counter{};
+        counter.visit(flat, 0);
+        benchmark::DoNotOptimize(counter.count);
+    }
+    set_items_processed(state, shape);
+}
+BENCHMARK(visit_flat)->Apply(shapes);
+
+/**
+ * Sums the leaf values of a flattened tree with a linear scan.
+ */
+static void visit_flat_walk(benchmark::State &state) {
+    auto shape = get_shape(state);
+    auto flat = synth::FlatTree::flatten(make_tree(shape));
+    for (auto _ : state) {
+        FlatSummer summer{};
+        summer.walk(flat);
+        benchmark::DoNotOptimize(summer.sum);
+    }
+    set_items_processed(state, shape);
+}
+BENCHMARK(visit_flat_walk)->Apply(shapes);
+
+/**
+ * Writes a debug dump of a tree to a string stream.
+ */
+static void dump(benchmark::State &state) {
+    auto shape = get_shape(state);
+    auto tree = make_tree(shape);
+    for (auto _ : state) {
+        std::ostringstream ss{};
+        tree->dump(ss);
+        benchmark::DoNotOptimize(ss.tellp());
+    }
+    set_items_processed(state, shape);
+}
+BENCHMARK(dump)->Apply(shapes);
+
+/**
+ * Serializes a tree to CBOR, in the original or compact format.
+ */
+static void serialize(benchmark::State &state, bool compact) {
+    auto shape = get_shape(state);
+    auto tree = make_tree(shape);
+    size_t bytes = 0;
+    for (auto _ : state) {
+        auto cbor = compact ? tree::base::serialize_compact(tree) : tree::base::serialize(tree);
+        bytes = cbor.size();
+        benchmark::DoNotOptimize(cbor);
+    }
+    set_items_processed(state, shape);
+    state.SetBytesProcessed(static_cast<int64_t>(state.iterations() * bytes));
+}
+BENCHMARK_CAPTURE(serialize, original, false)->Apply(shapes);
+BENCHMARK_CAPTURE(serialize, compact, true)->Apply(shapes);
+
+/**
+ * Deserializes a tree from CBOR, in the original or compact format.
+ */
+static void deserialize(benchmark::State &state, bool compact) {
+    auto shape = get_shape(state);
+    auto tree = make_tree(shape);
+    auto cbor = compact ? tree::base::serialize_compact(tree) : tree::base::serialize(tree);
+    for (auto _ : state) {
+        auto copy = tree::base::deserialize<synth::Root>(cbor);
+        benchmark::DoNotOptimize(copy);
+    }
+    set_items_processed(state, shape);
+    state.SetBytesProcessed(static_cast<int64_t>(state.iterations() * cbor.size()));
+}
+BENCHMARK_CAPTURE(deserialize, original, false)->Apply(shapes);
+BENCHMARK_CAPTURE(deserialize, compact, true)->Apply(shapes);
+
+/**
+ * Deserializes a tree from the chunked format with the given number of
+ * threads.
+ */
+static void deserialize_chunked(benchmark::State &state, size_t threads) {
+    auto shape = get_shape(state);
+    auto tree = make_tree(shape);
+    auto cbor = tree::base::serialize_chunked(tree, 2);
+    for (auto _ : state) {
+        auto copy = tree::base::deserialize_chunked<synth::Root>(cbor, threads);
+        benchmark::DoNotOptimize(copy);
+    }
+    set_items_processed(state, shape);
+    state.SetBytesProcessed(static_cast<int64_t>(state.iterations() * cbor.size()));
+}
+BENCHMARK_CAPTURE(deserialize_chunked, serial, 1)->Apply(shapes);
+BENCHMARK_CAPTURE(deserialize_chunked, parallel, 4)->Apply(shapes)->UseRealTime();
+
+/**
+ * Checks whether a tree is well-formed.
+ */
+static void check_well_formed(benchmark::State &state) {
+    auto shape = get_shape(state);
+    auto tree = make_tree(shape);
+    for (auto _ : state) {
+        tree.check_well_formed();
+    }
+    set_items_processed(state, shape);
+}
+BENCHMARK(check_well_formed)->Apply(shapes);
+
+/**
+ * Checks whether a tree is well-formed with the parallel implementation.
+ */
+static void check_well_formed_parallel(benchmark::State &state) {
+    auto shape = get_shape(state);
+    auto tree = make_tree(shape);
+    for (auto _ : state) {
+        tree.check_well_formed_parallel();
+    }
+    set_items_processed(state, shape);
+}
+BENCHMARK(check_well_formed_parallel)->Apply(shapes)->UseRealTime();
+
+/**
+ * Rechecks whether a tree is well-formed with an IncrementalValidator after
+ * replacing the root item with itself, such that only the root is rescanned.
+ */
+static void check_well_formed_incremental(benchmark::State &state) {
+    auto shape = get_shape(state);
+    auto tree = make_tree(shape);
+    tree::base::IncrementalValidator validator{};
+    tree.check_well_formed(validator);
+    for (auto _ : state) {
+        tree->item = tree::base::One<synth::Item>(tree->item);
+        tree.check_well_formed(validator);
+    }
+    set_items_processed(state, shape);
+}
+BENCHMARK(check_well_formed_incremental)->Apply(shapes);
+
+/**
+ * Sets and then reads back an annotation on every node of a tree.
+ */
+static void annotations(benchmark::State &state) {
+    auto shape = get_shape(state);
+    auto tree = make_tree(shape);
+    for (auto _ : state) {
+        Annotator annotator{};
+        tree->visit(annotator);
+        benchmark::DoNotOptimize(annotator.sum);
+    }
+    set_items_processed(state, shape);
+}
+BENCHMARK(annotations)->Apply(shapes);
+
+} // namespace bench
+
+BENCHMARK_MAIN();
@@ -0,0 +1,88 @@
+/** \file
+ * Defines primitives used in the synthetic tree for the benchmarks.
+ */
+
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include "tree-cbor.hpp"
+
+/**
+ * Namespace with primitives used in the synthetic tree for the benchmarks.
+ */
+namespace primitives {
+
+/**
+ * Integer primitive.
+ */
+using Int = int64_t;
+
+/**
+ * String primitive.
+ */
+using String = std::string;
+
+/**
+ * Initialization function. This must be specialized for any types used as
+ * primitives in a tree that are actual C primitives (int, char, bool, etc),
+ * as these are not initialized by the T() construct.
+ */
+template <class T>
+T initialize() { return T(); };
+
+/**
+ * Initializer for integers.
+ */
+template <>
+inline Int initialize<Int>() {
+    return 0;
+}
+
+/**
+ * Serialization function. This must be specialized for any types used as
+ * primitives in a tree.
+ */
+template <typename T>
+void serialize(const T &obj, tree::cbor::MapWriter &map);
+
+/**
+ * Serialization function for Int.
+ */
+template <>
+inline void serialize<Int>(const Int &obj, tree::cbor::MapWriter &map) {
+    map.append_int("val", obj);
+}
+
+/**
+ * Serialization function for String.
+ */
+template <>
+inline void serialize<String>(const String &obj, tree::cbor::MapWriter &map) {
+    map.append_string("val", obj);
+}
+
+/**
+ * Deserialization function. This must be specialized for any types used as
+ * primitives in a tree.
+ */
+template <typename T>
+T deserialize(const tree::cbor::MapReader &map);
+
+/**
+ * Deserialization function for Int.
+ */
+template <>
+inline Int deserialize<Int>(const tree::cbor::MapReader &map) {
+    return map.at("val").as_int();
+}
+
+/**
+ * Deserialization function for String.
+ */
+template <>
+inline String deserialize<String>(const tree::cbor::MapReader &map) {
+    return map.at("val").as_string();
+}
+
+} // namespace primitives
@@ -0,0 +1,92 @@
+/** \file
+ * Random generators for synthetic trees, used by the benchmarks.
+ */
+
+#include "random_tree.hpp"
+
+#include <random>
+#include <string>
+#include <vector>
+
+namespace bench {
+
+/**
+ * Returns the number of items in a tree with the given shape.
+ */
+size_t count_items(const Shape &shape) {
+    size_t count = 1;
+    size_t level = 1;
+    for (size_t i = 0; i < shape.depth; i++) {
+        level *= shape.width;
+        count += level;
+    }
+    return count;
+}
+
+/**
+ * Generates a random, well-formed tree with the given shape.
+ */
+synth::One<synth::Root> make_tree(const Shape &shape) {
+    std::mt19937_64 rng{shape.seed};
+    std::vector<synth::One<synth::Item>> items{};
+    std::vector<synth::One<synth::Branch>> branches{};
+    items.reserve(count_items(shape));
+
+    // Build the tree breadth-first, such that no recursion is needed. Each
+    // level replaces the previous one as the list of parents.
+    auto make_branch = [&rng]() {
+        return tree::base::make<synth::Branch>(
+            synth::Any<synth::Item>(), synth::OptLink<synth::Item>(),
+            "branch" + std::to_string(rng() % 1000000u),
+            static_cast<primitives::Int>(rng() % 1000000u)
+        );
+    };
+    auto make_leaf = [&rng]() {
+        return tree::base::make<synth::Leaf>(
+            "leaf" + std::to_string(rng() % 1000000u),
+            static_cast<primitives::Int>(rng() % 1000000u)
+        );
+    };
+    synth::One<synth::Item> root_item;
+    if (shape.depth) {
+        auto branch = make_branch();
+        branches.push_back(branch);
+        root_item = branch;
+    } else {
+        root_item = make_leaf();
+    }
+    items.push_back(root_item);
+    std::vector<synth::One<synth::Branch>> parents{branches};
+    for (size_t level = 1; level <= shape.depth; level++) {
+        std::vector<synth::One<synth::Branch>> next{};
+        for (auto &parent : parents) {
+            for (size_t i = 0; i < shape.width; i++) {
+                if (level < shape.depth) {
+                    auto branch = make_branch();
+                    branches.push_back(branch);
+                    next.push_back(branch);
+                    parent->children.add(branch);
+                    items.push_back(branch);
+                } else {
+                    auto leaf = make_leaf();
+                    parent->children.add(leaf);
+                    items.push_back(leaf);
+                }
+            }
+        }
+        parents = std::move(next);
+    }
+
+    // Add links to random items.
+    std::uniform_int_distribution<size_t> percent{0, 99};
+    std::uniform_int_distribution<size_t> index{0, items.size() - 1};
+    for (auto &branch : branches) {
+        if (percent(rng) < shape.link_percent) {
+            branch->target = items[index(rng)];
+        }
+    }
+
+    return tree::base::make<synth::Root>(root_item);
+}
+
+} // namespace bench
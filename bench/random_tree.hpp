@@ -0,0 +1,56 @@
+/** \file
+ * Random generators for synthetic trees, used by the benchmarks.
+ */
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include "synth.hpp"
+
+/**
+ * Namespace for the benchmark suite.
+ */
+namespace bench {
+
+/**
+ * Shape parameters for a randomly generated synthetic tree.
+ */
+struct Shape {
+
+    /**
+     * Number of children of each branch.
+     */
+    size_t width;
+
+    /**
+     * Number of levels of branches below the root; the items at the deepest
+     * level are leaves.
+     */
+    size_t depth;
+
+    /**
+     * Probability in percent that a branch has a link to a random other item
+     * in the tree.
+     */
+    size_t link_percent;
+
+    /**
+     * Seed for the random number generator, such that each shape always maps
+     * to the same tree.
+     */
+    uint64_t seed = 42;
+
+};
+
+/**
+ * Returns the number of items in a tree with the given shape.
+ */
+size_t count_items(const Shape &shape);
+
+/**
+ * Generates a random, well-formed tree with the given shape.
+ */
+synth::One<synth::Root> make_tree(const Shape &shape);
+
+} // namespace bench
@@ -1,5 +1,70 @@
+# Computes the files generated for a tree. With a nonzero SHARDS count, tree-gen
+# additionally generates a forward declaration header next to HDR, and splits
+# the source code over SRC and SHARDS - 1 more files named after SRC, which can
+# be compiled in parallel. Sets TREE_GEN_ARGS to the corresponding tree-gen
+# option, TREE_GEN_HDRS to the generated headers, TREE_GEN_SRCS to the
+# generated source files, and TREE_GEN_STAMP to the stamp file that records
+# when tree-gen last ran, in the parent scope.
+function(_tree_gen_outputs HDR SRC SHARDS)
+    set(ARGS "")
+    set(HDRS "${HDR}")
+    set(SRCS "${SRC}")
+    if(SHARDS)
+        set(ARGS "--shards=${SHARDS}")
+
+        # The suffixes are inserted in front of the extension, which starts
+        # at the first period of the basename, like NAME_WE.
+        get_filename_component(HDR_DIR "${HDR}" PATH)
+        get_filename_component(HDR_NAME "${HDR}" NAME_WE)
+        get_filename_component(HDR_EXT "${HDR}" EXT)
+        list(APPEND HDRS "${HDR_DIR}/${HDR_NAME}-fwd${HDR_EXT}")
+        get_filename_component(SRC_DIR "${SRC}" PATH)
+        get_filename_component(SRC_NAME "${SRC}" NAME_WE)
+        get_filename_component(SRC_EXT "${SRC}" EXT)
+        math(EXPR LAST_SHARD "${SHARDS} - 1")
+        if(LAST_SHARD GREATER 0)
+            foreach(SHARD RANGE 1 ${LAST_SHARD})
+                list(APPEND SRCS "${SRC_DIR}/${SRC_NAME}-${SHARD}${SRC_EXT}")
+            endforeach()
+        endif()
+    endif()
+    set(TREE_GEN_ARGS "${ARGS}" PARENT_SCOPE)
+    set(TREE_GEN_HDRS "${HDRS}" PARENT_SCOPE)
+    set(TREE_GEN_SRCS "${SRCS}" PARENT_SCOPE)
+    set(TREE_GEN_STAMP "${SRC}.stamp" PARENT_SCOPE)
+endfunction()
+
+# Adds a rule for the given generated files that depends on the stamp file set
+# by _tree_gen_outputs, but does nothing itself, such that targets using the
+# files run tree-gen first, but aren't rebuilt when it didn't modify them.
+function(_tree_gen_stamped)
+    add_custom_command(
+        COMMAND "${CMAKE_COMMAND}" -E echo_append
+        OUTPUT ${ARGN}
+        DEPENDS "${TREE_GEN_STAMP}"
+    )
+endfunction()
+
 # Utility function for generating a C++-only tree with tree-gen.
+#
+# Optional arguments:
+#  - SHARDS <count>: split the generated source code over <count> files that
+#    can be compiled in parallel: SRC itself, and files named after SRC with
+#    -1 up to -<count - 1> inserted in front of the extension. A header with
+#    only the forward declarations is also generated, named after HDR with -fwd
+#    inserted in the same way.
+#  - SOURCES <variable>: set <variable> to the list of generated source files
+#    in the calling scope, to add to a target.
+#
+# Generated files of which the contents do not change are not rewritten, so
+# changes to the tree file only rebuild what they actually affect. tree-gen
+# runs to update a stamp file next to SRC instead, which is always touched,
+# such that it doesn't run again on the next build when it left the files
+# alone.
 function(generate_tree TREE_GEN_EXECUTABLE TREE HDR SRC)
+    cmake_parse_arguments(TREE "" "SHARDS;SOURCES" "" ${ARGN})
+    _tree_gen_outputs("${HDR}" "${SRC}" "${TREE_SHARDS}")
+
     # Get the directory for the header file and make sure it exists.
     get_filename_component(HDR_DIR "${HDR}" PATH)
     file(MAKE_DIRECTORY "${HDR_DIR}")
@@ -10,14 +75,23 @@ function(generate_tree TREE_GEN_EXECUTABLE TREE HDR SRC)
 
     # Add a command to do the generation.
     add_custom_command(
-        COMMAND "${TREE_GEN_EXECUTABLE}" "${TREE}" "${HDR}" "${SRC}"
-        OUTPUT "${HDR}" "${SRC}"
+        COMMAND "${TREE_GEN_EXECUTABLE}" ${TREE_GEN_ARGS} "${TREE}" "${HDR}" "${SRC}"
+        COMMAND "${CMAKE_COMMAND}" -E touch "${TREE_GEN_STAMP}"
+        OUTPUT "${TREE_GEN_STAMP}"
         DEPENDS "${TREE}" "${TREE_GEN_EXECUTABLE}"
     )
+    _tree_gen_stamped(${TREE_GEN_HDRS} ${TREE_GEN_SRCS})
+    if(TREE_SOURCES)
+        set(${TREE_SOURCES} "${TREE_GEN_SRCS}" PARENT_SCOPE)
+    endif()
 endfunction()
 
-# Utility function for generating a C++ and Python tree with tree-gen.
+# Utility function for generating a C++ and Python tree with tree-gen. Takes
+# the same optional arguments as generate_tree.
 function(generate_tree_py TREE_GEN_EXECUTABLE TREE HDR SRC PY)
+    cmake_parse_arguments(TREE "" "SHARDS;SOURCES" "" ${ARGN})
+    _tree_gen_outputs("${HDR}" "${SRC}" "${TREE_SHARDS}")
+
     # Get the directory for the header file and make sure it exists.
     get_filename_component(HDR_DIR "${HDR}" PATH)
     file(MAKE_DIRECTORY "${HDR_DIR}")
@@ -32,8 +106,13 @@ function(generate_tree_py TREE_GEN_EXECUTABLE TREE HDR SRC PY)
 
     # Add a command to do the generation.
     add_custom_command(
-        COMMAND "${TREE_GEN_EXECUTABLE}" "${TREE}" "${HDR}" "${SRC}" "${PY}"
-        OUTPUT "${HDR}" "${SRC}" "${PY}"
+        COMMAND "${TREE_GEN_EXECUTABLE}" ${TREE_GEN_ARGS} "${TREE}" "${HDR}" "${SRC}" "${PY}"
+        COMMAND "${CMAKE_COMMAND}" -E touch "${TREE_GEN_STAMP}"
+        OUTPUT "${TREE_GEN_STAMP}"
         DEPENDS "${TREE}" "${TREE_GEN_EXECUTABLE}"
     )
-endfunction()
\ No newline at end of file
+    _tree_gen_stamped(${TREE_GEN_HDRS} ${TREE_GEN_SRCS} "${PY}")
+    if(TREE_SOURCES)
+        set(${TREE_SOURCES} "${TREE_GEN_SRCS}" PARENT_SCOPE)
+    endif()
+endfunction()
@@ -267,12 +267,32 @@ int main() {
     fmt::print("{}\n", oss.str());
     MARKER
 
+    // Both dump functions can also append to a string instead, and the debug
+    // dump can be limited to a maximum nesting depth and number of entries per
+    // list. That makes it cheap enough to log parts of big trees. Nodes beyond
+    // the depth limit are printed without their fields, and the remaining
+    // entries of long lists are summarized.
+    std::string limited{};
+    system->dump(limited, 3, 2);
+    ASSERT(limited.find("            Directory(...)\n            ... (5 more)\n") != std::string::npos);
+    fmt::print("{}", limited);
+    MARKER
+
     // Note that equality for two link edges is satisfied only if they point to
     // the exact same node. That's not the case for the links in our two
     // entirely separate trees, so the two trees register as unequal.
     ASSERT(!system2.equals(system));
     MARKER
 
+    // Every node also has a structural hash that is consistent with equals(),
+    // so hashes can be compared first to rule out unequal pairs cheaply. Our
+    // link-free subtrees do equal their clones, and thus hash equal as well.
+    auto program_files = system->drives[0]->root_dir->entries[0];
+    ASSERT(program_files->clone()->equals(*program_files));
+    ASSERT(program_files->clone()->hash() == program_files->hash());
+    ASSERT(program_files->hash() != system->drives[0]->root_dir->entries[1]->hash());
+    MARKER
+
     // To be sure no data was lost, we'll have to check the CBOR and debug dumps
     // instead.
     ASSERT(tree::base::serialize(tree::base::Maybe<directory::System>{ system }) == tree::base::serialize(system2));
@@ -283,5 +303,243 @@ int main() {
     ASSERT(ss1.str() == ss2.str());
     MARKER
 
+    // For big trees, there is also a compact serialization format. It
+    // identifies node types and fields by number rather than by name, so it's
+    // smaller and faster to load, but it can only be read back by code
+    // generated from the exact same tree description. deserialize() detects
+    // which format it's given by itself.
+    std::string compact = tree::base::serialize_compact(tree::base::Maybe<directory::System>{ system });
+    fmt::print("{} bytes instead of {}\n", compact.size(), cbor.size());
+    auto system3 = tree::base::deserialize<directory::System>(compact);
+    ASSERT(tree::base::serialize(system3) == cbor);
+    MARKER
+
+    // The compact format can also be split into chunks. serialize_chunked()
+    // writes each element of the outermost Any/Many edges with at least the
+    // given number of elements (two here, to split up the drives) as a
+    // separate chunk, along with a table of their offsets, such that they can
+    // be deserialized independently. deserialize_chunked() deserializes them
+    // in parallel.
+    std::string chunked = tree::base::serialize_chunked(tree::base::Maybe<directory::System>{ system }, 2);
+    ASSERT(tree::base::serialize(tree::base::deserialize_chunked<directory::System>(chunked, 2)) == cbor);
+    ASSERT(tree::base::serialize(tree::base::deserialize<directory::System>(chunked)) == cbor);
+    MARKER
+
+    // A ChunkedTree loads the chunks on demand instead. Until a chunk is
+    // loaded, the edge it belongs to is empty, and links to nodes inside it
+    // can't be restored yet, so the tree is only well-formed once everything
+    // has been loaded.
+    tree::base::ChunkedTree<directory::System> lazy{chunked};
+    fmt::print("{} chunks\n", lazy.size());
+    ASSERT(lazy.get()->drives[1].empty());
+    lazy.load(1);
+    ASSERT(!lazy.get()->drives[1].empty());
+    ASSERT(lazy.get()->drives[0].empty());
+    lazy.load(lazy.get()->drives);
+    ASSERT(lazy.pending() == 0);
+    lazy.get().check_well_formed();
+    ASSERT(tree::base::serialize(lazy.get()) == cbor);
+    MARKER
+
+    // Passes that only read a big tree can also run on a flattened copy of
+    // it. FlatTree::flatten() stores the nodes as an array of records in
+    // pre-order, and the fields of each node type in a separate set of
+    // columns, with child nodes and link targets replaced by record indices.
+    // The FlatVisitor base class works like StaticVisitor, but on (tree,
+    // index) pairs, and its walk() function visits every node with a simple
+    // loop over the records. Here we use it to list the mount points.
+    auto flat = directory::FlatTree::flatten(system);
+    ASSERT(flat.size() == 13);
+    ASSERT(flat.records[0].end == flat.size());
+    class MountLister : public directory::FlatVisitor<MountLister> {
+    public:
+        std::vector<std::string> mounts;
+
+        void visit_node(const directory::FlatTree &tree, uint32_t index) {
+            (void) tree;
+            (void) index;
+        }
+
+        void visit_mount(const directory::FlatTree &tree, uint32_t index) {
+            auto row = tree.records[index].row;
+            auto target = tree.records[tree.mount_rows.target[row]];
+            mounts.push_back(
+                tree.mount_rows.name[row] + " -> directory with " +
+                std::to_string(tree.directory_rows.entries[target.row].size) + " entries"
+            );
+        }
+    };
+    MountLister lister{};
+    lister.walk(flat);
+    ASSERT(lister.mounts.size() == 2);
+    for (auto &mount : lister.mounts) {
+        fmt::print("{}\n", mount);
+    }
+    MARKER
+
+    // unflatten() turns it back into a regular tree, links included.
+    auto system4 = flat.unflatten().as<directory::System>();
+    system4.check_well_formed();
+    ASSERT(tree::base::serialize(system4) == cbor);
+    MARKER
+
+    // Nodes don't know their parents, but a ParentIndex does. It is built in
+    // a single walk over the tree when it is first queried, after which it
+    // can find the parent of a node, the field and position within that
+    // field, the path from the root, and the nearest ancestor of some type.
+    // Here we use it on a copy of the system to find the drive a file is on.
+    auto system5 = system.clone();
+    directory::ParentIndex parents{system5.get_ptr().get()};
+    auto &hiberfil = *system5->drives[0]->root_dir->entries[3];
+    ASSERT(parents.parent_of(*system5) == nullptr);
+    ASSERT(parents.field_of(hiberfil) == 0);
+    ASSERT(parents.index_of(hiberfil) == 3);
+    ASSERT(parents.path_to(hiberfil).size() == 4);
+    ASSERT(parents.size() == 13);
+    auto drive = parents.ancestor_of<directory::Drive>(hiberfil);
+    fmt::print("{} is on drive {}\n", hiberfil.name, drive->letter);
+    MARKER
+
+    // The index notices when edges in the tree are modified, and is rebuilt
+    // by the next query. Let's move the file to the other drive.
+    auto moved = system5->drives[0]->root_dir->entries.take(3);
+    system5->drives[1]->root_dir->entries.add(moved);
+    drive = parents.ancestor_of<directory::Drive>(*moved);
+    fmt::print("{} is on drive {}\n", moved->name, drive->letter);
+    ASSERT(parents.index_of(*moved) == 1);
+    MARKER
+
+    // Trees often contain many identical subtrees. An Interner replaces them
+    // with a single canonical copy, based on the generated hash() and equals()
+    // functions. It freezes the tree in the process (see freeze()), since the
+    // same node may now appear more than once in it. Subtrees that contain
+    // the target of a link are left alone, as such a link would otherwise
+    // become ambiguous. Let's make a system with backup drives that all have
+    // the same contents.
+    auto backups = tree::base::make<directory::System>();
+    for (char letter : {'E', 'F', 'G'}) {
+        using namespace directory;
+        auto dir = tree::base::make<Directory>(Any<Entry>{}, "");
+        dir->entries.emplace<File>("backup data", "backup.bin")
+                    .emplace<Directory>(Any<Entry>{}, "old");
+        backups->drives.emplace<Drive>(letter, dir);
+    }
+    std::string expanded = tree::base::serialize(backups);
+    tree::base::Interner interner{};
+    interner.intern(backups);
+    backups.check_well_formed();
+    ASSERT(backups->drives[0]->root_dir.get_ptr() == backups->drives[2]->root_dir.get_ptr());
+    fmt::print("{} canonical subtrees\n", interner.size());
+    MARKER
+
+    // When such a tree is serialized, shared subtrees are written only once;
+    // further occurrences are written as back-references to the first, so
+    // the sharing survives a round trip.
+    std::string shared = tree::base::serialize(backups);
+    fmt::print("{} bytes instead of {}\n", shared.size(), expanded.size());
+    auto backups2 = tree::base::deserialize<directory::System>(shared);
+    ASSERT(backups2->drives[0]->root_dir.get_ptr() == backups2->drives[2]->root_dir.get_ptr());
+    ASSERT(tree::base::serialize(backups2) == shared);
+    auto backups3 = tree::base::deserialize<directory::System>(tree::base::serialize_compact(backups));
+    ASSERT(backups3->drives[0]->root_dir.get_ptr() == backups3->drives[2]->root_dir.get_ptr());
+    ASSERT(tree::base::serialize(backups3) == shared);
+    {
+        std::ofstream cbor_output;
+        cbor_output.open("backups.cbor", std::ios::out | std::ios::trunc | std::ios::binary);
+        cbor_output << shared;
+    }
+    MARKER
+
+    // memory_usage() reports how much memory a tree takes up, per node type,
+    // along with how full the vectors of its Any/Many edges are and what
+    // annotations it carries. Shared subtrees are counted once, so the
+    // interned backups only have seven nodes.
+    auto usage = directory::memory_usage(backups);
+    ASSERT(usage.node_count() == 7);
+    ASSERT(usage.nodes[static_cast<size_t>(directory::NodeType::Drive)].count == 3);
+    usage.dump();
+    MARKER
+
+    // When the support library is configured with TREE_STATS, allocate()
+    // also counts the live and peak number of nodes of each type, and the
+    // entry points for (de)serialization, checking, and cloning are timed.
+    // stats() takes a snapshot of these counters, for example to export them
+    // as metrics. Without TREE_STATS, they are all zero.
+    directory::stats().dump();
+    MARKER
+
+    // Analyses that are independent across siblings can use a
+    // ParallelReduceVisitor. Its visit_all() function visits the elements of
+    // an Any/Many edge on a pool of threads, in ranges of the given grain
+    // size, and combines their results with reduce(), which must be
+    // associative. The visit functions run concurrently, so they may only
+    // modify the node they are visiting; here, each directory records its
+    // total size as an annotation.
+    class ContentSize : public directory::ParallelReduceVisitor<size_t> {
+    public:
+        ContentSize() : ParallelReduceVisitor<size_t>(4, 100) {}
+
+        size_t reduce(size_t lhs, size_t rhs) override {
+            return lhs + rhs;
+        }
+
+        size_t visit_node(directory::Node &node) override {
+            (void) node;
+            return 0;
+        }
+
+        size_t visit_system(directory::System &node) override {
+            return visit_all(node.drives);
+        }
+
+        size_t visit_drive(directory::Drive &node) override {
+            return node.root_dir->visit(*this);
+        }
+
+        size_t visit_directory(directory::Directory &node) override {
+            auto size = visit_all(node.entries);
+            node.set_annotation<size_t>(size);
+            return size;
+        }
+
+        size_t visit_file(directory::File &node) override {
+            return node.contents.size();
+        }
+    };
+    auto archive = tree::base::make<directory::System>();
+    {
+        using namespace directory;
+        auto dir = tree::base::make<Directory>(Any<Entry>{}, "");
+        for (int i = 0; i < 1000; i++) {
+            dir->entries.emplace<File>(std::string(i % 10, 'x'), "file" + std::to_string(i));
+        }
+        archive->drives.emplace<Drive>('Z', dir);
+    }
+    ContentSize content_size{};
+    ASSERT(archive->visit(content_size) == 4500);
+    ASSERT(*archive->drives[0]->root_dir->get_annotation_ptr<size_t>() == 4500);
+    MARKER
+
+    // To ship an edited tree somewhere that already has the original, diff()
+    // writes a patch with only the differences: replaced, inserted, and
+    // removed subtrees, changed primitive fields, and retargeted links, each
+    // at a path of field and element indices from the root. apply_patch()
+    // then edits the original in place. Let's edit a copy of the system.
+    auto original = tree::base::deserialize<directory::System>(cbor);
+    auto edited = tree::base::deserialize<directory::System>(cbor);
+    {
+        using namespace directory;
+        auto edited_root = edited->drives[0]->root_dir;
+        edited_root->entries[4]->as_file()->contents = "less page file data";
+        edited_root->entries.remove(2);
+        edited->drives[1]->root_dir->entries.emplace<Mount>(edited_root->entries[0].as<Directory>(), "programs");
+    }
+    std::string patch = tree::base::diff(original, edited);
+    fmt::print("{} byte patch instead of {} bytes\n", patch.size(), tree::base::serialize_compact(edited).size());
+    tree::base::apply_patch(original, patch);
+    ASSERT(tree::base::serialize(original) == tree::base::serialize(edited));
+    ASSERT(original->drives[1]->root_dir->entries[1]->as_mount()->target.get_ptr() == original->drives[0]->root_dir->entries[0].get_ptr());
+    MARKER
+
     return 0;
 }
@@ -101,3 +101,41 @@ for c in cbor:
     count += 1
 print()
 marker()
+
+# | Python trees can't share nodes, so when the C++ code serializes a tree with
+# | shared subtrees, the back-references are expanded into copies.
+with open(os.path.join(TEST_DIR, 'backups.cbor'), 'rb') as f:
+    backups = System.deserialize(f.read())
+
+backups.check_well_formed()
+assert backups.drives[0].root_dir == backups.drives[2].root_dir
+assert backups.drives[0].root_dir is not backups.drives[2].root_dir
+print(backups.drives[2])
+marker()
+
+# The remaining checks are not part of the documentation.
+import directory
+
+# The serializer appends to a single buffer, which must give the same bytes as
+# converting the Python representation of the tree.
+for ob in (tree, backups):
+    id_map = ob.find_reachable()
+    assert ob.serialize() == directory._py_to_cbor(ob._serialize(id_map))
+
+# The dict-based deserializer, which is used for the Python representation and
+# for maps that the streaming reader can't handle, gives the same tree.
+cbor = tree.serialize()
+assert System.deserialize(directory._cbor_to_py(cbor)).serialize() == cbor
+
+# Any bytes-like object is accepted.
+assert System.deserialize(bytearray(cbor)).serialize() == cbor
+assert System.deserialize(memoryview(cbor)).serialize() == cbor
+
+# Truncated data and garbage are rejected with a ValueError.
+for data in [cbor[:size] for size in range(len(cbor))] + [cbor + b'\x00', b'\xff', b'\x1f', b'\xa1\x00\x00']:
+    try:
+        System.deserialize(data)
+    except ValueError:
+        pass
+    else:
+        assert False, 'deserializing invalid CBOR did not fail'
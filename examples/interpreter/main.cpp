@@ -158,8 +158,8 @@ int main() {
     // objects added to nodes without you ever having to declare that you're
     // going to add them. If that sounds like black magic to you in the context
     // of C++, well, that's because it is: internally annotations are stored
-    // as a map from ``std::type_index`` to a C++11 backport of ``std::any``...
-    // it's complicated. But you don't have to worry about it. What matters is
+    // as a small list of C++11 backports of ``std::any``, keyed by a unique
+    // per-type descriptor... it's complicated. But you don't have to worry about it. What matters is
     // that each and every node generated by tree-gen (or anything else that
     // inherits from ``tree::annotatable::Annotatable``) can have zero or one
     // annotation of every C++ type attached to it.
@@ -234,13 +234,12 @@ int main() {
     // recommended; if not used, a C++-compiler-specific identifier will be used
     // for the type.
     //
-    // Similar to links, annotations aren't copied as you might expect by
-    // ``copy()`` and ``clone()``. Specifically, annotations are stored as
-    // ``std::shared_ptr``s to unknown C++ objects, and therefore copying a
-    // node only copies the references to the annotations. To fully clone
-    // annotations, you'll either have to serialize and deserialize the node
-    // they belong to (after registering with ``serdes_registry`` of course), or
-    // clone them manually.
+    // Annotations are stored by value, so ``copy()`` and ``clone()`` copy them
+    // along with the node using their copy constructors. If you want copies
+    // of a node to share an annotation object instead, store a
+    // ``std::shared_ptr`` to it as the annotation. Annotation types that can't
+    // be copied can still be used, but copying a node that has one throws an
+    // exception.
 
     // Visitor pattern
     // ===============
@@ -336,6 +335,102 @@ int main() {
     ASSERT_RAISES(std::runtime_error, value::ErroneousValue().visit(eval));
     MARKER
 
+    // Every visit through ``Visitor`` goes through a few virtual function
+    // calls, which the compiler can't inline. For hot code paths such as this
+    // evaluator, there is also ``StaticVisitor<Derived, R>``, which uses the
+    // curiously recurring template pattern: you pass your own class as the
+    // first template argument, and define the visit functions as ordinary
+    // public member functions instead of overriding them. ``visit()`` then
+    // switches on the type of the node once and calls the right function
+    // directly, with the same fallback rules as ``Visitor``.
+    class StaticEvaluator : public value::StaticVisitor<StaticEvaluator, int> {
+    public:
+        int visit_node(value::Node &node) {
+            throw std::runtime_error("unknown node type");
+        }
+
+        int visit_literal(value::Literal &node) {
+            return node.value;
+        }
+
+        int visit_negate(value::Negate &node) {
+            return -visit(*node.oper);
+        }
+
+        int visit_add(value::Add &node) {
+            return visit(*node.lhs) + visit(*node.rhs);
+        }
+
+        int visit_sub(value::Sub &node) {
+            return visit(*node.lhs) - visit(*node.rhs);
+        }
+
+        int visit_mul(value::Mul &node) {
+            return visit(*node.lhs) * visit(*node.rhs);
+        }
+
+        int visit_div(value::Div &node) {
+            return visit(*node.lhs) / visit(*node.rhs);
+        }
+
+        int visit_reference(value::Reference &node) {
+            return node.target->value;
+        }
+    };
+    StaticEvaluator static_eval{};
+    ASSERT(static_eval.visit(*expr) == 14);
+    value::ErroneousValue erroneous{};
+    ASSERT_RAISES(std::runtime_error, static_eval.visit(erroneous));
+    MARKER
+
+    // When subtrees are shared, for instance because they were frozen (see
+    // ``freeze()``) or because they are reached through links, a visitor
+    // like the ones above computes the result for them every time it gets
+    // there. Deriving from ``MemoVisitor`` instead and calling ``memo()``
+    // rather than ``visit()`` caches the results per node, so each node is
+    // only visited once. The cache is thrown away automatically when edges
+    // in the tree are modified.
+    class MemoEvaluator : public value::MemoVisitor<int> {
+    public:
+        int visits = 0;
+
+        int visit_node(value::Node &node) override {
+            throw std::runtime_error("unknown node type");
+        }
+
+        int visit_literal(value::Literal &node) override {
+            visits++;
+            return node.value;
+        }
+
+        int visit_add(value::Add &node) override {
+            visits++;
+            return memo(node.lhs) + memo(node.rhs);
+        }
+
+        int visit_mul(value::Mul &node) override {
+            visits++;
+            return memo(node.lhs) * memo(node.rhs);
+        }
+    };
+
+    // (3 * 3) + (3 * 3) = 18, with a single shared (3 * 3) node.
+    auto square = tree::base::make<value::Mul>(
+        tree::base::make<value::Literal>(3),
+        tree::base::make<value::Literal>(3)
+    );
+    square.freeze();
+    auto sum = tree::base::make<value::Add>(square, square);
+    MemoEvaluator memo_eval{};
+    ASSERT(memo_eval.memo(*sum) == 18);
+    ASSERT(memo_eval.visits == 4);
+    ASSERT(memo_eval.memo(*sum) == 18);
+    ASSERT(memo_eval.visits == 4);
+    sum->rhs = tree::base::make<value::Literal>(1);
+    ASSERT(memo_eval.memo(*sum) == 10);
+    ASSERT(memo_eval.visits == 9);
+    MARKER
+
     // The visitor pattern is more powerful than recursively calling functions
     // for other reasons as well, because they can be specialized through
     // inheritance, state can be maintained in the class as the tree is
@@ -346,5 +441,89 @@ int main() {
     // pattern and casts is therefore usually a matter of personal preference.
     MARKER
 
+    // Because the visitor classes recurse through the visit methods, very
+    // deeply nested trees (think long chains of additions) can overflow the
+    // stack. For those, there is a third base class, ``Walker``, which walks
+    // the tree depth-first using an explicit stack instead; ``dump()`` uses
+    // it internally. Rather than visit methods, you override ``pre()`` and/or
+    // ``post()`` hooks, which are called for every node. They return a
+    // ``WalkAction``: ``CONTINUE``, ``SKIP`` to not descend into the current
+    // node, or ``STOP`` to abort the walk altogether. For instance, this
+    // counts the literals that aren't part of a multiplication.
+    class LiteralCounter : public value::Walker {
+    public:
+        int count = 0;
+
+    protected:
+        value::WalkAction pre(value::Node &node) override {
+            if (node.as_mul()) {
+                return value::WalkAction::SKIP;
+            }
+            if (node.as_literal()) {
+                count++;
+            }
+            return value::WalkAction::CONTINUE;
+        }
+    };
+    LiteralCounter counter{};
+    ASSERT(counter.walk(*expr));
+    ASSERT(counter.count == 1);
+    MARKER
+
+    // Finally, for quick checks where a visitor would be overkill, every node
+    // has ``is_*()`` and ``as_*()`` functions for all node types. These don't
+    // need ``dynamic_cast``: the node types are numbered such that the ones
+    // derived from any class form a contiguous range, so a check is just a
+    // comparison of ``type()`` against that range. ``match()`` does this for
+    // several classes at once, returning the index of the first one that
+    // matches or -1, which is convenient in ``switch`` statements.
+    ASSERT(expr->is_binop());
+    ASSERT(!expr->is_literal());
+    ASSERT(expr->as_rvalue() != nullptr);
+    ASSERT(expr->rhs->as_literal() == nullptr);
+    ASSERT((value::match<value::Literal, value::Binop, value::Node>(*expr->rhs) == 1));
+    ASSERT((value::match<value::Literal, value::Binop>(erroneous) == -1));
+    MARKER
+
+    // Variable names are ``primitives::Name``s, which are interned
+    // ``tree::base::Symbol``s rather than ``std::string``s. A symbol is just
+    // a pointer to the only copy of its text, so copying a node doesn't copy
+    // its name, and comparing names (as the generated ``equals()`` does)
+    // doesn't compare the characters.
+    auto ref_a = tree::base::make<value::Reference>("x");
+    auto ref_b = tree::base::make<value::Reference>(std::string("x"));
+    ASSERT(ref_a->name == ref_b->name);
+    ASSERT(&ref_a->name.str() == &ref_b->name.str());
+    ASSERT(sizeof(primitives::Name) == sizeof(void*));
+    fmt::print("name: {}\n", ref_a->name.view());
+
+    // The serialization functions for ``Name`` defer to the ones of
+    // ``Symbol``. Within a ``tree::base::SymbolTable``, which the
+    // serialization entry points create for every file, only the first
+    // occurrence of a name carries its text; the others refer to it by
+    // index, and the deserialization entry points resolve them again.
+    std::string names{};
+    {
+        tree::base::SymbolTable symbols{};
+        tree::cbor::Writer writer{names};
+        auto map = writer.start();
+        auto first = map.append_map("first");
+        primitives::serialize(ref_a->name, first);
+        first.close();
+        auto second = map.append_map("second");
+        primitives::serialize(ref_b->name, second);
+        second.close();
+        map.close();
+    }
+    tree::cbor::Reader names_reader{names};
+    ASSERT(names_reader.as_map().at("second").as_map().at("val").as_int() == 0);
+    {
+        tree::base::SymbolTable symbols{};
+        auto first = primitives::deserialize<primitives::Name>(names_reader.as_map().at("first").as_map());
+        auto second = primitives::deserialize<primitives::Name>(names_reader.as_map().at("second").as_map());
+        ASSERT(first == ref_a->name && second == ref_a->name);
+    }
+    MARKER
+
     return 0;
 }
@@ -22,6 +22,13 @@ using Int = int;
  */
 using Str = std::string;
 
+/**
+ * Names, used to refer to variables. These occur many times in a program, so
+ * they are interned: copying and comparing them is cheap, and each distinct
+ * name is serialized only once.
+ */
+using Name = tree::base::Symbol;
+
 /**
  * Initialization function. This must be specialized for any types used as
  * primitives in a tree that are actual C primitives (int, char, bool, etc),
@@ -63,6 +70,14 @@ inline void serialize<Str>(const Str &obj, tree::cbor::MapWriter &map) {
     map.append_string("val", obj);
 }
 
+/**
+ * Serialization function for Name.
+ */
+template <>
+inline void serialize<Name>(const Name &obj, tree::cbor::MapWriter &map) {
+    obj.serialize(map);
+}
+
 /**
  * Deserialization function. This must be specialized for any types used as
  * primitives in a tree. The default implementation doesn't do anything.
@@ -88,6 +103,14 @@ inline Str deserialize<Str>(const tree::cbor::MapReader &map) {
     return map.at("val").as_string();
 }
 
+/**
+ * Deserialization function for Name.
+ */
+template <>
+inline Name deserialize<Name>(const tree::cbor::MapReader &map) {
+    return Name::deserialize(map);
+}
+
 /**
  * Source location annotation object, containing source file line numbers etc.
  */
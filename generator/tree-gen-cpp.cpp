@@ -6,11 +6,14 @@
 #include "tree-gen-cpp.hpp"
 
 #include <cctype>
+#include <cstdint>
 #include <fmt/ostream.h>
 #include <fmt/ranges.h>
-#include <fstream>
-#include <iostream>
+#include <functional>
+#include <ostream>
+#include <sstream>
 #include <string>
+#include <unordered_map>
 #include <unordered_set>
 
 
@@ -20,7 +23,7 @@ namespace tree_gen::cpp {
  * Formats a C++ docstring.
  */
 void format_doc(
-    std::ofstream &stream,
+    std::ostream &stream,
     const std::string &doc,
     const std::string &indent = "",
     const std::string &annotation = ""
@@ -69,7 +72,7 @@ void format_doc(
  * Generates the node type enumeration.
  */
 void generate_enum(
-    std::ofstream &header,
+    std::ostream &header,
     Nodes &nodes
 ) {
 
@@ -93,54 +96,266 @@ void generate_enum(
     }
     header << "};" << std::endl << std::endl;
 
+    // Print the type range structure.
+    format_doc(
+        header,
+        "Range of positions in `Node::TYPE_RANKS`, covering the node types "
+        "derived from a node class."
+    );
+    header << "struct NodeTypeRange {" << std::endl << std::endl;
+    format_doc(header, "The first position in the range.", "    ");
+    header << "    uint32_t first;" << std::endl << std::endl;
+    format_doc(header, "The position past the last one in the range.", "    ");
+    header << "    uint32_t last;" << std::endl << std::endl;
+    format_doc(header, "Returns whether the given position is in the range.", "    ");
+    header << "    constexpr bool contains(uint32_t rank) const {" << std::endl;
+    header << "        return rank >= first && rank < last;" << std::endl;
+    header << "    }" << std::endl << std::endl;
+    header << "};" << std::endl << std::endl;
+
 }
 
 /**
- * Generates an `as_<type>` function.
+ * Generates the control and work item types for the iterative walker.
  */
-void generate_typecast_function(
-    std::ofstream &header,
-    std::ofstream &source,
-    const std::string &clsname,
-    Node &into,
-    bool allowed
+void generate_walk_types(
+    std::ostream &header
 ) {
-    for (int constant = 0; constant < 2; constant++) {
-        std::string doc = "Interprets this node to a node of type "
-                          + into.title_case_name
-                          + ". Returns null if it has the wrong type.";
-        format_doc(header, doc, "    ");
-        header << "    ";
-        if (!allowed) header << "virtual ";
-        if (constant) header << "const ";
-        header << into.title_case_name << " *";
-        header << "as_" << into.snake_case_name << "()";
-        if (constant) header << " const";
-        if (allowed) header << " override";
-        header << ";" << std::endl << std::endl;
-        format_doc(source, doc);
-        if (constant) source << "const ";
-        source << into.title_case_name << " *";
-        source << clsname << "::as_" << into.snake_case_name << "()";
-        if (constant) source << " const";
-        source << " {" << std::endl;
-        if (allowed) {
-            source << "    return dynamic_cast<";
-            if (constant) source << "const ";
-            source << into.title_case_name << "*>(this);" << std::endl;
+    format_doc(header, "Control value returned by the hooks of a `Walker`.");
+    header << "enum class WalkAction {" << std::endl;
+    format_doc(header, "Continue the traversal normally.", "    ");
+    header << "    CONTINUE," << std::endl << std::endl;
+    format_doc(header, "Don't descend into the current node or field.", "    ");
+    header << "    SKIP," << std::endl << std::endl;
+    format_doc(header, "Abort the traversal.", "    ");
+    header << "    STOP" << std::endl;
+    header << "};" << std::endl << std::endl;
+
+    format_doc(header, "Work item on the explicit stack of a `Walker`.");
+    header << "struct WalkItem {" << std::endl << std::endl;
+    format_doc(header, "The kinds of work items.", "    ");
+    header << "    enum class Kind { NODE, POST, ENTER_FIELD, LEAVE_FIELD, NULL_ELEMENT };" << std::endl << std::endl;
+    format_doc(header, "What to do.", "    ");
+    header << "    Kind kind;" << std::endl << std::endl;
+    format_doc(header, "The node to walk, or the node that the field belongs to.", "    ");
+    header << "    Node *node;" << std::endl << std::endl;
+    format_doc(header, "The field index, for the field and null element items.", "    ");
+    header << "    size_t field;" << std::endl << std::endl;
+    header << "};" << std::endl << std::endl;
+
+    format_doc(header, "Explicit work stack of a `Walker`.");
+    header << "using WalkStack = std::vector<WalkItem>;" << std::endl << std::endl;
+}
+
+/**
+ * Range of pre-order positions of the leaf node types derived from a node
+ * type, keyed by title case name; see compute_type_ranges().
+ */
+using TypeRanges = std::unordered_map<std::string, std::pair<size_t, size_t>>;
+
+/**
+ * Assigns pre-order positions to the leaf node types derived from the given
+ * node type, starting at the given position, and records the range for it
+ * and all its descendants.
+ */
+void assign_type_ranges(
+    const Node &node,
+    size_t &position,
+    TypeRanges &ranges
+) {
+    auto first = position;
+    if (node.derived.empty()) {
+        position++;
+    } else {
+        for (auto &derived : node.derived) {
+            assign_type_ranges(*derived.lock(), position, ranges);
+        }
+    }
+    ranges[node.title_case_name] = std::make_pair(first, position);
+}
+
+/**
+ * Computes the pre-order positions of all leaf node types in the class
+ * hierarchy, such that the leaf types derived from any node type form a
+ * contiguous range of positions. The range for `Node` covers all of them.
+ */
+TypeRanges compute_type_ranges(Nodes &nodes) {
+    TypeRanges ranges{};
+    size_t position = 0;
+    for (auto &node : nodes) {
+        if (!node->parent) {
+            assign_type_ranges(*node, position, ranges);
+        }
+    }
+    ranges["Node"] = std::make_pair(0, position);
+    return ranges;
+}
+
+/**
+ * Generates the `is_<type>` and `as_<type>` function declarations for the
+ * node base class. The `as_<type>` functions are defined by
+ * generate_typecast_definitions() once all node types are complete.
+ */
+void generate_typecast_functions(
+    std::ostream &header,
+    Nodes &nodes,
+    const TypeRanges &ranges
+) {
+
+    // Print the position table and the range of the base class.
+    format_doc(
+        header,
+        "Position of each node type in a pre-order traversal of the class "
+        "hierarchy, indexed by `NodeType`. The node types derived from any "
+        "class form a contiguous range of positions, given by its "
+        "`TYPE_RANGE`, so type checks are integer range checks.",
+        "    "
+    );
+    header << "    static constexpr uint32_t TYPE_RANKS[] = {";
+    bool first = true;
+    for (auto &node : nodes) {
+        if (node->derived.empty()) {
+            if (!first) header << ", ";
+            header << ranges.at(node->title_case_name).first;
+            first = false;
+        }
+    }
+    header << "};" << std::endl << std::endl;
+
+    format_doc(header, "Name of each node type, indexed by `NodeType`.", "    ");
+    header << "    static constexpr const char *TYPE_NAMES[] = {";
+    first = true;
+    for (auto &node : nodes) {
+        if (node->derived.empty()) {
+            if (!first) header << ", ";
+            header << "\"" << node->title_case_name << "\"";
+            first = false;
+        }
+    }
+    header << "};" << std::endl << std::endl;
+
+    format_doc(header, "Range of `TYPE_RANKS` positions of the node types derived from this class.", "    ");
+    auto range = ranges.at("Node");
+    header << "    static constexpr NodeTypeRange TYPE_RANGE{";
+    header << range.first << ", " << range.second << "};" << std::endl << std::endl;
+
+    format_doc(header, "Returns the `TYPE_RANKS` position of the type of this node.", "    ");
+    header << "    uint32_t type_rank() const {" << std::endl;
+    header << "        return TYPE_RANKS[static_cast<size_t>(type())];" << std::endl;
+    header << "    }" << std::endl << std::endl;
+
+    for (auto &node : nodes) {
+        range = ranges.at(node->title_case_name);
+        format_doc(header, "Returns whether this node is of type " + node->title_case_name + ".", "    ");
+        header << "    bool is_" << node->snake_case_name << "() const {" << std::endl;
+        if (node->derived.empty()) {
+            header << "        return type() == NodeType::" << node->title_case_name << ";" << std::endl;
+        } else if (range.first == 0) {
+            header << "        return type_rank() < " << range.second << ";" << std::endl;
         } else {
-            source << "    return nullptr;" << std::endl;
+            header << "        auto rank = type_rank();" << std::endl;
+            header << "        return rank >= " << range.first << " && rank < " << range.second << ";" << std::endl;
         }
-        source << "}" << std::endl << std::endl;
+        header << "    }" << std::endl << std::endl;
+
+        for (int constant = 0; constant < 2; constant++) {
+            format_doc(
+                header,
+                "Interprets this node to a node of type " + node->title_case_name +
+                ". Returns null if it has the wrong type.",
+                "    "
+            );
+            header << "    ";
+            if (constant) header << "const ";
+            header << node->title_case_name << " *as_" << node->snake_case_name << "()";
+            if (constant) header << " const";
+            header << ";" << std::endl << std::endl;
+        }
+    }
+}
+
+/**
+ * Generates the inline definitions of the `as_<type>` functions of the node
+ * base class, as well as the `match()` function.
+ */
+void generate_typecast_definitions(
+    std::ostream &header,
+    Nodes &nodes
+) {
+    for (auto &node : nodes) {
+        for (int constant = 0; constant < 2; constant++) {
+            format_doc(
+                header,
+                "Interprets this node to a node of type " + node->title_case_name +
+                ". Returns null if it has the wrong type."
+            );
+            header << "inline ";
+            if (constant) header << "const ";
+            header << node->title_case_name << " *Node::as_" << node->snake_case_name << "()";
+            if (constant) header << " const";
+            header << " {" << std::endl;
+            header << "    return is_" << node->snake_case_name << "() ? static_cast<";
+            if (constant) header << "const ";
+            header << node->title_case_name << "*>(this) : nullptr;" << std::endl;
+            header << "}" << std::endl << std::endl;
+        }
+    }
+
+    format_doc(
+        header,
+        "Returns the index of the first of the given node classes that the "
+        "given node is an instance of, or -1 if there is none, such that "
+        "several node types can be told apart with a single `type()` call "
+        "and a single `switch` statement. For example, "
+        "`match<Add, Sub, Node>(node)` returns 0 for additions, 1 for "
+        "subtractions, and 2 for everything else."
+    );
+    header << "template <class... Ts>" << std::endl;
+    header << "int match(const Node &node) {" << std::endl;
+    header << "    auto rank = node.type_rank();" << std::endl;
+    header << "    int index = 0;" << std::endl;
+    header << "    bool found = ((Ts::TYPE_RANGE.contains(rank) || (index++, false)) || ...);" << std::endl;
+    header << "    return found ? index : -1;" << std::endl;
+    header << "}" << std::endl << std::endl;
+}
+
+/**
+ * Computes a 32-bit FNV-1a hash of everything that determines the layout of
+ * the compact serialization format: the leaf node types in `NodeType` order,
+ * and the names and types of their fields in declaration order.
+ */
+uint32_t compute_schema_hash(Nodes &nodes) {
+    std::ostringstream ss{};
+    for (auto &node : nodes) {
+        if (!node->derived.empty()) {
+            continue;
+        }
+        ss << node->title_case_name << "{";
+        for (const auto &field : node->all_fields()) {
+            ss << field.name << ":" << field.type << ":" << field.ext_type << ":";
+            if (field.type == Prim) {
+                ss << field.prim_type;
+            } else {
+                ss << field.node_type->title_case_name;
+            }
+            ss << ";";
+        }
+        ss << "}";
+    }
+    uint32_t hash = 2166136261u;
+    for (auto c : ss.str()) {
+        hash ^= static_cast<uint8_t>(c);
+        hash *= 16777619u;
     }
+    return hash;
 }
 
 /**
  * Generates the base class for the nodes.
  */
 void generate_base_class(
-    std::ofstream &header,
-    std::ofstream &source,
+    std::ostream &header,
+    std::ostream &source,
     Nodes &nodes,
     bool with_serdes,
     const std::string &support_ns
@@ -165,6 +380,13 @@ void generate_base_class(
     format_doc(header, "Pointer-based equality operator.", "    ");
     header << "    virtual bool operator==(const Node& rhs) const = 0;" << std::endl << std::endl;
 
+    format_doc(header,
+        "Returns a structural hash of this subtree, consistent with equals(): "
+        "nodes that are equal hash equal, so comparing hashes first lets "
+        "equality checks over many candidates fail fast. Ignores annotations "
+        "and, like equals(), identifies link targets by address.", "    ");
+    header << "    virtual size_t hash() const = 0;" << std::endl << std::endl;
+
     format_doc(header, "Pointer-based inequality operator.", "    ");
     header << "    inline bool operator!=(const Node& rhs) const {" << std::endl;
     header << "        return !(*this == rhs);" << std::endl;
@@ -174,6 +396,10 @@ void generate_base_class(
     format_doc(header, "Internal helper method for visitor pattern.", "    ");
     header << "    virtual void visit_internal(VisitorBase &visitor, void *retval=nullptr) = 0;" << std::endl << std::endl;
 
+    header << "    friend class Walker;" << std::endl << std::endl;
+    format_doc(header, "Pushes the `Walker` work items for the fields of this node, last field first.", "    ");
+    header << "    virtual void push_walk_items(WalkStack &stack) = 0;" << std::endl << std::endl;
+
     header << "public:" << std::endl << std::endl;
     format_doc(header, "Visit this object.", "    ");
     header << "    template <typename T>" << std::endl;
@@ -199,6 +425,18 @@ void generate_base_class(
     source << "    visit(dumper);" << std::endl;
     source << "}" << std::endl << std::endl;
 
+    auto doc = "Appends a debug dump of this node to the given string, limited "
+               "to the given nesting depth and number of entries per Any/Many "
+               "field, where 0 means no limit.";
+    format_doc(header, doc, "    ");
+    header << "    void dump(std::string &out, size_t max_depth=0, size_t max_width=0);" << std::endl << std::endl;
+    format_doc(source, doc);
+    source << "void Node::dump(std::string &out, size_t max_depth, size_t max_width) {" << std::endl;
+    source << "    auto dumper = Dumper(out);" << std::endl;
+    source << "    dumper.limit(max_depth, max_width);" << std::endl;
+    source << "    visit(dumper);" << std::endl;
+    source << "}" << std::endl << std::endl;
+
     format_doc(header, "Writes a JSON dump of this node to the given stream.", "    ");
     header << "    void dump_json(std::ostream &out=std::cout);\n\n";
     format_doc(source, "Writes a JSON dump of this node to the given stream.");
@@ -207,6 +445,14 @@ void generate_base_class(
     source << "    visit(dumper);\n";
     source << "}\n\n";
 
+    format_doc(header, "Appends a JSON dump of this node to the given string.", "    ");
+    header << "    void dump_json(std::string &out);\n\n";
+    format_doc(source, "Appends a JSON dump of this node to the given string.");
+    source << "void Node::dump_json(std::string &out) {\n";
+    source << "    auto dumper = JsonDumper(out);\n";
+    source << "    visit(dumper);\n";
+    source << "}\n\n";
+
     format_doc(header, "Alternate debug dump that represents links and node uniqueness via sequence number tags.", "    ");
     header << "    void dump_seq(std::ostream &out=std::cout, int indent=0);" << std::endl << std::endl;
     format_doc(source, "Alternate debug dump that represents links and node uniqueness via sequence number tags.");
@@ -227,9 +473,7 @@ void generate_base_class(
     source << "    visit(dumper);" << std::endl;
     source << "}" << std::endl << std::endl;
 
-    for (auto &node : nodes) {
-        generate_typecast_function(header, source, "Node", *node, false);
-    }
+    generate_typecast_functions(header, nodes, compute_type_ranges(nodes));
 
     if (with_serdes) {
         format_doc(header, "Serializes this node to the given map.", "    ");
@@ -239,12 +483,12 @@ void generate_base_class(
         header << "    ) const = 0;" << std::endl << std::endl;
 
         format_doc(header, "Deserializes the given node.", "    ");
-        header << "    static std::shared_ptr<Node> deserialize(" << std::endl;
+        header << "    static " << support_ns << "::base::NodePtr<Node> deserialize(" << std::endl;
         header << "         const " << support_ns << "::cbor::MapReader &map," << std::endl;
         header << "         " << support_ns << "::base::IdentifierMap &ids" << std::endl;
         header << "    );" << std::endl << std::endl;
         format_doc(source, "Deserializes the given node.");
-        source << "std::shared_ptr<Node> Node::deserialize(" << std::endl;
+        source << support_ns << "::base::NodePtr<Node> Node::deserialize(" << std::endl;
         source << "    const " << support_ns << "::cbor::MapReader &map," << std::endl;
         source << "    " << support_ns << "::base::IdentifierMap &ids" << std::endl;
         source << ") {" << std::endl;
@@ -257,6 +501,86 @@ void generate_base_class(
         }
         source << "    throw std::runtime_error(\"Schema validation failed: unexpected node type \" + type);" << std::endl;
         source << "}" << std::endl << std::endl;
+
+        format_doc(header, "Deserializes the remainder of the given node from an event reader positioned just after its `@t` key and type, which has already been read.", "    ");
+        header << "    static " << support_ns << "::base::NodePtr<Node> deserialize(" << std::endl;
+        header << "         " << support_ns << "::cbor::EventReader &reader," << std::endl;
+        header << "         " << support_ns << "::base::IdentifierMap &ids," << std::endl;
+        header << "         std::string_view type," << std::endl;
+        header << "         " << support_ns << "::base::EdgeKeys &keys" << std::endl;
+        header << "    );" << std::endl << std::endl;
+        format_doc(source, "Deserializes the remainder of the given node from an event reader positioned just after its `@t` key and type, which has already been read.");
+        source << support_ns << "::base::NodePtr<Node> Node::deserialize(" << std::endl;
+        source << "    " << support_ns << "::cbor::EventReader &reader," << std::endl;
+        source << "    " << support_ns << "::base::IdentifierMap &ids," << std::endl;
+        source << "    std::string_view type," << std::endl;
+        source << "    " << support_ns << "::base::EdgeKeys &keys" << std::endl;
+        source << ") {" << std::endl;
+        for (auto &node : nodes) {
+            if (node->derived.empty()) {
+                source << "    if (type == \"" << node->title_case_name << "\") ";
+                source << "return " << node->title_case_name << "::deserialize(reader, ids, type, keys);" << std::endl;
+            }
+        }
+        source << "    throw std::runtime_error(\"Schema validation failed: unexpected node type \" + std::string(type));" << std::endl;
+        source << "}" << std::endl << std::endl;
+
+        format_doc(header, "Hash of the tree schema, used to check that trees serialized in the compact format are read back with the same schema.", "    ");
+        header << "    static constexpr uint32_t SCHEMA_HASH = 0x" << std::hex << compute_schema_hash(nodes) << std::dec << "u;" << std::endl << std::endl;
+
+        format_doc(header, "Appends this node to the given array as a node array with the given sequence number, using the compact format.", "    ");
+        header << "    virtual void serialize_compact(" << std::endl;
+        header << "        " << support_ns << "::cbor::ArrayWriter &parent," << std::endl;
+        header << "        const " << support_ns << "::base::PointerMap &ids," << std::endl;
+        header << "        int64_t seq" << std::endl;
+        header << "    ) const = 0;" << std::endl << std::endl;
+
+        format_doc(header, "Deserializes the given node from the compact format.", "    ");
+        header << "    static " << support_ns << "::base::NodePtr<Node> deserialize_compact(" << std::endl;
+        header << "         const " << support_ns << "::cbor::ArrayReader &ar," << std::endl;
+        header << "         " << support_ns << "::base::IdentifierMap &ids" << std::endl;
+        header << "    );" << std::endl << std::endl;
+        format_doc(source, "Deserializes the given node from the compact format.");
+        source << support_ns << "::base::NodePtr<Node> Node::deserialize_compact(" << std::endl;
+        source << "    const " << support_ns << "::cbor::ArrayReader &ar," << std::endl;
+        source << "    " << support_ns << "::base::IdentifierMap &ids" << std::endl;
+        source << ") {" << std::endl;
+        source << "    auto type = ar.at(1).as_int();" << std::endl;
+        source << "    switch (static_cast<NodeType>(type)) {" << std::endl;
+        for (auto &node : nodes) {
+            if (node->derived.empty()) {
+                source << "        case NodeType::" << node->title_case_name << ": ";
+                source << "return " << node->title_case_name << "::deserialize_compact(ar, ids);" << std::endl;
+            }
+        }
+        source << "        default: break;" << std::endl;
+        source << "    }" << std::endl;
+        source << "    throw std::runtime_error(\"Schema validation failed: unexpected node type \" + std::to_string(type));" << std::endl;
+        source << "}" << std::endl << std::endl;
+
+        format_doc(header, "Deserializes the remainder of the given node from the compact format, using an event reader positioned just after the sequence number and the given type.", "    ");
+        header << "    static " << support_ns << "::base::NodePtr<Node> deserialize_compact(" << std::endl;
+        header << "         " << support_ns << "::cbor::EventReader &reader," << std::endl;
+        header << "         " << support_ns << "::base::IdentifierMap &ids," << std::endl;
+        header << "         int64_t type" << std::endl;
+        header << "    );" << std::endl << std::endl;
+        format_doc(source, "Deserializes the remainder of the given node from the compact format, using an event reader positioned just after the sequence number and the given type.");
+        source << support_ns << "::base::NodePtr<Node> Node::deserialize_compact(" << std::endl;
+        source << "    " << support_ns << "::cbor::EventReader &reader," << std::endl;
+        source << "    " << support_ns << "::base::IdentifierMap &ids," << std::endl;
+        source << "    int64_t type" << std::endl;
+        source << ") {" << std::endl;
+        source << "    switch (static_cast<NodeType>(type)) {" << std::endl;
+        for (auto &node : nodes) {
+            if (node->derived.empty()) {
+                source << "        case NodeType::" << node->title_case_name << ": ";
+                source << "return " << node->title_case_name << "::deserialize_compact(reader, ids, type);" << std::endl;
+            }
+        }
+        source << "        default: break;" << std::endl;
+        source << "    }" << std::endl;
+        source << "    throw std::runtime_error(\"Schema validation failed: unexpected node type \" + std::to_string(type));" << std::endl;
+        source << "}" << std::endl << std::endl;
     }
 
     header << "};" << std::endl << std::endl;
@@ -268,7 +592,7 @@ void generate_base_class(
  * derived from the given node class.
  */
 void generate_deserialize_mux(
-    std::ofstream &source,
+    std::ostream &source,
     Node &node
 ) {
     if (node.derived.empty()) {
@@ -281,14 +605,70 @@ void generate_deserialize_mux(
     }
 }
 
+/**
+ * Recursive function to print a muxing if statement for the event reader
+ * based deserialization of all node classes derived from the given node class.
+ */
+void generate_deserialize_stream_mux(
+    std::ostream &source,
+    Node &node
+) {
+    if (node.derived.empty()) {
+        source << "    if (type == \"" << node.title_case_name << "\") ";
+        source << "return " << node.title_case_name << "::deserialize(reader, ids, type, keys);" << std::endl;
+    } else {
+        for (auto &derived : node.derived) {
+            generate_deserialize_stream_mux(source, *(derived.lock()));
+        }
+    }
+}
+
+/**
+ * Recursive function to print the switch cases for the compact-format
+ * deserialization of all node classes derived from the given node class.
+ */
+void generate_deserialize_compact_mux(
+    std::ostream &source,
+    Node &node
+) {
+    if (node.derived.empty()) {
+        source << "        case NodeType::" << node.title_case_name << ": ";
+        source << "return " << node.title_case_name << "::deserialize_compact(ar, ids);" << std::endl;
+    } else {
+        for (auto &derived : node.derived) {
+            generate_deserialize_compact_mux(source, *(derived.lock()));
+        }
+    }
+}
+
+/**
+ * Recursive function to print the switch cases for the event reader based
+ * compact-format deserialization of all node classes derived from the given
+ * node class.
+ */
+void generate_deserialize_compact_stream_mux(
+    std::ostream &source,
+    Node &node
+) {
+    if (node.derived.empty()) {
+        source << "        case NodeType::" << node.title_case_name << ": ";
+        source << "return " << node.title_case_name << "::deserialize_compact(reader, ids, type);" << std::endl;
+    } else {
+        for (auto &derived : node.derived) {
+            generate_deserialize_compact_stream_mux(source, *(derived.lock()));
+        }
+    }
+}
+
 /**
  * Generates the class for the given node.
  */
 void generate_node_class(
-    std::ofstream &header,
-    std::ofstream &source,
+    std::ostream &header,
+    std::ostream &source,
     Specification &spec,
-    Node &node
+    Node &node,
+    const TypeRanges &ranges
 ) {
     const auto all_fields = node.all_fields();
     const auto &support_ns = spec.support_namespace;
@@ -406,57 +786,113 @@ void generate_node_class(
         source << std::endl << "{}" << std::endl << std::endl;
     }
 
-    // Print find_reachable and check_complete functions.
+    // Print the steps of the non-recursive find_reachable, check_complete,
+    // validate, and clone_edges traversals. The edges are pushed in reverse
+    // order, such that they are handled in field order, which keeps the node
+    // sequence numbers the same as for a depth-first pre-order traversal.
     if (node.derived.empty()) {
-        std::string doc = "Registers all reachable nodes with the given PointerMap.";
-        format_doc(header, doc, "    ");
-        header << "    void find_reachable(" << support_ns << "::base::PointerMap &map) const override;" << std::endl << std::endl;
-        format_doc(source, doc);
-        source << "void " << node.title_case_name;
-        source << "::find_reachable(" << support_ns << "::base::PointerMap &map) const {" << std::endl;
-        source << "    (void) map;" << std::endl;
-        for (auto &field : all_fields) {
-            auto type = (field.type == Prim) ? field.ext_type : field.type;
+        std::vector<std::string> edges{};
+        std::vector<std::string> owned{};
+        for (auto field_it = all_fields.rbegin(); field_it != all_fields.rend(); ++field_it) {
+            auto type = (field_it->type == Prim) ? field_it->ext_type : field_it->type;
             switch (type) {
                 case Maybe:
                 case One:
                 case Any:
                 case Many:
+                    owned.push_back(field_it->name);
+                    edges.push_back(field_it->name);
+                    break;
                 case OptLink:
                 case Link:
-                    source << "    " << field.name << ".find_reachable(map);" << std::endl;
+                    edges.push_back(field_it->name);
                     break;
                 default:
                     break;
             }
         }
+
+        std::string doc = "Registers this node's edges with the given PointerMap as part of find_reachable().";
+        format_doc(header, doc, "    ");
+        header << "    void find_reachable_step(" << support_ns << "::base::PointerMap &map, ConstWorkStack &stack) const override;" << std::endl << std::endl;
+        format_doc(source, doc);
+        source << "void " << node.title_case_name;
+        source << "::find_reachable_step(" << support_ns << "::base::PointerMap &map, ConstWorkStack &stack) const {" << std::endl;
+        source << "    (void) map;" << std::endl;
+        source << "    (void) stack;" << std::endl;
+        for (auto &edge : edges) {
+            source << "    stack.push_back(&" << edge << ");" << std::endl;
+        }
+        source << "}" << std::endl << std::endl;
+
+        doc = "Checks whether this `" + node.title_case_name + "` is complete/fully defined as part of check_complete().";
+        format_doc(header, doc, "    ");
+        header << "    void check_complete_step(const " << support_ns << "::base::PointerMap &map, ConstWorkStack &stack) const override;" << std::endl << std::endl;
+        format_doc(source, doc);
+        source << "void " << node.title_case_name;
+        source << "::check_complete_step(const " << support_ns << "::base::PointerMap &map, ConstWorkStack &stack) const {" << std::endl;
+        source << "    (void) map;" << std::endl;
+        source << "    (void) stack;" << std::endl;
+        if (node.is_error_marker) {
+            source << "    throw " << support_ns << "::base::NotWellFormed(\"" << node.title_case_name << " error node in tree\");" << std::endl;
+        } else {
+            for (auto &edge : edges) {
+                source << "    stack.push_back(&" << edge << ");" << std::endl;
+            }
+        }
         source << "}" << std::endl << std::endl;
 
-        doc = "Returns whether this `" + node.title_case_name + "` is complete/fully defined.";
+        doc = "Registers this node's edges with the given PointerMap and checks completeness as part of validate().";
         format_doc(header, doc, "    ");
-        header << "    void check_complete(const " << support_ns << "::base::PointerMap &map) const override;" << std::endl << std::endl;
+        header << "    void validate_step(" << support_ns << "::base::PointerMap &map, ConstWorkStack &stack) const override;" << std::endl << std::endl;
         format_doc(source, doc);
         source << "void " << node.title_case_name;
-        source << "::check_complete(const " << support_ns << "::base::PointerMap &map) const {" << std::endl;
+        source << "::validate_step(" << support_ns << "::base::PointerMap &map, ConstWorkStack &stack) const {" << std::endl;
         source << "    (void) map;" << std::endl;
+        source << "    (void) stack;" << std::endl;
         if (node.is_error_marker) {
             source << "    throw " << support_ns << "::base::NotWellFormed(\"" << node.title_case_name << " error node in tree\");" << std::endl;
         } else {
+            for (auto &edge : edges) {
+                source << "    stack.push_back(&" << edge << ");" << std::endl;
+            }
+        }
+        source << "}" << std::endl << std::endl;
+
+        doc = "Pushes the owned edges of this node as part of clone_edges(), and registers its links with the given CloneMap, if any.";
+        format_doc(header, doc, "    ");
+        header << "    void clone_step(WorkStack &stack, " << support_ns << "::base::CloneMap *copies) override;" << std::endl << std::endl;
+        format_doc(source, doc);
+        source << "void " << node.title_case_name;
+        source << "::clone_step(WorkStack &stack, " << support_ns << "::base::CloneMap *copies) {" << std::endl;
+        source << "    (void) stack;" << std::endl;
+        source << "    (void) copies;" << std::endl;
+        for (auto &edge : owned) {
+            source << "    stack.push_back(&" << edge << ");" << std::endl;
+        }
+        if (owned.size() != edges.size()) {
+            source << "    if (copies) {" << std::endl;
             for (auto &field : all_fields) {
                 auto type = (field.type == Prim) ? field.ext_type : field.type;
-                switch (type) {
-                    case Maybe:
-                    case One:
-                    case Any:
-                    case Many:
-                    case OptLink:
-                    case Link:
-                        source << "    " << field.name << ".check_complete(map);" << std::endl;
-                        break;
-                    default:
-                        break;
+                if (type == Link || type == OptLink) {
+                    source << "        copies->register_link(" << field.name << ");" << std::endl;
                 }
             }
+            source << "    }" << std::endl;
+        }
+        source << "}" << std::endl << std::endl;
+
+        doc = "Records this node and pushes its owned edges as part of measure().";
+        format_doc(header, doc, "    ");
+        header << "    void measure_step(" << support_ns << "::base::MemoryUsage &usage, ConstWorkStack &stack) const override;" << std::endl << std::endl;
+        format_doc(source, doc);
+        source << "void " << node.title_case_name;
+        source << "::measure_step(" << support_ns << "::base::MemoryUsage &usage, ConstWorkStack &stack) const {" << std::endl;
+        source << "    (void) stack;" << std::endl;
+        source << "    usage.add_node(static_cast<size_t>(NodeType::" << node.title_case_name << "), sizeof(";
+        source << node.title_case_name << "), *this);" << std::endl;
+        for (auto &edge : owned) {
+            source << "    stack.push_back(&" << edge << ");" << std::endl;
         }
         source << "}" << std::endl << std::endl;
     }
@@ -479,17 +915,54 @@ void generate_node_class(
         header << "protected:" << std::endl << std::endl;
         format_doc(header, doc, "    ");
         header << "    void visit_internal(VisitorBase &visitor, void *retval) override;" << std::endl << std::endl;
-        header << "public:" << std::endl << std::endl;
         format_doc(source, doc);
         source << "void " << node.title_case_name;
         source << "::visit_internal(VisitorBase &visitor, void *retval) {" << std::endl;
         source << "    visitor.raw_visit_" << node.snake_case_name;
         source << "(*this, retval);" << std::endl;
         source << "}" << std::endl << std::endl;
+
+        doc = "Pushes the `Walker` work items for the fields of this node, last field first.";
+        format_doc(header, doc, "    ");
+        header << "    void push_walk_items(WalkStack &stack) override;" << std::endl << std::endl;
+        header << "public:" << std::endl << std::endl;
+        format_doc(source, doc);
+        source << "void " << node.title_case_name;
+        source << "::push_walk_items(WalkStack &stack) {" << std::endl;
+        source << "    (void) stack;" << std::endl;
+        for (size_t index = all_fields.size(); index-- > 0;) {
+            auto &field = all_fields[index];
+            source << "    stack.push_back({WalkItem::Kind::LEAVE_FIELD, this, " << index << "});" << std::endl;
+            switch (field.type) {
+                case Maybe:
+                case One:
+                    source << "    if (!" << field.name << ".empty()) {" << std::endl;
+                    source << "        stack.push_back({WalkItem::Kind::NODE, " << field.name << ".get_ptr().get(), 0});" << std::endl;
+                    source << "    }" << std::endl;
+                    break;
+                case Any:
+                case Many:
+                    source << "    for (auto it = " << field.name << ".get_vec().rbegin(); it != " << field.name << ".get_vec().rend(); ++it) {" << std::endl;
+                    source << "        if (it->empty()) {" << std::endl;
+                    source << "            stack.push_back({WalkItem::Kind::NULL_ELEMENT, this, " << index << "});" << std::endl;
+                    source << "        } else {" << std::endl;
+                    source << "            stack.push_back({WalkItem::Kind::NODE, it->get_ptr().get(), 0});" << std::endl;
+                    source << "        }" << std::endl;
+                    source << "    }" << std::endl;
+                    break;
+                default:
+                    break;
+            }
+            source << "    stack.push_back({WalkItem::Kind::ENTER_FIELD, this, " << index << "});" << std::endl;
+        }
+        source << "}" << std::endl << std::endl;
     }
 
-    // Print conversion function.
-    generate_typecast_function(header, source, node.title_case_name, node, true);
+    // Print the type range.
+    auto range = ranges.at(node.title_case_name);
+    format_doc(header, "Range of `TYPE_RANKS` positions of the node types derived from this class.", "    ");
+    header << "    static constexpr NodeTypeRange TYPE_RANGE{";
+    header << range.first << ", " << range.second << "};" << std::endl << std::endl;
 
     // Print copy method.
     if (node.derived.empty()) {
@@ -520,12 +993,7 @@ void generate_node_class(
             source << spec.tree_namespace << "::";
         }
         source << "make<" << node.title_case_name << ">(*this);" << std::endl;
-        for (auto &field : all_fields) {
-            auto type = (field.type == Prim) ? field.ext_type : field.type;
-            if (type == Maybe || type == One || type == Any || type == Many) {
-                source << "    node->" << field.name << " = this->" << field.name << ".clone();" << std::endl;
-            }
-        }
+        source << "    node->clone_edges();" << std::endl;
         source << "    return node;" << std::endl;
         source << "}" << std::endl << std::endl;
     }
@@ -540,7 +1008,7 @@ void generate_node_class(
         source << "::equals(const Node &rhs) const {" << std::endl;
         source << "    if (rhs.type() != NodeType::" << node.title_case_name << ") return false;" << std::endl;
         if (!all_fields.empty()) {
-            source << "    auto rhsc = dynamic_cast<const " << node.title_case_name << "&>(rhs);" << std::endl;
+            source << "    const auto &rhsc = static_cast<const " << node.title_case_name << "&>(rhs);" << std::endl;
             for (auto &field : all_fields) {
                 if (field.type == Prim && field.ext_type == Prim) {
                     source << "    if (this->" << field.name << " != rhsc." << field.name << ") return false;" << std::endl;
@@ -560,13 +1028,31 @@ void generate_node_class(
         source << "::operator==(const Node &rhs) const {" << std::endl;
         source << "    if (rhs.type() != NodeType::" << node.title_case_name << ") return false;" << std::endl;
         if (!all_fields.empty()) {
-            source << "    auto rhsc = dynamic_cast<const " << node.title_case_name << "&>(rhs);" << std::endl;
+            source << "    const auto &rhsc = static_cast<const " << node.title_case_name << "&>(rhs);" << std::endl;
             for (auto &field : all_fields) {
                 source << "    if (this->" << field.name << " != rhsc." << field.name << ") return false;" << std::endl;
             }
         }
         source << "    return true;" << std::endl;
         source << "}" << std::endl << std::endl;
+
+        doc = "Returns a structural hash of this subtree, consistent with equals().";
+        format_doc(header, doc, "    ");
+        header << "    size_t hash() const override;" << std::endl << std::endl;
+        format_doc(source, doc);
+        source << "size_t " << node.title_case_name;
+        source << "::hash() const {" << std::endl;
+        source << "    size_t seed = static_cast<size_t>(NodeType::" << node.title_case_name << ");" << std::endl;
+        for (auto &field : all_fields) {
+            if (field.type == Prim && field.ext_type == Prim) {
+                source << "    " << support_ns << "::base::hash_combine(seed, ";
+                source << support_ns << "::base::Hash<" << field.prim_type << ">()(this->" << field.name << "));" << std::endl;
+            } else {
+                source << "    " << support_ns << "::base::hash_combine(seed, this->" << field.name << ".hash());" << std::endl;
+            }
+        }
+        source << "    return seed;" << std::endl;
+        source << "}" << std::endl << std::endl;
     }
 
     // Print serdes methods.
@@ -604,27 +1090,37 @@ void generate_node_class(
             source << "}" << std::endl << std::endl;
 
             format_doc(header, "Deserializes the given node.", "    ");
-            header << "    static std::shared_ptr<" << node.title_case_name << "> ";
+            header << "    static " << support_ns << "::base::NodePtr<" << node.title_case_name << "> ";
             header << "deserialize(const " << support_ns << "::cbor::MapReader &map, " << support_ns << "::base::IdentifierMap &ids);" << std::endl << std::endl;
             format_doc(source, "Deserializes the given node.");
-            source << "std::shared_ptr<" << node.title_case_name << "> ";
+            source << support_ns << "::base::NodePtr<" << node.title_case_name << "> ";
             source << node.title_case_name << "::deserialize(const " << support_ns << "::cbor::MapReader &map, " << support_ns << "::base::IdentifierMap &ids) {" << std::endl;
             source << "    (void) ids;" << std::endl;
-            source << "    auto type = map.at(\"@t\").as_string();" << std::endl;
+            source << "    auto it = map.begin();" << std::endl;
+            source << "    auto type = map.at(\"@t\", it).as_string();" << std::endl;
             source << "    if (type != \"" << node.title_case_name << "\") {" << std::endl;
             source << "        throw std::runtime_error(\"Schema validation failed: unexpected node type \" + type);" << std::endl;
             source << "    }" << std::endl;
-            source << "    auto node = std::make_shared<" << node.title_case_name << ">(" << std::endl;
+
+            // Look up the submaps for all fields in the order in which
+            // serialize() writes them, so the iterator hint makes each lookup
+            // take constant time. The fields must also be read in that order,
+            // since symbol tables and back-references to shared subtrees
+            // refer to what was read before, so they are assigned one by one
+            // rather than passed to the constructor, of which the argument
+            // evaluation order is unspecified.
+            for (const auto &field : all_fields) {
+                source << "    auto " << field.name << "_map = ";
+                source << "map.at(\"" << field.name << "\", it).as_map();" << std::endl;
+            }
+            source << "    auto node = ";
+            if (!spec.tree_namespace.empty()) {
+                source << spec.tree_namespace << "::";
+            }
+            source << "allocate<" << node.title_case_name << ">();" << std::endl;
             std::vector<Field> links{};
-            first = true;
             for (const auto &field : all_fields) {
-                if (first) {
-                    first = false;
-                } else {
-                    source << "," << std::endl;
-                }
-                source << "        ";
-
+                source << "    node->" << field.name << " = ";
                 EdgeType type = (field.type != Prim) ? field.type : field.ext_type;
                 if (field.type != Prim) {
                     switch (field.type) {
@@ -637,20 +1133,18 @@ void generate_node_class(
                         default:      source << "<?>"; break;
                     }
                     source << "<" << field.node_type->title_case_name << ">(";
-                    source << "map.at(\"" << field.name << "\").as_map(), ids)";
+                    source << field.name << "_map, ids);" << std::endl;
                 } else if (field.ext_type != Prim) {
                     source << field.prim_type << "(";
-                    source << "map.at(\"" << field.name << "\").as_map(), ids)";
+                    source << field.name << "_map, ids);" << std::endl;
                 } else {
                     source << spec.deserialize_fn << "<" << field.prim_type << ">";
-                    source << "(map.at(\"" << field.name << "\").as_map())";
+                    source << "(" << field.name << "_map);" << std::endl;
                 }
                 if (type == OptLink || type == Link) {
                     links.push_back(field);
                 }
             }
-            source << std::endl;
-            source << "    );" << std::endl;
             first = true;
             for (const auto &link : links) {
                 source << "    ";
@@ -658,7 +1152,7 @@ void generate_node_class(
                     first = false;
                     source << "auto ";
                 }
-                source << "link = map.at(\"" << link.name << "\").as_map().at(\"@l\");" << std::endl;
+                source << "link = " << link.name << "_map.at(\"@l\");" << std::endl;
                 source << "    if (!link.is_null()) {" << std::endl;
                 source << "        ids.register_link(node->" << link.name << ", link.as_int());" << std::endl;
                 source << "    }" << std::endl;
@@ -666,12 +1160,303 @@ void generate_node_class(
             source << "    node->deserialize_annotations(map);" << std::endl;
             source << "    return node;" << std::endl;
             source << "}" << std::endl << std::endl;
+
+            format_doc(header, "Deserializes the remainder of the given node from an event reader positioned just after its `@t` key and type, which has already been read.", "    ");
+            header << "    static " << support_ns << "::base::NodePtr<" << node.title_case_name << "> ";
+            header << "deserialize(" << support_ns << "::cbor::EventReader &reader, " << support_ns << "::base::IdentifierMap &ids, std::string_view type, " << support_ns << "::base::EdgeKeys &keys);" << std::endl << std::endl;
+            format_doc(source, "Deserializes the remainder of the given node from an event reader positioned just after its `@t` key and type, which has already been read.");
+            source << support_ns << "::base::NodePtr<" << node.title_case_name << "> ";
+            source << node.title_case_name << "::deserialize(" << support_ns << "::cbor::EventReader &reader, " << support_ns << "::base::IdentifierMap &ids, std::string_view type, " << support_ns << "::base::EdgeKeys &keys) {" << std::endl;
+            source << "    (void) ids;" << std::endl;
+            source << "    if (type != \"" << node.title_case_name << "\") {" << std::endl;
+            source << "        throw std::runtime_error(\"Schema validation failed: unexpected node type \" + std::string(type));" << std::endl;
+            source << "    }" << std::endl;
+            source << "    auto node = ";
+            if (!spec.tree_namespace.empty()) {
+                source << spec.tree_namespace << "::";
+            }
+            source << "allocate<" << node.title_case_name << ">();" << std::endl;
+
+            // Read the keys in whatever order they appear in. Note that the
+            // key is only valid until the next read, so each value must be
+            // read only after the key has been compared.
+            source << "    size_t fields = 0;" << std::endl;
+            source << "    while (!reader.at_end()) {" << std::endl;
+            source << "        auto key = reader.read_key();" << std::endl;
+            source << "        ";
+            for (const auto &field : all_fields) {
+                source << "if (key == \"" << field.name << "\") {" << std::endl;
+                if (field.type != Prim) {
+                    source << "            node->" << field.name << ".deserialize(reader, ids);" << std::endl;
+                } else if (field.ext_type != Prim) {
+                    source << "            node->" << field.name << " = " << field.prim_type << "(reader.read_item().as_map(), ids);" << std::endl;
+                } else {
+                    source << "            node->" << field.name << " = " << spec.deserialize_fn << "<" << field.prim_type << ">";
+                    source << "(reader.read_item().as_map());" << std::endl;
+                }
+                source << "            fields++;" << std::endl;
+                source << "        } else ";
+            }
+            source << "if (!keys.read(key, reader) && !node->deserialize_annotation(key, reader)) {" << std::endl;
+            source << "            reader.skip();" << std::endl;
+            source << "        }" << std::endl;
+            source << "    }" << std::endl;
+            source << "    reader.read_end();" << std::endl;
+            source << "    if (fields != " << all_fields.size() << ") {" << std::endl;
+            source << "        throw std::runtime_error(\"Schema validation failed: missing or duplicate field in " << node.title_case_name << "\");" << std::endl;
+            source << "    }" << std::endl;
+            source << "    return node;" << std::endl;
+            source << "}" << std::endl << std::endl;
+
+            format_doc(header, "Serializes this node to the given array, using the compact format.", "    ");
+            header << "    void serialize_compact(" << std::endl;
+            header << "        " << support_ns << "::cbor::ArrayWriter &parent," << std::endl;
+            header << "        const " << support_ns << "::base::PointerMap &ids," << std::endl;
+            header << "        int64_t seq" << std::endl;
+            header << "    ) const override;" << std::endl << std::endl;
+            format_doc(source, "Appends this node to the given array as a node array with the given sequence number, using the compact format.");
+            source << "void " << node.title_case_name << "::serialize_compact(" << std::endl;
+            source << "    " << support_ns << "::cbor::ArrayWriter &parent," << std::endl;
+            source << "    const " << support_ns << "::base::PointerMap &ids," << std::endl;
+            source << "    int64_t seq" << std::endl;
+            source << ") const {" << std::endl;
+            source << "    (void) ids;" << std::endl;
+            source << "    auto ar = parent.append_array(" << (all_fields.size() + 3) << ");" << std::endl;
+            source << "    ar.append_int(seq);" << std::endl;
+            source << "    ar.append_int(static_cast<int64_t>(NodeType::" << node.title_case_name << "));" << std::endl;
+            first = true;
+            for (const auto &field : all_fields) {
+                if (field.type != Prim) {
+                    source << "    " << field.name << ".serialize_compact(ar, ids);" << std::endl;
+                    continue;
+                }
+                source << "    ";
+                if (first) {
+                    source << "auto ";
+                    first = false;
+                }
+                source << "submap = ar.append_map();" << std::endl;
+                if (field.ext_type == Prim) {
+                    source << "    " << spec.serialize_fn << "<" << field.prim_type << ">";
+                    source << "(" << field.name << ", submap);" << std::endl;
+                } else {
+                    source << "    " << field.name << ".serialize(submap, ids);" << std::endl;
+                }
+                source << "    submap.close();" << std::endl;
+            }
+            source << "    serialize_annotations_compact(ar);" << std::endl;
+            source << "    ar.close();" << std::endl;
+            source << "}" << std::endl << std::endl;
+
+            format_doc(header, "Deserializes the given node from the compact format.", "    ");
+            header << "    static " << support_ns << "::base::NodePtr<" << node.title_case_name << "> ";
+            header << "deserialize_compact(const " << support_ns << "::cbor::ArrayReader &ar, " << support_ns << "::base::IdentifierMap &ids);" << std::endl << std::endl;
+            format_doc(source, "Deserializes the given node from the compact format.");
+            source << support_ns << "::base::NodePtr<" << node.title_case_name << "> ";
+            source << node.title_case_name << "::deserialize_compact(const " << support_ns << "::cbor::ArrayReader &ar, " << support_ns << "::base::IdentifierMap &ids) {" << std::endl;
+            source << "    (void) ids;" << std::endl;
+            source << "    auto it = ar.begin();" << std::endl;
+            source << "    ++it;" << std::endl;
+            source << "    if (it->as_int() != static_cast<int64_t>(NodeType::" << node.title_case_name << ")) {" << std::endl;
+            source << "        throw std::runtime_error(\"Schema validation failed: unexpected node type \" + std::to_string(it->as_int()));" << std::endl;
+            source << "    }" << std::endl;
+            source << "    auto node = ";
+            if (!spec.tree_namespace.empty()) {
+                source << spec.tree_namespace << "::";
+            }
+            source << "allocate<" << node.title_case_name << ">();" << std::endl;
+            for (const auto &field : all_fields) {
+                source << "    ++it;" << std::endl;
+                EdgeType type = (field.type != Prim) ? field.type : field.ext_type;
+                if (type == OptLink || type == Link) {
+                    source << "    if (!it->is_null()) {" << std::endl;
+                    source << "        ids.register_link(node->" << field.name << ", it->as_int());" << std::endl;
+                    source << "    }" << std::endl;
+                } else if (field.type != Prim) {
+                    source << "    node->" << field.name << ".deserialize_compact(*it, ids);" << std::endl;
+                } else if (field.ext_type != Prim) {
+                    source << "    node->" << field.name << " = " << field.prim_type << "(it->as_map(), ids);" << std::endl;
+                } else {
+                    source << "    node->" << field.name << " = " << spec.deserialize_fn << "<" << field.prim_type << ">";
+                    source << "(it->as_map());" << std::endl;
+                }
+            }
+            source << "    ++it;" << std::endl;
+            source << "    node->deserialize_annotations(it->as_map());" << std::endl;
+            source << "    return node;" << std::endl;
+            source << "}" << std::endl << std::endl;
+
+            format_doc(header, "Deserializes the remainder of the given node from the compact format, using an event reader positioned just after the sequence number and the given type.", "    ");
+            header << "    static " << support_ns << "::base::NodePtr<" << node.title_case_name << "> ";
+            header << "deserialize_compact(" << support_ns << "::cbor::EventReader &reader, " << support_ns << "::base::IdentifierMap &ids, int64_t type);" << std::endl << std::endl;
+            format_doc(source, "Deserializes the remainder of the given node from the compact format, using an event reader positioned just after the sequence number and the given type.");
+            source << support_ns << "::base::NodePtr<" << node.title_case_name << "> ";
+            source << node.title_case_name << "::deserialize_compact(" << support_ns << "::cbor::EventReader &reader, " << support_ns << "::base::IdentifierMap &ids, int64_t type) {" << std::endl;
+            source << "    (void) ids;" << std::endl;
+            source << "    if (type != static_cast<int64_t>(NodeType::" << node.title_case_name << ")) {" << std::endl;
+            source << "        throw std::runtime_error(\"Schema validation failed: unexpected node type \" + std::to_string(type));" << std::endl;
+            source << "    }" << std::endl;
+            source << "    auto node = ";
+            if (!spec.tree_namespace.empty()) {
+                source << spec.tree_namespace << "::";
+            }
+            source << "allocate<" << node.title_case_name << ">();" << std::endl;
+            for (const auto &field : all_fields) {
+                EdgeType type = (field.type != Prim) ? field.type : field.ext_type;
+                if (type == OptLink || type == Link) {
+                    source << "    if (reader.at_null()) {" << std::endl;
+                    source << "        reader.read_null();" << std::endl;
+                    source << "    } else {" << std::endl;
+                    source << "        ids.register_link(node->" << field.name << ", reader.read_int());" << std::endl;
+                    source << "    }" << std::endl;
+                } else if (field.type != Prim) {
+                    source << "    node->" << field.name << ".deserialize_compact(reader, ids);" << std::endl;
+                } else if (field.ext_type != Prim) {
+                    source << "    node->" << field.name << " = " << field.prim_type << "(reader.read_item().as_map(), ids);" << std::endl;
+                } else {
+                    source << "    node->" << field.name << " = " << spec.deserialize_fn << "<" << field.prim_type << ">";
+                    source << "(reader.read_item().as_map());" << std::endl;
+                }
+            }
+            source << "    node->deserialize_annotations(reader.read_item().as_map());" << std::endl;
+            source << "    reader.read_end();" << std::endl;
+            source << "    return node;" << std::endl;
+            source << "}" << std::endl << std::endl;
+
+            // Print the functions for diff() and apply_patch(). Fields are
+            // numbered in constructor argument order, as for the Walker.
+            auto doc = "Compares the fields of this node with those of the given node of the same type as part of `diff()`, or only records its edges and links if the given node is null.";
+            format_doc(header, doc, "    ");
+            header << "    void diff_step(const " << support_ns << "::base::Completable *old, " << support_ns << "::base::TreeDiff &diff) const override;" << std::endl << std::endl;
+            format_doc(source, doc);
+            source << "void " << node.title_case_name << "::diff_step(const " << support_ns << "::base::Completable *old, " << support_ns << "::base::TreeDiff &diff) const {" << std::endl;
+            source << "    (void) diff;" << std::endl;
+            source << "    auto oldc = static_cast<const " << node.title_case_name << "*>(old);" << std::endl;
+            source << "    (void) oldc;" << std::endl;
+            for (size_t index = 0; index < all_fields.size(); index++) {
+                const auto &field = all_fields[index];
+                if (field.type != Prim) {
+                    source << "    diff.compare(" << index << ", oldc ? &oldc->" << field.name << " : nullptr, this->" << field.name << ");" << std::endl;
+                } else if (field.ext_type != Prim) {
+                    source << "    if (oldc && !this->" << field.name << ".equals(oldc->" << field.name << ")) {" << std::endl;
+                    source << "        diff.set(" << index << ", [this, &diff](" << support_ns << "::cbor::MapWriter &map) {" << std::endl;
+                    source << "            this->" << field.name << ".serialize(map, diff.get_ids());" << std::endl;
+                    source << "        });" << std::endl;
+                    source << "    }" << std::endl;
+                } else {
+                    source << "    if (oldc && this->" << field.name << " != oldc->" << field.name << ") {" << std::endl;
+                    source << "        diff.set(" << index << ", [this](" << support_ns << "::cbor::MapWriter &map) {" << std::endl;
+                    source << "            " << spec.serialize_fn << "<" << field.prim_type << ">(this->" << field.name << ", map);" << std::endl;
+                    source << "        });" << std::endl;
+                    source << "    }" << std::endl;
+                }
+            }
+            source << "}" << std::endl << std::endl;
+
+            // Prints the switch over the fields of the given kinds for the
+            // patch functions below, falling back to the Completable
+            // implementation, which throws.
+            auto patch_switch = [&](
+                bool edges, bool links, bool prims,
+                const std::function<void(const Field&)> &body,
+                const std::string &fallback
+            ) {
+                bool any = false;
+                for (size_t index = 0; index < all_fields.size(); index++) {
+                    const auto &field = all_fields[index];
+                    EdgeType type = (field.type != Prim) ? field.type : field.ext_type;
+                    bool is_link = field.type != Prim && (type == OptLink || type == Link);
+                    bool is_edge = field.type != Prim && !is_link;
+                    if (!(is_link ? links : is_edge ? edges : prims)) {
+                        continue;
+                    }
+                    if (!any) {
+                        source << "    switch (field) {" << std::endl;
+                        any = true;
+                    }
+                    source << "        case " << index << ":" << std::endl;
+                    body(field);
+                }
+                if (any) {
+                    source << "        default:" << std::endl;
+                    source << "            " << fallback << std::endl;
+                    source << "    }" << std::endl;
+                } else {
+                    source << "    " << fallback << std::endl;
+                }
+            };
+
+            doc = "Returns the node at the given position of the given field for `apply_patch()`, after replacing it with a mutable copy registered with `copies` if it is frozen and `copies` is non-null.";
+            format_doc(header, doc, "    ");
+            header << "    " << support_ns << "::base::Completable &patch_child(size_t field, size_t index, " << support_ns << "::base::CloneMap *copies) override;" << std::endl << std::endl;
+            format_doc(source, doc);
+            source << support_ns << "::base::Completable &" << node.title_case_name << "::patch_child(size_t field, size_t index, " << support_ns << "::base::CloneMap *copies) {" << std::endl;
+            patch_switch(true, false, false, [&](const Field &field) {
+                source << "            return this->" << field.name << ".patch_node(index, copies);" << std::endl;
+            }, "return " + support_ns + "::base::Completable::patch_child(field, index, copies);");
+            source << "}" << std::endl << std::endl;
+
+            doc = "Returns the shared pointer to the node at the given position of the given field for `apply_patch()`.";
+            format_doc(header, doc, "    ");
+            header << "    " << support_ns << "::base::NodePtr<" << support_ns << "::base::Completable> patch_target(size_t field, size_t index) const override;" << std::endl << std::endl;
+            format_doc(source, doc);
+            source << support_ns << "::base::NodePtr<" << support_ns << "::base::Completable> " << node.title_case_name << "::patch_target(size_t field, size_t index) const {" << std::endl;
+            patch_switch(true, false, false, [&](const Field &field) {
+                source << "            return this->" << field.name << ".patch_shared(index);" << std::endl;
+            }, "return " + support_ns + "::base::Completable::patch_target(field, index);");
+            source << "}" << std::endl << std::endl;
+
+            doc = "Applies an operation of a patch to the given field for `apply_patch()`.";
+            format_doc(header, doc, "    ");
+            header << "    void patch_field(" << std::endl;
+            header << "        size_t field," << std::endl;
+            header << "        " << support_ns << "::base::PatchOperation operation," << std::endl;
+            header << "        size_t index," << std::endl;
+            header << "        const " << support_ns << "::cbor::Reader *value," << std::endl;
+            header << "        " << support_ns << "::base::IdentifierMap &ids" << std::endl;
+            header << "    ) override;" << std::endl << std::endl;
+            format_doc(source, doc);
+            source << "void " << node.title_case_name << "::patch_field(" << std::endl;
+            source << "    size_t field," << std::endl;
+            source << "    " << support_ns << "::base::PatchOperation operation," << std::endl;
+            source << "    size_t index," << std::endl;
+            source << "    const " << support_ns << "::cbor::Reader *value," << std::endl;
+            source << "    " << support_ns << "::base::IdentifierMap &ids" << std::endl;
+            source << ") {" << std::endl;
+            patch_switch(true, false, true, [&](const Field &field) {
+                if (field.type != Prim) {
+                    source << "            this->" << field.name << ".patch(operation, index, value, ids);" << std::endl;
+                    source << "            return;" << std::endl;
+                    return;
+                }
+                source << "            if (operation != " << support_ns << "::base::PatchOperation::SET || !value) {" << std::endl;
+                source << "                throw " << support_ns << "::base::RuntimeError(\"Invalid patch: unsupported operation on a primitive field\");" << std::endl;
+                source << "            }" << std::endl;
+                if (field.ext_type != Prim) {
+                    source << "            this->" << field.name << " = " << field.prim_type << "(value->as_map(), ids);" << std::endl;
+                } else {
+                    source << "            this->" << field.name << " = " << spec.deserialize_fn << "<" << field.prim_type << ">(value->as_map());" << std::endl;
+                }
+                source << "            return;" << std::endl;
+            }, support_ns + "::base::Completable::patch_field(field, operation, index, value, ids);");
+            source << "}" << std::endl << std::endl;
+
+            doc = "Redirects the given link field to the given node, or empties it, for `apply_patch()`.";
+            format_doc(header, doc, "    ");
+            header << "    void patch_link(size_t field, const " << support_ns << "::base::NodePtr<" << support_ns << "::base::Completable> &node) override;" << std::endl << std::endl;
+            format_doc(source, doc);
+            source << "void " << node.title_case_name << "::patch_link(size_t field, const " << support_ns << "::base::NodePtr<" << support_ns << "::base::Completable> &node) {" << std::endl;
+            patch_switch(false, true, false, [&](const Field &field) {
+                source << "            this->" << field.name << ".patch(node);" << std::endl;
+                source << "            return;" << std::endl;
+            }, support_ns + "::base::Completable::patch_link(field, node);");
+            source << "}" << std::endl << std::endl;
         } else {
             format_doc(header, "Deserializes the given node.", "    ");
-            header << "    static std::shared_ptr<" << node.title_case_name << "> ";
+            header << "    static " << support_ns << "::base::NodePtr<" << node.title_case_name << "> ";
             header << "deserialize(const " << support_ns << "::cbor::MapReader &map, " << support_ns << "::base::IdentifierMap &ids);" << std::endl << std::endl;
             format_doc(source, "Deserializes the given node.");
-            source << "std::shared_ptr<" << node.title_case_name << "> ";
+            source << support_ns << "::base::NodePtr<" << node.title_case_name << "> ";
             source << node.title_case_name << "::deserialize(const " << support_ns << "::cbor::MapReader &map, " << support_ns << "::base::IdentifierMap &ids) {" << std::endl;
             source << "    auto type = map.at(\"@t\").as_string();" << std::endl;
             for (auto &derived : node.derived) {
@@ -679,6 +1464,49 @@ void generate_node_class(
             }
             source << "    throw std::runtime_error(\"Schema validation failed: unexpected node type \" + type);" << std::endl;
             source << "}" << std::endl << std::endl;
+
+            format_doc(header, "Deserializes the given node from the compact format.", "    ");
+            header << "    static " << support_ns << "::base::NodePtr<" << node.title_case_name << "> ";
+            header << "deserialize_compact(const " << support_ns << "::cbor::ArrayReader &ar, " << support_ns << "::base::IdentifierMap &ids);" << std::endl << std::endl;
+            format_doc(source, "Deserializes the given node from the compact format.");
+            source << support_ns << "::base::NodePtr<" << node.title_case_name << "> ";
+            source << node.title_case_name << "::deserialize_compact(const " << support_ns << "::cbor::ArrayReader &ar, " << support_ns << "::base::IdentifierMap &ids) {" << std::endl;
+            source << "    auto type = ar.at(1).as_int();" << std::endl;
+            source << "    switch (static_cast<NodeType>(type)) {" << std::endl;
+            for (auto &derived : node.derived) {
+                generate_deserialize_compact_mux(source, *(derived.lock()));
+            }
+            source << "        default: break;" << std::endl;
+            source << "    }" << std::endl;
+            source << "    throw std::runtime_error(\"Schema validation failed: unexpected node type \" + std::to_string(type));" << std::endl;
+            source << "}" << std::endl << std::endl;
+
+            format_doc(header, "Deserializes the remainder of the given node from an event reader positioned just after its `@t` key and type, which has already been read.", "    ");
+            header << "    static " << support_ns << "::base::NodePtr<" << node.title_case_name << "> ";
+            header << "deserialize(" << support_ns << "::cbor::EventReader &reader, " << support_ns << "::base::IdentifierMap &ids, std::string_view type, " << support_ns << "::base::EdgeKeys &keys);" << std::endl << std::endl;
+            format_doc(source, "Deserializes the remainder of the given node from an event reader positioned just after its `@t` key and type, which has already been read.");
+            source << support_ns << "::base::NodePtr<" << node.title_case_name << "> ";
+            source << node.title_case_name << "::deserialize(" << support_ns << "::cbor::EventReader &reader, " << support_ns << "::base::IdentifierMap &ids, std::string_view type, " << support_ns << "::base::EdgeKeys &keys) {" << std::endl;
+            for (auto &derived : node.derived) {
+                generate_deserialize_stream_mux(source, *(derived.lock()));
+            }
+            source << "    throw std::runtime_error(\"Schema validation failed: unexpected node type \" + std::string(type));" << std::endl;
+            source << "}" << std::endl << std::endl;
+
+            format_doc(header, "Deserializes the remainder of the given node from the compact format, using an event reader positioned just after the sequence number and the given type.", "    ");
+            header << "    static " << support_ns << "::base::NodePtr<" << node.title_case_name << "> ";
+            header << "deserialize_compact(" << support_ns << "::cbor::EventReader &reader, " << support_ns << "::base::IdentifierMap &ids, int64_t type);" << std::endl << std::endl;
+            format_doc(source, "Deserializes the remainder of the given node from the compact format, using an event reader positioned just after the sequence number and the given type.");
+            source << support_ns << "::base::NodePtr<" << node.title_case_name << "> ";
+            source << node.title_case_name << "::deserialize_compact(" << support_ns << "::cbor::EventReader &reader, " << support_ns << "::base::IdentifierMap &ids, int64_t type) {" << std::endl;
+            source << "    switch (static_cast<NodeType>(type)) {" << std::endl;
+            for (auto &derived : node.derived) {
+                generate_deserialize_compact_stream_mux(source, *(derived.lock()));
+            }
+            source << "        default: break;" << std::endl;
+            source << "    }" << std::endl;
+            source << "    throw std::runtime_error(\"Schema validation failed: unexpected node type \" + std::to_string(type));" << std::endl;
+            source << "}" << std::endl << std::endl;
         }
     }
 
@@ -690,8 +1518,8 @@ void generate_node_class(
  * Generate the visitor base class.
  */
 void generate_visitor_base_class(
-    std::ofstream &header,
-    std::ofstream &source,
+    std::ostream &header,
+    std::ostream &source,
     Nodes &nodes
 ) {
     (void) source;
@@ -734,8 +1562,8 @@ void generate_visitor_base_class(
  * Generate the templated visitor class.
  */
 void generate_visitor_class(
-    std::ofstream &header,
-    std::ofstream &source,
+    std::ostream &header,
+    std::ostream &source,
     Nodes &nodes
 ) {
     // Print class header.
@@ -838,14 +1666,76 @@ void generate_visitor_class(
         source << "    this->visit_" << node->snake_case_name << "(node);" << std::endl;
         source << "}" << std::endl << std::endl;
     }
+
+    // Print the class header for the statically dispatched variant.
+    format_doc(
+        header,
+        "Base class for visitors that are dispatched at compile time.\n\n"
+        "This is an alternative to `Visitor` for performance-critical code. "
+        "Derive `Derived` from `StaticVisitor<Derived, R>`, define "
+        "`visit_node()` and the node-specific visit functions you need as "
+        "public, non-virtual member functions returning `R`, and call "
+        "`visit(node)`. Only the node type is determined at runtime, by "
+        "switching on `Node::type()`; the visit functions are then resolved "
+        "at compile time, so they can be inlined. The default implementations "
+        "for the node-specific functions fall back to the more generic "
+        "functions, eventually leading to `visit_node()`, the same way they "
+        "do for `Visitor`.");
+    header << "template <class Derived, typename R = void>" << std::endl;
+    header << "class StaticVisitor {" << std::endl;
+    header << "protected:" << std::endl << std::endl;
+
+    // Access to the derived class.
+    format_doc(header, "Returns a reference to the derived visitor.", "    ");
+    header << "    Derived &derived() {" << std::endl;
+    header << "        return static_cast<Derived&>(*this);" << std::endl;
+    header << "    }" << std::endl << std::endl;
+
+    header << "public:" << std::endl << std::endl;
+
+    // Dispatch function.
+    format_doc(header, "Visits the given node with the visit function of `Derived` for its type.", "    ");
+    header << "    R visit(Node &node) {" << std::endl;
+    header << "        switch (node.type()) {" << std::endl;
+    for (auto &node : nodes) {
+        if (node->derived.empty()) {
+            header << "            case NodeType::" << node->title_case_name << ":" << std::endl;
+            header << "                return derived().visit_" << node->snake_case_name;
+            header << "(static_cast<" << node->title_case_name << "&>(node));" << std::endl;
+        }
+    }
+    header << "        }" << std::endl;
+    header << "        return derived().visit_node(node);" << std::endl;
+    header << "    }" << std::endl << std::endl;
+
+    // Default functions for all node types.
+    for (auto &node : nodes) {
+        std::string doc;
+        if (node->derived.empty()) {
+            doc = "Visitor function for `" + node->title_case_name + "` nodes.";
+        } else {
+            doc = "Fallback function for `" + node->title_case_name + "` nodes.";
+        }
+        format_doc(header, doc, "    ");
+        header << "    R visit_" << node->snake_case_name;
+        header << "(" << node->title_case_name << " &node) {" << std::endl;
+        if (node->parent) {
+            header << "        return derived().visit_" << node->parent->snake_case_name << "(node);" << std::endl;
+        } else {
+            header << "        return derived().visit_node(node);" << std::endl;
+        }
+        header << "    }" << std::endl << std::endl;
+    }
+
+    header << "};" << std::endl << std::endl;
 }
 
 /**
  * Generate the recursive visitor class.
  */
 void generate_recursive_visitor_class(
-    std::ofstream &header,
-    std::ofstream &source,
+    std::ostream &header,
+    std::ostream &source,
     Nodes &nodes
 ) {
 
@@ -855,7 +1745,8 @@ void generate_recursive_visitor_class(
         "Visitor base class defaulting to DFS pre-order traversal.\n\n"
         "The visitor functions for nodes with subnode fields default to DFS "
         "traversal in addition to falling back to more generic node types."
-        "Links and OptLinks are *not* followed."
+        "Links and OptLinks are *not* followed. The traversal recurses through "
+        "the visit functions, so use `Walker` instead for deeply nested trees."
     );
     header << "class RecursiveVisitor : public Visitor<void> {" << std::endl;
     header << "public:" << std::endl << std::endl;
@@ -887,22 +1778,653 @@ void generate_recursive_visitor_class(
     header << "};" << std::endl << std::endl;
 }
 
+/**
+ * Generate the memoizing visitor class.
+ */
+void generate_memo_visitor_class(
+    std::ostream &header,
+    const std::string &support_ns
+) {
+
+    // Print class header.
+    format_doc(
+        header,
+        "Visitor base class that caches its results per node.\n\n"
+        "Derive from this class like from `Visitor<T>`, but call `memo()` "
+        "rather than `visit()` on child nodes and link targets. The first "
+        "`memo()` call for a node visits it and stores the result in a table "
+        "indexed by its `PointerMap` sequence number; later calls return the "
+        "stored result, so shared subtrees are only visited once. The table "
+        "is cleared when a top-level `memo()` call finds that edges were "
+        "modified since it was filled, as reported by an `EdgeTracker`. "
+        "Call `invalidate()` after assigning primitive fields or destroying "
+        "visited nodes, as neither is tracked. `T` must not be void."
+    );
+    header << "template <typename T>" << std::endl;
+    header << "class MemoVisitor : public Visitor<T> {" << std::endl;
+    header << "private:" << std::endl << std::endl;
+
+    format_doc(header, "Sequence numbers of the visited nodes.", "    ");
+    header << "    " << support_ns << "::base::PointerMap ids;" << std::endl << std::endl;
+
+    format_doc(header, "The results for the visited nodes, indexed by sequence number.", "    ");
+    header << "    std::vector<T> results;" << std::endl << std::endl;
+
+    format_doc(header, "Tracker for edge modifications.", "    ");
+    header << "    " << support_ns << "::base::EdgeTracker tracker;" << std::endl << std::endl;
+
+    format_doc(header, "Generation of the tracker as of the last top-level `memo()` call.", "    ");
+    header << "    size_t generation;" << std::endl << std::endl;
+
+    format_doc(header, "Number of `memo()` calls in progress.", "    ");
+    header << "    size_t depth = 0;" << std::endl << std::endl;
+
+    header << "public:" << std::endl << std::endl;
+
+    format_doc(header, "Constructs a visitor with an empty cache.", "    ");
+    header << "    MemoVisitor() : ids(), results(), tracker(), generation(tracker.generation()) {" << std::endl;
+    header << "        ids.enable_exceptions = false;" << std::endl;
+    header << "    }" << std::endl << std::endl;
+
+    format_doc(header, "Returns the result for the given node, visiting it if there is none yet.", "    ");
+    header << "    T memo(Node &node) {" << std::endl;
+    header << "        if (!depth && tracker.generation() != generation) {" << std::endl;
+    header << "            invalidate();" << std::endl;
+    header << "        }" << std::endl;
+    header << "        auto index = ids.get_ref(node);" << std::endl;
+    header << "        if (index != " << support_ns << "::base::PointerMap::INVALID) {" << std::endl;
+    header << "            return results[index];" << std::endl;
+    header << "        }" << std::endl;
+    header << "        depth++;" << std::endl;
+    header << "        T result;" << std::endl;
+    header << "        try {" << std::endl;
+    header << "            result = node.visit(*this);" << std::endl;
+    header << "        } catch (...) {" << std::endl;
+    header << "            depth--;" << std::endl;
+    header << "            throw;" << std::endl;
+    header << "        }" << std::endl;
+    header << "        depth--;" << std::endl;
+    header << std::endl;
+    header << "        // Nodes are numbered in the order in which their results are" << std::endl;
+    header << "        // stored, so the sequence number indexes the results." << std::endl;
+    header << "        if (ids.add_ref(node) == results.size()) {" << std::endl;
+    header << "            results.push_back(result);" << std::endl;
+    header << "        }" << std::endl;
+    header << "        if (!depth) {" << std::endl;
+    header << "            generation = tracker.generation();" << std::endl;
+    header << "        }" << std::endl;
+    header << "        return result;" << std::endl;
+    header << "    }" << std::endl << std::endl;
+
+    format_doc(header, "Returns the result for the node that the given edge refers to.", "    ");
+    header << "    template <class S>" << std::endl;
+    header << "    T memo(const Maybe<S> &edge) {" << std::endl;
+    header << "        return memo(*edge);" << std::endl;
+    header << "    }" << std::endl << std::endl;
+
+    format_doc(header, "Returns the result for the node that the given link refers to.", "    ");
+    header << "    template <class S>" << std::endl;
+    header << "    T memo(const OptLink<S> &link) {" << std::endl;
+    header << "        return memo(*link);" << std::endl;
+    header << "    }" << std::endl << std::endl;
+
+    format_doc(header, "Discards all cached results.", "    ");
+    header << "    void invalidate() {" << std::endl;
+    header << "        ids = " << support_ns << "::base::PointerMap();" << std::endl;
+    header << "        ids.enable_exceptions = false;" << std::endl;
+    header << "        results.clear();" << std::endl;
+    header << "        generation = tracker.generation();" << std::endl;
+    header << "    }" << std::endl << std::endl;
+
+    format_doc(header, "Returns the number of cached results.", "    ");
+    header << "    size_t size() const {" << std::endl;
+    header << "        return results.size();" << std::endl;
+    header << "    }" << std::endl << std::endl;
+
+    header << "};" << std::endl << std::endl;
+}
+
+/**
+ * Generate the parallel map-reduce visitor class.
+ */
+void generate_parallel_reduce_visitor_class(
+    std::ostream &header,
+    const std::string &support_ns
+) {
+
+    // Print class header.
+    format_doc(
+        header,
+        "Visitor base class that visits the elements of `Any`/`Many` edges in "
+        "parallel and reduces their results.\n\n"
+        "Derive from this class like from `Visitor<T>`, override `reduce()` "
+        "with an associative function that combines two results, and call "
+        "`visit_all()` rather than visiting the elements of `Any`/`Many` "
+        "edges one by one. Edges with more elements than the grain size are "
+        "split into ranges of that size, which are visited concurrently on a "
+        "`WorkPool`; the results are reduced in order, so `reduce()` need not "
+        "be commutative. `visit_all()` may be used recursively.\n\n"
+        "The visit functions and `reduce()` are called from multiple threads "
+        "at once, so they must not modify state of the visitor or of the tree "
+        "other than that of the node being visited. Reading annotations is "
+        "safe, as each thread only reads the nodes it visits. Writing "
+        "annotations is only allowed for the node being visited, by its own "
+        "visit function: the annotations of a node belong exclusively to the "
+        "thread visiting it. This excludes shared (frozen) subtrees, which "
+        "may be visited by multiple threads at once. `T` must be "
+        "default-constructible and must not be void."
+    );
+    header << "template <typename T>" << std::endl;
+    header << "class ParallelReduceVisitor : public Visitor<T> {" << std::endl;
+    header << "private:" << std::endl << std::endl;
+
+    format_doc(header, "The pool that visits the ranges of large edges.", "    ");
+    header << "    std::shared_ptr<" << support_ns << "::base::WorkPool> pool;" << std::endl << std::endl;
+
+    format_doc(header, "The maximum number of elements visited as a single task.", "    ");
+    header << "    size_t grain;" << std::endl << std::endl;
+
+    header << "public:" << std::endl << std::endl;
+
+    format_doc(header, "Constructs a visitor with its own pool of the given number of threads (zero for one per hardware thread), visiting ranges of the given number of elements as single tasks.", "    ");
+    header << "    explicit ParallelReduceVisitor(size_t threads = 0, size_t grain = 64) :" << std::endl;
+    header << "        pool(std::make_shared<" << support_ns << "::base::WorkPool>(threads))," << std::endl;
+    header << "        grain(grain ? grain : 1)" << std::endl;
+    header << "    {}" << std::endl << std::endl;
+
+    format_doc(header, "Constructs a visitor that shares the given pool, visiting ranges of the given number of elements as single tasks.", "    ");
+    header << "    ParallelReduceVisitor(std::shared_ptr<" << support_ns << "::base::WorkPool> pool, size_t grain = 64) :" << std::endl;
+    header << "        pool(std::move(pool))," << std::endl;
+    header << "        grain(grain ? grain : 1)" << std::endl;
+    header << "    {}" << std::endl << std::endl;
+
+    format_doc(header, "Combines two results. Must be associative, and safe to call from multiple threads.", "    ");
+    header << "    virtual T reduce(T lhs, T rhs) = 0;" << std::endl << std::endl;
+
+    format_doc(header, "Visits the elements of the given edge, and returns the reduction of `init` and their results, in order.", "    ");
+    header << "    template <class S>" << std::endl;
+    header << "    T visit_all(Any<S> &edge, T init = T()) {" << std::endl;
+    header << "        auto count = edge.size();" << std::endl;
+    header << "        if (count <= grain || pool->size() < 2) {" << std::endl;
+    header << "            for (size_t i = 0; i < count; i++) {" << std::endl;
+    header << "                init = reduce(std::move(init), edge.at(i)->visit(*this));" << std::endl;
+    header << "            }" << std::endl;
+    header << "            return init;" << std::endl;
+    header << "        }" << std::endl;
+    header << "        std::vector<T> results((count + grain - 1) / grain);" << std::endl;
+    header << "        pool->parallel_for(results.size(), 1, [&](size_t begin, size_t end) {" << std::endl;
+    header << "            for (size_t range = begin; range < end; range++) {" << std::endl;
+    header << "                auto first = range * grain;" << std::endl;
+    header << "                auto last = std::min(count, first + grain);" << std::endl;
+    header << "                T result = edge.at(first)->visit(*this);" << std::endl;
+    header << "                for (size_t i = first + 1; i < last; i++) {" << std::endl;
+    header << "                    result = reduce(std::move(result), edge.at(i)->visit(*this));" << std::endl;
+    header << "                }" << std::endl;
+    header << "                results[range] = std::move(result);" << std::endl;
+    header << "            }" << std::endl;
+    header << "        });" << std::endl;
+    header << "        for (auto &result : results) {" << std::endl;
+    header << "            init = reduce(std::move(init), std::move(result));" << std::endl;
+    header << "        }" << std::endl;
+    header << "        return init;" << std::endl;
+    header << "    }" << std::endl << std::endl;
+
+    format_doc(header, "Returns the pool that visits the ranges of large edges.", "    ");
+    header << "    " << support_ns << "::base::WorkPool &get_pool() const {" << std::endl;
+    header << "        return *pool;" << std::endl;
+    header << "    }" << std::endl << std::endl;
+
+    format_doc(header, "Returns the maximum number of elements visited as a single task.", "    ");
+    header << "    size_t get_grain() const {" << std::endl;
+    header << "        return grain;" << std::endl;
+    header << "    }" << std::endl << std::endl;
+
+    header << "};" << std::endl << std::endl;
+}
+
+/**
+ * Generate the iterative walker class.
+ */
+void generate_walker_class(
+    std::ostream &header,
+    std::ostream &source
+) {
+
+    // Print class header.
+    format_doc(
+        header,
+        "Visitor base class for non-recursive DFS traversal.\n\n"
+        "Unlike RecursiveVisitor, the traversal is driven by an explicit work "
+        "stack, so it can't overflow the call stack for deeply nested trees. "
+        "Override pre() and/or post() to operate on the nodes in pre- or "
+        "post-order, and enter_field(), leave_field(), and null_element() for "
+        "finer-grained control; all hooks can stop the traversal, and pre() "
+        "and enter_field() can skip subtrees. Links and OptLinks are *not* "
+        "followed, and neither are edges to nodes of other trees."
+    );
+    header << "class Walker : public Visitor<void> {" << std::endl;
+    header << "public:" << std::endl << std::endl;
+
+    auto doc = "Walks the subtree rooted at the given node. Returns false if a hook stopped the traversal.";
+    format_doc(header, doc, "    ");
+    header << "    bool walk(Node &root);" << std::endl << std::endl;
+    format_doc(source, doc);
+    source << "bool Walker::walk(Node &root) {" << std::endl;
+    source << "    WalkStack stack{};" << std::endl;
+    source << "    stack.push_back({WalkItem::Kind::NODE, &root, 0});" << std::endl;
+    source << "    while (!stack.empty()) {" << std::endl;
+    source << "        auto item = stack.back();" << std::endl;
+    source << "        stack.pop_back();" << std::endl;
+    source << "        auto action = WalkAction::CONTINUE;" << std::endl;
+    source << "        switch (item.kind) {" << std::endl;
+    source << "            case WalkItem::Kind::NODE:" << std::endl;
+    source << "                action = pre(*item.node);" << std::endl;
+    source << "                if (action == WalkAction::CONTINUE) {" << std::endl;
+    source << "                    stack.push_back({WalkItem::Kind::POST, item.node, 0});" << std::endl;
+    source << "                    item.node->push_walk_items(stack);" << std::endl;
+    source << "                } else if (action == WalkAction::SKIP) {" << std::endl;
+    source << "                    action = post(*item.node);" << std::endl;
+    source << "                }" << std::endl;
+    source << "                break;" << std::endl;
+    source << "            case WalkItem::Kind::POST:" << std::endl;
+    source << "                action = post(*item.node);" << std::endl;
+    source << "                break;" << std::endl;
+    source << "            case WalkItem::Kind::ENTER_FIELD:" << std::endl;
+    source << "                action = enter_field(*item.node, item.field);" << std::endl;
+    source << "                if (action == WalkAction::SKIP) {" << std::endl;
+    source << "                    // The children of this field haven't been expanded" << std::endl;
+    source << "                    // yet, so the next LEAVE_FIELD item is ours." << std::endl;
+    source << "                    while (stack.back().kind != WalkItem::Kind::LEAVE_FIELD) {" << std::endl;
+    source << "                        stack.pop_back();" << std::endl;
+    source << "                    }" << std::endl;
+    source << "                }" << std::endl;
+    source << "                break;" << std::endl;
+    source << "            case WalkItem::Kind::LEAVE_FIELD:" << std::endl;
+    source << "                action = leave_field(*item.node, item.field);" << std::endl;
+    source << "                break;" << std::endl;
+    source << "            case WalkItem::Kind::NULL_ELEMENT:" << std::endl;
+    source << "                action = null_element(*item.node, item.field);" << std::endl;
+    source << "                break;" << std::endl;
+    source << "        }" << std::endl;
+    source << "        if (action == WalkAction::STOP) {" << std::endl;
+    source << "            return false;" << std::endl;
+    source << "        }" << std::endl;
+    source << "    }" << std::endl;
+    source << "    return true;" << std::endl;
+    source << "}" << std::endl << std::endl;
+
+    doc = "Visitor entry point, such that `node.visit(walker)` walks the subtree rooted at `node`.";
+    format_doc(header, doc, "    ");
+    header << "    void visit_node(Node &node) override;" << std::endl << std::endl;
+    format_doc(source, doc);
+    source << "void Walker::visit_node(Node &node) {" << std::endl;
+    source << "    walk(node);" << std::endl;
+    source << "}" << std::endl << std::endl;
+
+    header << "protected:" << std::endl << std::endl;
+
+    doc = "Called when a node is entered. Returning SKIP prevents the "
+          "traversal from descending into its fields; post() is still called.";
+    format_doc(header, doc, "    ");
+    header << "    virtual WalkAction pre(Node &node);" << std::endl << std::endl;
+    format_doc(source, doc);
+    source << "WalkAction Walker::pre(Node &node) {" << std::endl;
+    source << "    (void) node;" << std::endl;
+    source << "    return WalkAction::CONTINUE;" << std::endl;
+    source << "}" << std::endl << std::endl;
+
+    doc = "Called when a node is left, after all its fields.";
+    format_doc(header, doc, "    ");
+    header << "    virtual WalkAction post(Node &node);" << std::endl << std::endl;
+    format_doc(source, doc);
+    source << "WalkAction Walker::post(Node &node) {" << std::endl;
+    source << "    (void) node;" << std::endl;
+    source << "    return WalkAction::CONTINUE;" << std::endl;
+    source << "}" << std::endl << std::endl;
+
+    doc = "Called for each field of a node, including primitives and links, "
+          "before the nodes it refers to are walked. Fields are numbered in "
+          "constructor argument order. Returning SKIP prevents the traversal "
+          "from descending into the field; leave_field() is still called.";
+    format_doc(header, doc, "    ");
+    header << "    virtual WalkAction enter_field(Node &node, size_t field);" << std::endl << std::endl;
+    format_doc(source, doc);
+    source << "WalkAction Walker::enter_field(Node &node, size_t field) {" << std::endl;
+    source << "    (void) node;" << std::endl;
+    source << "    (void) field;" << std::endl;
+    source << "    return WalkAction::CONTINUE;" << std::endl;
+    source << "}" << std::endl << std::endl;
+
+    doc = "Called for each field of a node after the nodes it refers to have been walked.";
+    format_doc(header, doc, "    ");
+    header << "    virtual WalkAction leave_field(Node &node, size_t field);" << std::endl << std::endl;
+    format_doc(source, doc);
+    source << "WalkAction Walker::leave_field(Node &node, size_t field) {" << std::endl;
+    source << "    (void) node;" << std::endl;
+    source << "    (void) field;" << std::endl;
+    source << "    return WalkAction::CONTINUE;" << std::endl;
+    source << "}" << std::endl << std::endl;
+
+    doc = "Called in place of pre() and post() for empty entries of Any/Many fields.";
+    format_doc(header, doc, "    ");
+    header << "    virtual WalkAction null_element(Node &node, size_t field);" << std::endl << std::endl;
+    format_doc(source, doc);
+    source << "WalkAction Walker::null_element(Node &node, size_t field) {" << std::endl;
+    source << "    (void) node;" << std::endl;
+    source << "    (void) field;" << std::endl;
+    source << "    return WalkAction::CONTINUE;" << std::endl;
+    source << "}" << std::endl << std::endl;
+
+    header << "};" << std::endl << std::endl;
+}
+
+/**
+ * Generate the parent index class.
+ */
+void generate_parent_index_class(
+    std::ostream &header,
+    std::ostream &source,
+    const std::string &support_ns
+) {
+
+    // Print class header.
+    format_doc(
+        header,
+        "Index of the parent of each node in a tree.\n\n"
+        "The index is built in a single walk over the tree when it is first "
+        "queried, after which `parent_of()`, `field_of()`, and `index_of()` "
+        "take constant time, and `path_to()` and `ancestor_of()` take time "
+        "linear in the depth of the node. The next query rebuilds the index "
+        "when edges were modified since it was built, as reported by an "
+        "`EdgeTracker`, or after `invalidate()`. Frozen nodes that appear more "
+        "than once in the tree are indexed under the first parent that refers "
+        "to them. The root node must outlive the index."
+    );
+    header << "class ParentIndex {" << std::endl;
+    header << "private:" << std::endl << std::endl;
+
+    format_doc(header, "Walker that fills the index.", "    ");
+    header << "    class Builder;" << std::endl << std::endl;
+
+    format_doc(header, "Position of an indexed node in the tree.", "    ");
+    header << "    struct Entry {" << std::endl << std::endl;
+    format_doc(header, "The parent of the node, or null for the root.", "        ");
+    header << "        Node *parent;" << std::endl << std::endl;
+    format_doc(header, "The field of the parent that refers to the node.", "        ");
+    header << "        size_t field;" << std::endl << std::endl;
+    format_doc(header, "The position of the node in the field.", "        ");
+    header << "        size_t index;" << std::endl << std::endl;
+    header << "    };" << std::endl << std::endl;
+
+    format_doc(header, "The root of the indexed tree, or null if there is none.", "    ");
+    header << "    Node *root;" << std::endl << std::endl;
+
+    format_doc(header, "Sequence numbers of the indexed nodes.", "    ");
+    header << "    " << support_ns << "::base::PointerMap ids;" << std::endl << std::endl;
+
+    format_doc(header, "The positions of the indexed nodes, indexed by sequence number.", "    ");
+    header << "    std::vector<Entry> entries;" << std::endl << std::endl;
+
+    format_doc(header, "Tracker for edge modifications.", "    ");
+    header << "    " << support_ns << "::base::EdgeTracker tracker;" << std::endl << std::endl;
+
+    format_doc(header, "Generation of the tracker as of the last build.", "    ");
+    header << "    size_t generation;" << std::endl << std::endl;
+
+    format_doc(header, "Whether the index has been built.", "    ");
+    header << "    bool built;" << std::endl << std::endl;
+
+    // Print the builder first, as it is only defined in the source.
+    format_doc(source, "Walker that records the position of each node with a `ParentIndex`.");
+    source << "class ParentIndex::Builder : public Walker {" << std::endl;
+    source << "private:" << std::endl << std::endl;
+    format_doc(source, "A node that is being walked.", "    ");
+    source << "    struct Frame {" << std::endl;
+    source << "        Node *node;" << std::endl;
+    source << "        size_t field;" << std::endl;
+    source << "        size_t next;" << std::endl;
+    source << "    };" << std::endl << std::endl;
+    format_doc(source, "The index to fill.", "    ");
+    source << "    ParentIndex &index;" << std::endl << std::endl;
+    format_doc(source, "The nodes on the path from the root to the current node.", "    ");
+    source << "    std::vector<Frame> frames;" << std::endl << std::endl;
+    source << "public:" << std::endl << std::endl;
+    format_doc(source, "Constructs a builder for the given index.", "    ");
+    source << "    explicit Builder(ParentIndex &index) : index(index), frames() {}" << std::endl << std::endl;
+    source << "protected:" << std::endl << std::endl;
+    format_doc(source, "Records the node, or skips it if it was reached before through another parent.", "    ");
+    source << "    WalkAction pre(Node &node) override {" << std::endl;
+    source << "        Entry entry{nullptr, 0, 0};" << std::endl;
+    source << "        if (!frames.empty()) {" << std::endl;
+    source << "            auto &top = frames.back();" << std::endl;
+    source << "            entry = Entry{top.node, top.field, top.next++};" << std::endl;
+    source << "        }" << std::endl;
+    source << "        frames.push_back(Frame{&node, 0, 0});" << std::endl;
+    source << "        if (index.ids.add_ref(node) != index.entries.size()) {" << std::endl;
+    source << "            return WalkAction::SKIP;" << std::endl;
+    source << "        }" << std::endl;
+    source << "        index.entries.push_back(entry);" << std::endl;
+    source << "        return WalkAction::CONTINUE;" << std::endl;
+    source << "    }" << std::endl << std::endl;
+    format_doc(source, "Leaves the node.", "    ");
+    source << "    WalkAction post(Node &node) override {" << std::endl;
+    source << "        (void) node;" << std::endl;
+    source << "        frames.pop_back();" << std::endl;
+    source << "        return WalkAction::CONTINUE;" << std::endl;
+    source << "    }" << std::endl << std::endl;
+    format_doc(source, "Starts numbering the nodes in a field.", "    ");
+    source << "    WalkAction enter_field(Node &node, size_t field) override {" << std::endl;
+    source << "        (void) node;" << std::endl;
+    source << "        frames.back().field = field;" << std::endl;
+    source << "        frames.back().next = 0;" << std::endl;
+    source << "        return WalkAction::CONTINUE;" << std::endl;
+    source << "    }" << std::endl << std::endl;
+    format_doc(source, "Counts an empty Any/Many element.", "    ");
+    source << "    WalkAction null_element(Node &node, size_t field) override {" << std::endl;
+    source << "        (void) node;" << std::endl;
+    source << "        (void) field;" << std::endl;
+    source << "        frames.back().next++;" << std::endl;
+    source << "        return WalkAction::CONTINUE;" << std::endl;
+    source << "    }" << std::endl << std::endl;
+    source << "};" << std::endl << std::endl;
+
+    auto doc = "Returns the position of the given node, building the index if needed, "
+               "or null if the node is not part of the tree.";
+    format_doc(header, doc, "    ");
+    header << "    const Entry *find(const Node &node);" << std::endl << std::endl;
+    format_doc(source, doc);
+    source << "const ParentIndex::Entry *ParentIndex::find(const Node &node) {" << std::endl;
+    source << "    if (!root) {" << std::endl;
+    source << "        return nullptr;" << std::endl;
+    source << "    }" << std::endl;
+    source << "    if (!built || tracker.generation() != generation) {" << std::endl;
+    source << "        ids = " << support_ns << "::base::PointerMap();" << std::endl;
+    source << "        ids.enable_exceptions = false;" << std::endl;
+    source << "        entries.clear();" << std::endl;
+    source << "        generation = tracker.generation();" << std::endl;
+    source << "        Builder builder{*this};" << std::endl;
+    source << "        builder.walk(*root);" << std::endl;
+    source << "        built = true;" << std::endl;
+    source << "    }" << std::endl;
+    source << "    auto seq = ids.get_ref(node);" << std::endl;
+    source << "    if (seq == " << support_ns << "::base::PointerMap::INVALID) {" << std::endl;
+    source << "        return nullptr;" << std::endl;
+    source << "    }" << std::endl;
+    source << "    return &entries[seq];" << std::endl;
+    source << "}" << std::endl << std::endl;
+
+    header << "public:" << std::endl << std::endl;
+
+    doc = "Constructs an index for an empty tree.";
+    format_doc(header, doc, "    ");
+    header << "    ParentIndex();" << std::endl << std::endl;
+    format_doc(source, doc);
+    source << "ParentIndex::ParentIndex() : ParentIndex(nullptr) {}" << std::endl << std::endl;
+
+    doc = "Constructs an index for the tree rooted at the given node, or for an "
+          "empty tree if it is null. The index is built by the first query.";
+    format_doc(header, doc, "    ");
+    header << "    explicit ParentIndex(Node *root);" << std::endl << std::endl;
+    format_doc(source, doc);
+    source << "ParentIndex::ParentIndex(Node *root) :" << std::endl;
+    source << "    root(root), ids(), entries(), tracker(), generation(tracker.generation()), built(false)" << std::endl;
+    source << "{" << std::endl;
+    source << "    ids.enable_exceptions = false;" << std::endl;
+    source << "}" << std::endl << std::endl;
+
+    doc = "Builds an index for the tree rooted at the given node.";
+    format_doc(header, doc, "    ");
+    header << "    static ParentIndex build(Node &root);" << std::endl << std::endl;
+    format_doc(source, doc);
+    source << "ParentIndex ParentIndex::build(Node &root) {" << std::endl;
+    source << "    ParentIndex index{&root};" << std::endl;
+    source << "    index.find(root);" << std::endl;
+    source << "    return index;" << std::endl;
+    source << "}" << std::endl << std::endl;
+
+    doc = "Discards the index, such that the next query rebuilds it. Call this "
+          "after destroying nodes of the tree without modifying its edges, as "
+          "that is not tracked.";
+    format_doc(header, doc, "    ");
+    header << "    void invalidate();" << std::endl << std::endl;
+    format_doc(source, doc);
+    source << "void ParentIndex::invalidate() {" << std::endl;
+    source << "    built = false;" << std::endl;
+    source << "}" << std::endl << std::endl;
+
+    doc = "Returns whether the given node is part of the tree.";
+    format_doc(header, doc, "    ");
+    header << "    bool contains(const Node &node);" << std::endl << std::endl;
+    format_doc(source, doc);
+    source << "bool ParentIndex::contains(const Node &node) {" << std::endl;
+    source << "    return find(node) != nullptr;" << std::endl;
+    source << "}" << std::endl << std::endl;
+
+    doc = "Returns the parent of the given node, or null if it is the root or "
+          "not part of the tree.";
+    format_doc(header, doc, "    ");
+    header << "    Node *parent_of(const Node &node);" << std::endl << std::endl;
+    format_doc(source, doc);
+    source << "Node *ParentIndex::parent_of(const Node &node) {" << std::endl;
+    source << "    auto entry = find(node);" << std::endl;
+    source << "    return entry ? entry->parent : nullptr;" << std::endl;
+    source << "}" << std::endl << std::endl;
+
+    doc = "Returns the index of the field of the parent that refers to the "
+          "given node, numbered in constructor argument order as for "
+          "`Walker::enter_field()`. Throws an `OutOfRange` if the node is the "
+          "root or not part of the tree.";
+    format_doc(header, doc, "    ");
+    header << "    size_t field_of(const Node &node);" << std::endl << std::endl;
+    format_doc(source, doc);
+    source << "size_t ParentIndex::field_of(const Node &node) {" << std::endl;
+    source << "    auto entry = find(node);" << std::endl;
+    source << "    if (!entry || !entry->parent) {" << std::endl;
+    source << "        throw " << support_ns << "::base::OutOfRange(\"node has no parent in the indexed tree\");" << std::endl;
+    source << "    }" << std::endl;
+    source << "    return entry->field;" << std::endl;
+    source << "}" << std::endl << std::endl;
+
+    doc = "Returns the position of the given node in the Any/Many field of its "
+          "parent that refers to it, or zero for Maybe/One fields. Throws an "
+          "`OutOfRange` if the node is the root or not part of the tree.";
+    format_doc(header, doc, "    ");
+    header << "    size_t index_of(const Node &node);" << std::endl << std::endl;
+    format_doc(source, doc);
+    source << "size_t ParentIndex::index_of(const Node &node) {" << std::endl;
+    source << "    auto entry = find(node);" << std::endl;
+    source << "    if (!entry || !entry->parent) {" << std::endl;
+    source << "        throw " << support_ns << "::base::OutOfRange(\"node has no parent in the indexed tree\");" << std::endl;
+    source << "    }" << std::endl;
+    source << "    return entry->index;" << std::endl;
+    source << "}" << std::endl << std::endl;
+
+    doc = "Returns the nodes on the path from the root to the given node, both "
+          "included, or an empty vector if the node is not part of the tree.";
+    format_doc(header, doc, "    ");
+    header << "    std::vector<Node*> path_to(const Node &node);" << std::endl << std::endl;
+    format_doc(source, doc);
+    source << "std::vector<Node*> ParentIndex::path_to(const Node &node) {" << std::endl;
+    source << "    std::vector<Node*> path{};" << std::endl;
+    source << "    auto entry = find(node);" << std::endl;
+    source << "    if (!entry) {" << std::endl;
+    source << "        return path;" << std::endl;
+    source << "    }" << std::endl;
+    source << "    path.push_back(const_cast<Node*>(&node));" << std::endl;
+    source << "    while (entry->parent) {" << std::endl;
+    source << "        path.push_back(entry->parent);" << std::endl;
+    source << "        entry = find(*entry->parent);" << std::endl;
+    source << "    }" << std::endl;
+    source << "    std::reverse(path.begin(), path.end());" << std::endl;
+    source << "    return path;" << std::endl;
+    source << "}" << std::endl << std::endl;
+
+    format_doc(
+        header,
+        "Returns the nearest proper ancestor of the given node that is of "
+        "type `T` (or a type derived from it), or null if there is none.",
+        "    "
+    );
+    header << "    template <class T>" << std::endl;
+    header << "    T *ancestor_of(const Node &node) {" << std::endl;
+    header << "        for (auto parent = parent_of(node); parent; parent = parent_of(*parent)) {" << std::endl;
+    header << "            if (T::TYPE_RANGE.contains(parent->type_rank())) {" << std::endl;
+    header << "                return static_cast<T*>(parent);" << std::endl;
+    header << "            }" << std::endl;
+    header << "        }" << std::endl;
+    header << "        return nullptr;" << std::endl;
+    header << "    }" << std::endl << std::endl;
+
+    doc = "Returns the number of indexed nodes, building the index if needed.";
+    format_doc(header, doc, "    ");
+    header << "    size_t size();" << std::endl << std::endl;
+    format_doc(source, doc);
+    source << "size_t ParentIndex::size() {" << std::endl;
+    source << "    if (!root) {" << std::endl;
+    source << "        return 0;" << std::endl;
+    source << "    }" << std::endl;
+    source << "    find(*root);" << std::endl;
+    source << "    return entries.size();" << std::endl;
+    source << "}" << std::endl << std::endl;
+
+    header << "};" << std::endl << std::endl;
+}
+
+/**
+ * Writes the given code to the given stream, indenting each nonempty line
+ * with the given prefix.
+ */
+void write_indented(
+    std::ostream &out,
+    const std::string &code,
+    const std::string &prefix
+) {
+    std::istringstream ss{code};
+    std::string line;
+    while (std::getline(ss, line)) {
+        if (!line.empty()) {
+            out << prefix << line;
+        }
+        out << std::endl;
+    }
+}
+
 /**
  * Generate the dumper class.
  */
 void generate_dumper_class(
-    std::ofstream &header,
-    std::ofstream &source,
+    std::ostream &header,
+    std::ostream &source,
     Nodes &nodes,
     std::string &source_location,
     std::string &support_ns
 ) {
     // Print class header.
     format_doc(header, "Visitor class that debug-dumps a tree to a stream");
-    header << "class Dumper : public RecursiveVisitor {" << std::endl;
+    header << "class Dumper : public Walker {" << std::endl;
     header << "protected:" << std::endl << std::endl;
-    format_doc(header, "Output stream to dump to.", "    ");
-    header << "    std::ostream &out;" << std::endl << std::endl;
+    format_doc(header, "Buffered writer for the stream or string to dump to.", "    ");
+    header << "    " << support_ns << "::base::TextWriter out;" << std::endl << std::endl;
     format_doc(header, "Current indentation level.", "    ");
     header << "    int indent = 0;" << std::endl << std::endl;
     format_doc(header, "When non-null, the print node IDs from here instead of link contents.", "    ");
@@ -911,185 +2433,407 @@ void generate_dumper_class(
     header << "    bool in_raw_pointers = false;" << std::endl << std::endl;
     format_doc(header, "Whether we're printing the contents of a link.", "    ");
     header << "    bool in_link = false;" << std::endl << std::endl;
+    format_doc(header, "Maximum nesting depth of the nodes to dump, or 0 for no limit.", "    ");
+    header << "    size_t max_depth = 0;" << std::endl << std::endl;
+    format_doc(header, "Maximum number of entries to dump per Any/Many field, or 0 for no limit.", "    ");
+    header << "    size_t max_width = 0;" << std::endl << std::endl;
+    format_doc(header, "Nesting depth of the node being dumped.", "    ");
+    header << "    size_t depth = 0;" << std::endl << std::endl;
+    format_doc(header, "Whether pre() skipped the current node, such that post() shouldn't dump anything.", "    ");
+    header << "    bool skipped = false;" << std::endl << std::endl;
+    format_doc(header, "Number of entries visited so far and total number of entries for each node field being dumped.", "    ");
+    header << "    std::vector<std::pair<size_t, size_t>> entries;" << std::endl << std::endl;
 
     // Print function that prints indentation level.
     format_doc(header, "Writes the current indentation level's worth of spaces.", "    ");
     header << "    void write_indent();" << std::endl << std::endl;
     format_doc(source, "Writes the current indentation level's worth of spaces.");
     source << "void Dumper::write_indent() {" << std::endl;
-    source << "    for (int i = 0; i < indent; i++) {" << std::endl;
-    source << "        out << \"  \";" << std::endl;
+    source << "    out.indent(indent);" << std::endl;
+    source << "}" << std::endl << std::endl;
+
+    // Print function that applies the width limit.
+    auto doc = "Counts an entry of the node field being dumped, and returns "
+               "whether it lies beyond the width limit. An ellipsis is "
+               "dumped in place of the first entry that does.";
+    format_doc(header, doc, "    ");
+    header << "    bool elide_entry();" << std::endl << std::endl;
+    format_doc(source, doc);
+    source << "bool Dumper::elide_entry() {" << std::endl;
+    source << "    if (!max_width || entries.empty()) {" << std::endl;
+    source << "        return false;" << std::endl;
+    source << "    }" << std::endl;
+    source << "    auto &entry = entries.back();" << std::endl;
+    source << "    if (entry.first++ < max_width) {" << std::endl;
+    source << "        return false;" << std::endl;
     source << "    }" << std::endl;
+    source << "    if (entry.first == max_width + 1) {" << std::endl;
+    source << "        write_indent();" << std::endl;
+    source << "        out << \"... (\" << entry.second - max_width << \" more)\";" << std::endl;
+    source << "        out.end_line();" << std::endl;
+    source << "    }" << std::endl;
+    source << "    return true;" << std::endl;
     source << "}" << std::endl << std::endl;
 
-    // Write constructor.
-    header << "public:" << std::endl << std::endl;
-    format_doc(header, "Construct a dumping visitor.", "    ");
-    header << "    Dumper(std::ostream &out, int indent = 0, " << support_ns << "::base::PointerMap *ids = nullptr, bool in_raw_pointers = false)" << std::endl;
-    header << "    : out(out), indent(indent), ids(ids), in_raw_pointers(in_raw_pointers) {};" << std::endl << std::endl;
+    // Gather the leaf types.
+    Nodes leaves{};
+    bool with_fields = false;
+    for (auto &node : nodes) {
+        if (node->derived.empty()) {
+            leaves.push_back(node);
+            with_fields |= !node->all_fields().empty();
+        }
+    }
 
-    // Print fallback function.
-    format_doc(header, "Dumps a `Node`.", "    ");
-    header << "    void visit_node(Node &node) override;" << std::endl;
-    format_doc(source, "Dumps a `Node`.");
-    source << "void Dumper::visit_node(Node &node) {" << std::endl;
-    source << "    (void) node;" << std::endl;
+    // Print the pre-order hook, which prints the node type and opens the
+    // field list.
+    doc = "Dumps the header of a node.";
+    format_doc(header, doc, "    ");
+    header << "    WalkAction pre(Node &node) override;" << std::endl << std::endl;
+    format_doc(source, doc);
+    source << "WalkAction Dumper::pre(Node &node) {" << std::endl;
+    source << "    if (elide_entry()) {" << std::endl;
+    source << "        skipped = true;" << std::endl;
+    source << "        return WalkAction::SKIP;" << std::endl;
+    source << "    }" << std::endl;
     source << "    write_indent();" << std::endl;
-    source << "    out << \"!Node()\" << std::endl;" << std::endl;
+    source << "    switch (node.type()) {" << std::endl;
+    for (auto &node : leaves) {
+        source << "        case NodeType::" << node->title_case_name << ":" << std::endl;
+        source << "            out << \"" << node->title_case_name << "\";" << std::endl;
+        source << "            break;" << std::endl;
+    }
+    source << "    }" << std::endl;
+    source << "    if (ids != nullptr) {" << std::endl;
+    source << "        out << \"@\" << ids->get_ref(node);" << std::endl;
+    source << "    }" << std::endl;
+    source << "    if (max_depth && depth >= max_depth) {" << std::endl;
+    source << "        out << \"(...)\";" << std::endl;
+    source << "        out.end_line();" << std::endl;
+    source << "        skipped = true;" << std::endl;
+    source << "        return WalkAction::SKIP;" << std::endl;
+    source << "    }" << std::endl;
+    source << "    depth++;" << std::endl;
+    source << "    out << \"(\";" << std::endl;
+    if (!source_location.empty()) {
+        source << "    if (auto loc = node.get_annotation_ptr<" << source_location << ">()) {" << std::endl;
+        source << "        out << \" # \" << out.format(*loc);" << std::endl;
+        source << "    }" << std::endl;
+    }
+    source << "    out.end_line();" << std::endl;
+    if (with_fields) {
+        source << "    switch (node.type()) {" << std::endl;
+        for (auto &node : leaves) {
+            if (!node->all_fields().empty()) {
+                source << "        case NodeType::" << node->title_case_name << ":" << std::endl;
+            }
+        }
+        source << "            indent++;" << std::endl;
+        source << "            break;" << std::endl;
+        source << "        default:" << std::endl;
+        source << "            break;" << std::endl;
+        source << "    }" << std::endl;
+    }
+    source << "    return WalkAction::CONTINUE;" << std::endl;
     source << "}" << std::endl << std::endl;
 
-    // Functions for all node types.
-    for (auto &node : nodes) {
-        bool first_prim = true;
-        auto doc = "Dumps a `" + node->title_case_name + "` node.";
-        format_doc(header, doc, "    ");
-        header << "    void visit_" << node->snake_case_name;
-        header << "(" << node->title_case_name << " &node) override;" << std::endl << std::endl;
-        format_doc(source, doc);
-        source << "void Dumper::visit_" << node->snake_case_name;
-        source << "(" << node->title_case_name << " &node) {" << std::endl;
-        source << "    write_indent();" << std::endl;
-        auto attributes = node->all_fields();
-        source << "    out << \"" << node->title_case_name << "\";" << std::endl;
-        source << "    if (ids != nullptr) {" << std::endl;
-        source << "        out << \"@\" << ids->get_ref(node);" << std::endl;
+    // Print the post-order hook, which closes the field list.
+    doc = "Dumps the footer of a node.";
+    format_doc(header, doc, "    ");
+    header << "    WalkAction post(Node &node) override;" << std::endl << std::endl;
+    format_doc(source, doc);
+    source << "WalkAction Dumper::post(Node &node) {" << std::endl;
+    source << "    if (skipped) {" << std::endl;
+    source << "        skipped = false;" << std::endl;
+    source << "        return WalkAction::CONTINUE;" << std::endl;
+    source << "    }" << std::endl;
+    source << "    depth--;" << std::endl;
+    if (with_fields) {
+        source << "    switch (node.type()) {" << std::endl;
+        for (auto &node : leaves) {
+            if (!node->all_fields().empty()) {
+                source << "        case NodeType::" << node->title_case_name << ":" << std::endl;
+            }
+        }
+        source << "            indent--;" << std::endl;
+        source << "            write_indent();" << std::endl;
+        source << "            break;" << std::endl;
+        source << "        default:" << std::endl;
+        source << "            break;" << std::endl;
         source << "    }" << std::endl;
-        source << "    out << \"(\";" << std::endl;
-        if (!source_location.empty()) {
-            source << "    if (auto loc = node.get_annotation_ptr<" << source_location << ">()) {" << std::endl;
-            source << "        out << \" # \" << *loc;" << std::endl;
-            source << "    }" << std::endl;
+    }
+    source << "    out << \")\";" << std::endl;
+    source << "    out.end_line();" << std::endl;
+    source << "    return WalkAction::CONTINUE;" << std::endl;
+    source << "}" << std::endl << std::endl;
+
+    // Print the field hooks. Everything that doesn't involve walking into a
+    // node of this tree is dumped from enter_field(), including link targets
+    // and the nodes of other trees; leave_field() only closes the brackets
+    // opened for the node edges.
+    doc = "Dumps the start of a field, or all of it if it doesn't refer to nodes of this tree.";
+    format_doc(header, doc, "    ");
+    header << "    WalkAction enter_field(Node &base_node, size_t field) override;" << std::endl << std::endl;
+    format_doc(source, doc);
+    source << "WalkAction Dumper::enter_field(Node &base_node, size_t field) {" << std::endl;
+    source << "    switch (base_node.type()) {" << std::endl;
+    for (auto &node : leaves) {
+        auto attributes = node->all_fields();
+        if (attributes.empty()) {
+            continue;
         }
-        source << "    out << std::endl;" << std::endl;
-        if (!attributes.empty()) {
-            source << "    indent++;" << std::endl;
-            for (auto &attrib : attributes) {
-                source << "    write_indent();" << std::endl;
-                source << "    out << \"" << attrib.name;
-                if (attrib.ext_type == Link || attrib.ext_type == OptLink) {
-                    source << " --> ";
-                } else {
-                    source << ": ";
-                }
-                source << "\";" << std::endl;
-                switch (attrib.ext_type) {
-                    case Maybe:
-                    case One:
-                    case OptLink:
-                    case Link:
-                        source << "    if (node." << attrib.name << ".empty()) {" << std::endl;
-                        if (attrib.ext_type == One || attrib.ext_type == Link) {
-                            source << "        out << \"!MISSING\" << std::endl;" << std::endl;
-                        } else {
-                            source << "        out << \"-\" << std::endl;" << std::endl;
-                        }
-                        if (attrib.ext_type == Link || attrib.ext_type == OptLink) {
-                            source << "    } else if (ids != nullptr && ids->get(node." << attrib.name << ") != (size_t)-1) {" << std::endl;
-                            auto type = attrib.node_type ? attrib.node_type->title_case_name : attrib.prim_type;
-                            source << "        out << \"" << type << "@\" << ids->get(node." << attrib.name << ") << std::endl;" << std::endl;
-                        }
-                        source << "    } else {" << std::endl;
-                        source << "        if (in_raw_pointers) {" << std::endl;
-                        source << "            out << std::hex << reinterpret_cast<const void*>(node." << attrib.name << ".get_ptr().get()) << \" \";" << std::endl;
-                        source << "        }" << std::endl;
-                        source << "        out << \"<\" << std::endl;" << std::endl;
-                        source << "        indent++;" << std::endl;
-                        if (attrib.ext_type == Link || attrib.ext_type == OptLink) {
-                            source << "        if (!in_link) {" << std::endl;
-                            source << "            in_link = true;" << std::endl;
-                            if (attrib.type == Prim) {
-                                source << "            if (!node." << attrib.name << ".empty()) {" << std::endl;
-                                source << "                node." << attrib.name << "->dump(out, indent);" << std::endl;
-                                source << "            }" << std::endl;
-                            } else {
-                                source << "            node." << attrib.name << ".visit(*this);" << std::endl;
-                            }
-                            source << "            in_link = false;" << std::endl;
-                            source << "        } else {" << std::endl;
-                            source << "            write_indent();" << std::endl;
-                            source << "            out << \"...\" << std::endl;" << std::endl;
-                            source << "        }" << std::endl;
-                        } else if (attrib.type == Prim) {
-                            source << "        if (!node." << attrib.name << ".empty()) {" << std::endl;
-                            source << "            node." << attrib.name << "->dump(out, indent);" << std::endl;
-                            source << "        }" << std::endl;
-                        } else {
-                            source << "        node." << attrib.name << ".visit(*this);" << std::endl;
-                        }
-                        source << "        indent--;" << std::endl;
-                        source << "        write_indent();" << std::endl;
-                        source << "        out << \">\" << std::endl;" << std::endl;
-                        source << "    }" << std::endl;
+        source << "        case NodeType::" << node->title_case_name << ": {" << std::endl;
+        source << "            auto &node = static_cast<" << node->title_case_name << "&>(base_node);" << std::endl;
+        source << "            switch (field) {" << std::endl;
+        for (size_t index = 0; index < attributes.size(); index++) {
+            auto &attrib = attributes[index];
+            std::ostringstream code{};
+            code << "write_indent();" << std::endl;
+            code << "out << \"" << attrib.name;
+            if (attrib.ext_type == Link || attrib.ext_type == OptLink) {
+                code << " --> ";
+            } else {
+                code << ": ";
+            }
+            code << "\";" << std::endl;
+            switch (attrib.ext_type) {
+                case Maybe:
+                case One:
+                case OptLink:
+                case Link:
+                    if (attrib.type != Prim && attrib.ext_type != Link && attrib.ext_type != OptLink) {
+                        code << "entries.emplace_back(0, 1);" << std::endl;
+                    }
+                    code << "if (node." << attrib.name << ".empty()) {" << std::endl;
+                    if (attrib.ext_type == One || attrib.ext_type == Link) {
+                        code << "    out << \"!MISSING\";" << std::endl;
+                    } else {
+                        code << "    out << '-';" << std::endl;
+                    }
+                    code << "    out.end_line();" << std::endl;
+                    if (attrib.ext_type == Link || attrib.ext_type == OptLink) {
+                        code << "} else if (ids != nullptr && ids->get(node." << attrib.name << ") != (size_t)-1) {" << std::endl;
+                        auto type = attrib.node_type ? attrib.node_type->title_case_name : attrib.prim_type;
+                        code << "    out << \"" << type << "@\" << ids->get(node." << attrib.name << ");" << std::endl;
+                        code << "    out.end_line();" << std::endl;
+                    }
+                    code << "} else {" << std::endl;
+                    code << "    if (in_raw_pointers) {" << std::endl;
+                    code << "        out << static_cast<const void*>(node." << attrib.name << ".get_ptr().get()) << ' ';" << std::endl;
+                    code << "    }" << std::endl;
+                    code << "    out << '<';" << std::endl;
+                    code << "    out.end_line();" << std::endl;
+                    code << "    indent++;" << std::endl;
+                    if (attrib.type != Prim && attrib.ext_type != Link && attrib.ext_type != OptLink) {
+                        code << "}" << std::endl;
                         break;
-
-                    case Any:
-                    case Many:
-                        source << "    if (node." << attrib.name << ".empty()) {" << std::endl;
-                        if (attrib.ext_type == Many) {
-                            source << "        out << \"!MISSING\" << std::endl;" << std::endl;
-                        } else {
-                            source << "        out << \"[]\" << std::endl;" << std::endl;
-                        }
-                        source << "    } else {" << std::endl;
-                        source << "        out << \"[\" << std::endl;" << std::endl;
-                        source << "        indent++;" << std::endl;
-                        source << "        for (auto &sptr : node." << attrib.name << ") {" << std::endl;
-                        source << "            if (!sptr.empty()) {" << std::endl;
+                    }
+                    if (attrib.ext_type == Link || attrib.ext_type == OptLink) {
+                        code << "    if (!in_link) {" << std::endl;
+                        code << "        in_link = true;" << std::endl;
                         if (attrib.type == Prim) {
-                            source << "                sptr->dump(out, indent);" << std::endl;
+                            code << "        if (!node." << attrib.name << ".empty()) {" << std::endl;
+                            code << "            node." << attrib.name << "->dump(out.start_scratch(), indent);" << std::endl;
+                            code << "            out << out.finish_scratch();" << std::endl;
+                            code << "        }" << std::endl;
                         } else {
-                            source << "                sptr->visit(*this);" << std::endl;
+                            code << "        entries.emplace_back(0, 1);" << std::endl;
+                            code << "        node." << attrib.name << ".visit(*this);" << std::endl;
+                            code << "        entries.pop_back();" << std::endl;
                         }
-                        source << "            } else {" << std::endl;
-                        source << "                write_indent();" << std::endl;
-                        source << "                out << \"!NULL\" << std::endl;" << std::endl;
-                        source << "            }" << std::endl;
-                        source << "        }" << std::endl;
-                        source << "        indent--;" << std::endl;
-                        source << "        write_indent();" << std::endl;
-                        source << "        out << \"]\" << std::endl;" << std::endl;
-                        source << "    }" << std::endl;
+                        code << "        in_link = false;" << std::endl;
+                        code << "    } else {" << std::endl;
+                        code << "        write_indent();" << std::endl;
+                        code << "        out << \"...\";" << std::endl;
+                        code << "        out.end_line();" << std::endl;
+                        code << "    }" << std::endl;
+                    } else {
+                        code << "    if (!node." << attrib.name << ".empty()) {" << std::endl;
+                        code << "        node." << attrib.name << "->dump(out.start_scratch(), indent);" << std::endl;
+                        code << "        out << out.finish_scratch();" << std::endl;
+                        code << "    }" << std::endl;
+                    }
+                    code << "    indent--;" << std::endl;
+                    code << "    write_indent();" << std::endl;
+                    code << "    out << '>';" << std::endl;
+                    code << "    out.end_line();" << std::endl;
+                    code << "}" << std::endl;
+                    break;
+
+                case Any:
+                case Many:
+                    if (attrib.type != Prim) {
+                        code << "entries.emplace_back(0, node." << attrib.name << ".size());" << std::endl;
+                    }
+                    code << "if (node." << attrib.name << ".empty()) {" << std::endl;
+                    if (attrib.ext_type == Many) {
+                        code << "    out << \"!MISSING\";" << std::endl;
+                    } else {
+                        code << "    out << \"[]\";" << std::endl;
+                    }
+                    code << "    out.end_line();" << std::endl;
+                    code << "} else {" << std::endl;
+                    code << "    out << '[';" << std::endl;
+                    code << "    out.end_line();" << std::endl;
+                    code << "    indent++;" << std::endl;
+                    if (attrib.type != Prim) {
+                        code << "}" << std::endl;
                         break;
+                    }
+                    code << "    size_t count = 0;" << std::endl;
+                    code << "    for (auto &sptr : node." << attrib.name << ") {" << std::endl;
+                    code << "        if (max_width && count++ == max_width) {" << std::endl;
+                    code << "            write_indent();" << std::endl;
+                    code << "            out << \"... (\" << node." << attrib.name << ".size() - max_width << \" more)\";" << std::endl;
+                    code << "            out.end_line();" << std::endl;
+                    code << "            break;" << std::endl;
+                    code << "        }" << std::endl;
+                    code << "        if (!sptr.empty()) {" << std::endl;
+                    code << "            sptr->dump(out.start_scratch(), indent);" << std::endl;
+                    code << "            out << out.finish_scratch();" << std::endl;
+                    code << "        } else {" << std::endl;
+                    code << "            write_indent();" << std::endl;
+                    code << "            out << \"!NULL\";" << std::endl;
+                    code << "            out.end_line();" << std::endl;
+                    code << "        }" << std::endl;
+                    code << "    }" << std::endl;
+                    code << "    indent--;" << std::endl;
+                    code << "    write_indent();" << std::endl;
+                    code << "    out << ']';" << std::endl;
+                    code << "    out.end_line();" << std::endl;
+                    code << "}" << std::endl;
+                    break;
 
-                    case Prim:
-                        if (first_prim) {
-                            source << "    std::stringstream ss;" << std::endl;
-                            source << "    size_t pos;" << std::endl;
-                            first_prim = false;
-                        } else {
-                            source << "    ss.str(\"\");" << std::endl;
-                            source << "    ss.clear();" << std::endl;
-                        }
-                        source << "    ss << node." << attrib.name << ";" << std::endl;
-                        source << "    pos = ss.str().find_last_not_of(\" \\n\\r\\t\");" << std::endl;
-                        source << "    if (pos != std::string::npos) {" << std::endl;
-                        source << "        ss.str(ss.str().erase(pos+1));" << std::endl;
-                        source << "    }" << std::endl;
-                        source << "    if (ss.str().find('\\n') == std::string::npos) {" << std::endl;
-                        source << "        out << ss.str() << std::endl;" << std::endl;
-                        source << "    } else {" << std::endl;
-                        source << "        out << \"" << attrib.prim_type << "<<\" << std::endl;" << std::endl;
-                        source << "        indent++;" << std::endl;
-                        source << "        std::string s;" << std::endl;
-                        source << "        while (!ss.eof()) {" << std::endl;
-                        source << "            std::getline(ss, s);" << std::endl;
-                        source << "            write_indent();" << std::endl;
-                        source << "            out << s << std::endl;" << std::endl;
-                        source << "        }" << std::endl;
-                        source << "        indent--;" << std::endl;
-                        source << "        write_indent();" << std::endl;
-                        source << "        out << \">>\" << std::endl;" << std::endl;
-                        source << "    }" << std::endl;
-                        break;
+                case Prim:
+                    code << "auto text = " << support_ns << "::base::TextWriter::trim(out.format(node." << attrib.name << "));" << std::endl;
+                    code << "auto pos = text.find('\\n');" << std::endl;
+                    code << "if (pos == std::string_view::npos) {" << std::endl;
+                    code << "    out << text;" << std::endl;
+                    code << "    out.end_line();" << std::endl;
+                    code << "} else {" << std::endl;
+                    code << "    out << \"" << attrib.prim_type << "<<\";" << std::endl;
+                    code << "    out.end_line();" << std::endl;
+                    code << "    indent++;" << std::endl;
+                    code << "    while (true) {" << std::endl;
+                    code << "        write_indent();" << std::endl;
+                    code << "        out << text.substr(0, pos);" << std::endl;
+                    code << "        out.end_line();" << std::endl;
+                    code << "        if (pos == std::string_view::npos) {" << std::endl;
+                    code << "            break;" << std::endl;
+                    code << "        }" << std::endl;
+                    code << "        text.remove_prefix(pos + 1);" << std::endl;
+                    code << "        pos = text.find('\\n');" << std::endl;
+                    code << "    }" << std::endl;
+                    code << "    indent--;" << std::endl;
+                    code << "    write_indent();" << std::endl;
+                    code << "    out << \">>\";" << std::endl;
+                    code << "    out.end_line();" << std::endl;
+                    code << "}" << std::endl;
+                    break;
 
-                }
             }
-            source << "    indent--;" << std::endl;
-            source << "    write_indent();" << std::endl;
+            code << "break;" << std::endl;
+            source << "                case " << index << ": {" << std::endl;
+            write_indented(source, code.str(), "                    ");
+            source << "                }" << std::endl;
         }
-        source << "    out << \")\" << std::endl;" << std::endl;
-        source << "}" << std::endl << std::endl;
+        source << "            }" << std::endl;
+        source << "            break;" << std::endl;
+        source << "        }" << std::endl;
+    }
+    source << "        default:" << std::endl;
+    source << "            break;" << std::endl;
+    source << "    }" << std::endl;
+    source << "    return WalkAction::CONTINUE;" << std::endl;
+    source << "}" << std::endl << std::endl;
+
+    doc = "Dumps the end of a field that refers to nodes of this tree.";
+    format_doc(header, doc, "    ");
+    header << "    WalkAction leave_field(Node &base_node, size_t field) override;" << std::endl << std::endl;
+    format_doc(source, doc);
+    source << "WalkAction Dumper::leave_field(Node &base_node, size_t field) {" << std::endl;
+    source << "    switch (base_node.type()) {" << std::endl;
+    for (auto &node : leaves) {
+        auto attributes = node->all_fields();
+        std::ostringstream cases{};
+        for (size_t index = 0; index < attributes.size(); index++) {
+            auto &attrib = attributes[index];
+            if (attrib.type == Prim || attrib.ext_type == Link || attrib.ext_type == OptLink) {
+                continue;
+            }
+            cases << "                case " << index << ":" << std::endl;
+            cases << "                    entries.pop_back();" << std::endl;
+            cases << "                    if (!node." << attrib.name << ".empty()) {" << std::endl;
+            cases << "                        indent--;" << std::endl;
+            cases << "                        write_indent();" << std::endl;
+            if (attrib.ext_type == Any || attrib.ext_type == Many) {
+                cases << "                        out << ']';" << std::endl;
+            } else {
+                cases << "                        out << '>';" << std::endl;
+            }
+            cases << "                        out.end_line();" << std::endl;
+            cases << "                    }" << std::endl;
+            cases << "                    break;" << std::endl;
+        }
+        if (cases.str().empty()) {
+            continue;
+        }
+        source << "        case NodeType::" << node->title_case_name << ": {" << std::endl;
+        source << "            auto &node = static_cast<" << node->title_case_name << "&>(base_node);" << std::endl;
+        source << "            switch (field) {" << std::endl;
+        source << cases.str();
+        source << "            }" << std::endl;
+        source << "            break;" << std::endl;
+        source << "        }" << std::endl;
     }
+    source << "        default:" << std::endl;
+    source << "            break;" << std::endl;
+    source << "    }" << std::endl;
+    source << "    return WalkAction::CONTINUE;" << std::endl;
+    source << "}" << std::endl << std::endl;
+
+    doc = "Dumps an empty entry of an Any/Many field.";
+    format_doc(header, doc, "    ");
+    header << "    WalkAction null_element(Node &node, size_t field) override;" << std::endl << std::endl;
+    format_doc(source, doc);
+    source << "WalkAction Dumper::null_element(Node &node, size_t field) {" << std::endl;
+    source << "    (void) node;" << std::endl;
+    source << "    (void) field;" << std::endl;
+    source << "    if (elide_entry()) {" << std::endl;
+    source << "        return WalkAction::CONTINUE;" << std::endl;
+    source << "    }" << std::endl;
+    source << "    write_indent();" << std::endl;
+    source << "    out << \"!NULL\";" << std::endl;
+    source << "    out.end_line();" << std::endl;
+    source << "    return WalkAction::CONTINUE;" << std::endl;
+    source << "}" << std::endl << std::endl;
+
+    // Write constructor.
+    header << "public:" << std::endl << std::endl;
+    format_doc(header, "Construct a dumping visitor that writes to the given stream when it is flushed or destroyed.", "    ");
+    header << "    Dumper(std::ostream &out, int indent = 0, " << support_ns << "::base::PointerMap *ids = nullptr, bool in_raw_pointers = false)" << std::endl;
+    header << "    : out(out), indent(indent), ids(ids), in_raw_pointers(in_raw_pointers) {};" << std::endl << std::endl;
+    format_doc(header, "Construct a dumping visitor that appends to the given string.", "    ");
+    header << "    Dumper(std::string &out, int indent = 0, " << support_ns << "::base::PointerMap *ids = nullptr, bool in_raw_pointers = false)" << std::endl;
+    header << "    : out(out), indent(indent), ids(ids), in_raw_pointers(in_raw_pointers) {};" << std::endl << std::endl;
+
+    doc = "Limits the dump to the given nesting depth and number of entries "
+          "per Any/Many field, where 0 means no limit. Nodes beyond the "
+          "depth limit are dumped without their fields, and entries beyond "
+          "the width limit are replaced by a single ellipsis line.";
+    format_doc(header, doc, "    ");
+    header << "    Dumper &limit(size_t max_depth, size_t max_width);" << std::endl << std::endl;
+    format_doc(source, doc);
+    source << "Dumper &Dumper::limit(size_t max_depth, size_t max_width) {" << std::endl;
+    source << "    this->max_depth = max_depth;" << std::endl;
+    source << "    this->max_width = max_width;" << std::endl;
+    source << "    return *this;" << std::endl;
+    source << "}" << std::endl << std::endl;
+
+    format_doc(header, "Writes the dumped text to the stream, if any.", "    ");
+    header << "    void flush() {" << std::endl;
+    header << "        out.flush();" << std::endl;
+    header << "    }" << std::endl << std::endl;
 
     header << "};" << std::endl << std::endl;
 }
@@ -1098,10 +2842,11 @@ void generate_dumper_class(
  * Generate the JSON dumper class.
  */
 void generate_json_dumper_class(
-    std::ofstream &header,
-    std::ofstream &source,
+    std::ostream &header,
+    std::ostream &source,
     Nodes &nodes,
-    std::string &source_location
+    std::string &source_location,
+    std::string &support_ns
 ) {
     // Print class header.
     format_doc(header, "Visitor class that JSON dumps a tree to a stream");
@@ -1109,16 +2854,25 @@ void generate_json_dumper_class(
         class JsonDumper : public RecursiveVisitor {
         protected:)"_indent_0_remove_first_line);
     fmt::print(header, "\n");
-    format_doc(header, "Output stream to dump to.", "    ");
-    fmt::print(header, "std::ostream &out;\n"_indent_4);
+    format_doc(header, "Buffered writer for the stream or string to dump to.", "    ");
+    fmt::print(header, "    {}::base::TextWriter out;\n", support_ns);
     format_doc(header, "Whether we're printing the contents of a link.", "    ");
     fmt::print(header, "bool in_link = false;\n"_indent_4);
 
     // Write constructor.
     fmt::print(header, "public:\n\n");
-    format_doc(header, "Construct a dumping visitor.", "    ");
+    format_doc(header, "Construct a dumping visitor that writes to the given stream when it is flushed or destroyed.", "    ");
     fmt::print(header, "JsonDumper(std::ostream &out) : out(out) {};"_indent_4);
     fmt::print(header, "\n");
+    format_doc(header, "Construct a dumping visitor that appends to the given string.", "    ");
+    fmt::print(header, "JsonDumper(std::string &out) : out(out) {};"_indent_4);
+    fmt::print(header, "\n");
+    format_doc(header, "Writes the dumped text to the stream, if any.", "    ");
+    fmt::print(header, R"(
+        void flush() {
+            out.flush();
+        })"_indent_4_remove_first_line);
+    fmt::print(header, "\n");
 
     // Print fallback function.
     format_doc(header, "JSON dumps a `Node`.", "    ");
@@ -1178,7 +2932,8 @@ void generate_json_dumper_class(
                                 fmt::print(source, R"(
                                     out << "\"{0}\":";
                                     if (!node.{0}.empty()) {
-                                        node.{0}->dump_json(out);
+                                        node.{0}->dump_json(out.start_scratch());
+                                        out << out.finish_scratch();
                                     })"_indent_12_remove_first_line,
                                     attrib.name);
                             } else {
@@ -1197,7 +2952,8 @@ void generate_json_dumper_class(
                             fmt::print(source, R"(
                                 out << "\"{0}\":";
                                 if (!node.{0}.empty()) {
-                                    node.{0}->dump_json(out);
+                                    node.{0}->dump_json(out.start_scratch());
+                                    out << out.finish_scratch();
                                 })"_indent_4_remove_first_line,
                                 attrib.name);
                         } else {
@@ -1232,10 +2988,10 @@ void generate_json_dumper_class(
                             })"_indent_4_remove_first_line,
                             attrib.name,
                             (attrib.ext_type == Many) ? R"(\"!MISSING\")" : "[]",
-                            (attrib.type == Prim) ? "sptr->dump_json(out)" : "sptr->visit(*this)");
+                            (attrib.type == Prim) ? "sptr->dump_json(out.start_scratch());\n                        out << out.finish_scratch()" : "sptr->visit(*this)");
                         break;
                     case Prim:
-                        fmt::print(source, R"(out << "\"{0}\":\"" << node.{0} << "\"";)"_indent_4, attrib.name);
+                        fmt::print(source, R"(out << "\"{0}\":\"" << out.format(node.{0}) << "\"";)"_indent_4, attrib.name);
                         break;
 
                 }
@@ -1247,7 +3003,7 @@ void generate_json_dumper_class(
                 fmt::print(source, R"(out << ",";)"_indent_8);
             }
             fmt::print(source, R"(
-                   out << "\"source_location\":\"" << *loc << "\"";
+                   out << "\"source_location\":\"" << out.format(*loc) << "\"";
                })"_indent_4_remove_first_line);
         }
         fmt::print(source, R"(out << "}";)"_indent_4);
@@ -1260,27 +3016,558 @@ void generate_json_dumper_class(
     fmt::print(header, "};\n\n"_indent_0);
 }
 
+/**
+ * Generate the flattened, index-based tree representation and its visitor.
+ */
+void generate_flat_classes(
+    std::ostream &header,
+    std::ostream &source,
+    Nodes &nodes,
+    const std::vector<std::string> &namespaces,
+    const std::string &support_ns
+) {
+
+    // The node classes are referred to by their qualified name within
+    // flatten(), as its helper structs could otherwise hide them.
+    std::string tree_ns = "";
+    for (auto &name : namespaces) {
+        tree_ns += "::" + name;
+    }
+
+    // Generate the record and range types.
+    format_doc(
+        header,
+        "Record of a node in a `FlatTree`. The records are stored in "
+        "pre-order, so the subtree of the node at index `i` consists of the "
+        "records `i` up to but excluding `end`. A frozen subtree that appears "
+        "more than once is only stored at its first occurrence."
+    );
+    header << "struct FlatRecord {" << std::endl << std::endl;
+    format_doc(header, "The type of the node.", "    ");
+    header << "    NodeType type;" << std::endl << std::endl;
+    format_doc(header, "Index of the node in the columns for its type.", "    ");
+    header << "    uint32_t row;" << std::endl << std::endl;
+    format_doc(header, "Index of the first record past the subtree of the node.", "    ");
+    header << "    uint32_t end;" << std::endl << std::endl;
+    header << "};" << std::endl << std::endl;
+
+    format_doc(
+        header,
+        "Range of node indices in `FlatTree::lists`, representing the "
+        "elements of an Any or Many edge."
+    );
+    header << "struct FlatRange {" << std::endl << std::endl;
+    format_doc(header, "Index of the first element in `FlatTree::lists`.", "    ");
+    header << "    uint32_t begin;" << std::endl << std::endl;
+    format_doc(header, "Number of elements.", "    ");
+    header << "    uint32_t size;" << std::endl << std::endl;
+    header << "};" << std::endl << std::endl;
+
+    // Generate the column structures for the node types.
+    for (auto &node : nodes) {
+        if (!node->derived.empty()) {
+            continue;
+        }
+        format_doc(
+            header,
+            "Columns for the `" + node->title_case_name + "` nodes of a "
+            "`FlatTree`, indexed by `FlatRecord::row`. Edges are stored as "
+            "node indices, or `FlatTree::NONE` for empty edges."
+        );
+        header << "struct Flat" << node->title_case_name << " {" << std::endl << std::endl;
+        format_doc(header, "Index of the node record of each row.", "    ");
+        header << "    std::vector<uint32_t> records;" << std::endl << std::endl;
+        for (auto &field : node->all_fields()) {
+            switch (field.type) {
+                case Maybe:
+                case One:
+                    format_doc(header, "Index of the `" + field.name + "` child node.", "    ");
+                    header << "    std::vector<uint32_t> " << field.name << ";" << std::endl << std::endl;
+                    break;
+                case Any:
+                case Many:
+                    format_doc(header, "Range of the indices of the `" + field.name + "` child nodes.", "    ");
+                    header << "    std::vector<FlatRange> " << field.name << ";" << std::endl << std::endl;
+                    break;
+                case OptLink:
+                case Link:
+                    format_doc(header, "Index of the node linked to by `" + field.name + "`.", "    ");
+                    header << "    std::vector<uint32_t> " << field.name << ";" << std::endl << std::endl;
+                    break;
+                case Prim:
+                    format_doc(header, "Values of `" + field.name + "`.", "    ");
+                    header << "    std::vector<" << field.prim_type << "> " << field.name << ";" << std::endl << std::endl;
+                    break;
+            }
+        }
+        header << "};" << std::endl << std::endl;
+    }
+
+    // Print the class header for the tree itself.
+    format_doc(
+        header,
+        "Flattened, read-only representation of a tree.\n\n"
+        "The nodes are stored as a contiguous array of records in pre-order, "
+        "and their fields in per-type struct-of-arrays columns. Child nodes "
+        "and link targets are referred to by their 32-bit record index, so "
+        "traversing a `FlatTree` doesn't chase pointers or touch reference "
+        "counts. Annotations are not retained, and edges to nodes of other "
+        "trees are stored like primitive values."
+    );
+    header << "class FlatTree {" << std::endl;
+    header << "public:" << std::endl << std::endl;
+
+    format_doc(header, "Node index used for empty edges.", "    ");
+    header << "    static constexpr uint32_t NONE = UINT32_MAX;" << std::endl << std::endl;
+
+    format_doc(header, "The node records, in pre-order.", "    ");
+    header << "    std::vector<FlatRecord> records;" << std::endl << std::endl;
+
+    format_doc(header, "Node indices of the elements of all Any and Many edges.", "    ");
+    header << "    std::vector<uint32_t> lists;" << std::endl << std::endl;
+
+    for (auto &node : nodes) {
+        if (node->derived.empty()) {
+            format_doc(header, "Columns for the `" + node->title_case_name + "` nodes.", "    ");
+            header << "    Flat" << node->title_case_name << " " << node->snake_case_name << "_rows;" << std::endl << std::endl;
+        }
+    }
+
+    auto doc = "Returns the number of nodes in the tree.";
+    format_doc(header, doc, "    ");
+    header << "    size_t size() const;" << std::endl << std::endl;
+    format_doc(source, doc);
+    source << "size_t FlatTree::size() const {" << std::endl;
+    source << "    return records.size();" << std::endl;
+    source << "}" << std::endl << std::endl;
+
+    // Conversion from the pointer-based representation.
+    doc = "Flattens the tree rooted at the given node. Frozen subtrees that "
+          "appear more than once (see `Completable::freeze()`) are stored "
+          "once, and all their parents refer to the same record. Throws a "
+          "`NotWellFormed` exception if any other node appears more than once "
+          "or a link refers to a node outside the tree. An empty root yields "
+          "an empty tree.";
+    format_doc(header, doc, "    ");
+    header << "    static FlatTree flatten(const Maybe<Node> &root);" << std::endl << std::endl;
+    format_doc(source, doc);
+    source << "FlatTree FlatTree::flatten(const Maybe<Node> &root) {" << std::endl;
+    source << "    FlatTree tree{};" << std::endl;
+    source << "    if (root.empty()) {" << std::endl;
+    source << "        return tree;" << std::endl;
+    source << "    }" << std::endl;
+    source << std::endl;
+    source << "    // Work items are either nodes to flatten, along with the slot that" << std::endl;
+    source << "    // receives their index, or markers for the end of a subtree." << std::endl;
+    source << "    struct Item {" << std::endl;
+    source << "        Maybe<Node> node;" << std::endl;
+    source << "        std::vector<uint32_t> *slot;" << std::endl;
+    source << "        size_t slot_index;" << std::endl;
+    source << "        uint32_t close;" << std::endl;
+    source << "    };" << std::endl;
+    source << std::endl;
+    source << "    // Links are resolved once all nodes have an index." << std::endl;
+    source << "    struct Fixup {" << std::endl;
+    source << "        std::vector<uint32_t> *slot;" << std::endl;
+    source << "        size_t slot_index;" << std::endl;
+    source << "        OptLink<Node> target;" << std::endl;
+    source << "    };" << std::endl;
+    source << std::endl;
+    source << "    " << support_ns << "::base::PointerMap ids{};" << std::endl;
+    source << "    std::vector<Item> stack{};" << std::endl;
+    source << "    std::vector<Fixup> fixups{};" << std::endl;
+    source << "    stack.push_back({root, nullptr, 0, NONE});" << std::endl;
+    source << "    while (!stack.empty()) {" << std::endl;
+    source << "        auto item = std::move(stack.back());" << std::endl;
+    source << "        stack.pop_back();" << std::endl;
+    source << "        if (item.close != NONE) {" << std::endl;
+    source << "            tree.records[item.close].end = (uint32_t)tree.records.size();" << std::endl;
+    source << "            continue;" << std::endl;
+    source << "        }" << std::endl;
+    source << "        if (tree.records.size() >= NONE) {" << std::endl;
+    source << "            throw " << support_ns << "::base::RuntimeError(\"tree is too large to flatten\");" << std::endl;
+    source << "        }" << std::endl;
+    source << "        auto index = (uint32_t)tree.records.size();" << std::endl;
+    source << "        if (!item.node.is_frozen()) {" << std::endl;
+    source << "            ids.add(item.node);" << std::endl;
+    source << "        } else if (!ids.add_shared(item.node)) {" << std::endl;
+    source << std::endl;
+    source << "            // Shared frozen subtrees are only flattened once; the" << std::endl;
+    source << "            // sequence numbers of the map match the record indices." << std::endl;
+    source << "            (*item.slot)[item.slot_index] = (uint32_t)ids.get(item.node);" << std::endl;
+    source << "            continue;" << std::endl;
+    source << "        }" << std::endl;
+    source << "        if (item.slot) {" << std::endl;
+    source << "            (*item.slot)[item.slot_index] = index;" << std::endl;
+    source << "        }" << std::endl;
+    source << "        stack.push_back({Maybe<Node>(), nullptr, 0, index});" << std::endl;
+    source << "        switch (item.node->type()) {" << std::endl;
+    for (auto &node : nodes) {
+        if (!node->derived.empty()) {
+            continue;
+        }
+        auto fields = node->all_fields();
+        source << "            case NodeType::" << node->title_case_name << ": {" << std::endl;
+        source << "                auto &node = static_cast<const " << tree_ns << "::" << node->title_case_name << "&>(*item.node);" << std::endl;
+        source << "                auto &rows = tree." << node->snake_case_name << "_rows;" << std::endl;
+        source << "                auto row = rows.records.size();" << std::endl;
+        source << "                tree.records.push_back({NodeType::" << node->title_case_name << ", (uint32_t)row, 0});" << std::endl;
+        source << "                rows.records.push_back(index);" << std::endl;
+        for (auto &field : fields) {
+            switch (field.type) {
+                case Maybe:
+                case One:
+                    source << "                rows." << field.name << ".push_back(NONE);" << std::endl;
+                    break;
+                case Any:
+                case Many:
+                    source << "                rows." << field.name << ".push_back({(uint32_t)tree.lists.size(), (uint32_t)node." << field.name << ".size()});" << std::endl;
+                    source << "                tree.lists.resize(tree.lists.size() + node." << field.name << ".size(), NONE);" << std::endl;
+                    break;
+                case OptLink:
+                case Link:
+                    source << "                rows." << field.name << ".push_back(NONE);" << std::endl;
+                    source << "                if (!node." << field.name << ".empty()) {" << std::endl;
+                    source << "                    fixups.push_back({&rows." << field.name << ", row, node." << field.name << "});" << std::endl;
+                    source << "                }" << std::endl;
+                    break;
+                case Prim:
+                    source << "                rows." << field.name << ".push_back(node." << field.name << ");" << std::endl;
+                    break;
+            }
+        }
+
+        // Push the children in reverse, so they are flattened in order.
+        bool has_children = false;
+        for (auto it = fields.rbegin(); it != fields.rend(); ++it) {
+            auto &field = *it;
+            switch (field.type) {
+                case Maybe:
+                case One:
+                    source << "                if (!node." << field.name << ".empty()) {" << std::endl;
+                    source << "                    stack.push_back({node." << field.name << ", &rows." << field.name << ", row, NONE});" << std::endl;
+                    source << "                }" << std::endl;
+                    has_children = true;
+                    break;
+                case Any:
+                case Many:
+                    source << "                {" << std::endl;
+                    source << "                    auto &vec = node." << field.name << ".get_vec();" << std::endl;
+                    source << "                    size_t begin = rows." << field.name << ".back().begin;" << std::endl;
+                    source << "                    for (size_t i = vec.size(); i-- > 0;) {" << std::endl;
+                    source << "                        if (!vec[i].empty()) {" << std::endl;
+                    source << "                            stack.push_back({vec[i], &tree.lists, begin + i, NONE});" << std::endl;
+                    source << "                        }" << std::endl;
+                    source << "                    }" << std::endl;
+                    source << "                }" << std::endl;
+                    has_children = true;
+                    break;
+                default:
+                    break;
+            }
+        }
+        if (!has_children && fields.empty()) {
+            source << "                (void) node;" << std::endl;
+        }
+        source << "                break;" << std::endl;
+        source << "            }" << std::endl;
+    }
+    source << "        }" << std::endl;
+    source << "    }" << std::endl;
+    source << "    for (auto &fixup : fixups) {" << std::endl;
+    source << "        (*fixup.slot)[fixup.slot_index] = (uint32_t)ids.get(fixup.target);" << std::endl;
+    source << "    }" << std::endl;
+    source << "    return tree;" << std::endl;
+    source << "}" << std::endl << std::endl;
+
+    // Conversion back to the pointer-based representation.
+    doc = "Reconstructs the pointer-based tree, including its links. Records "
+          "referred to by more than one edge become shared frozen subtrees "
+          "again. Returns an empty edge if the tree is empty.";
+    format_doc(header, doc, "    ");
+    header << "    One<Node> unflatten() const;" << std::endl << std::endl;
+    format_doc(source, doc);
+    source << "One<Node> FlatTree::unflatten() const {" << std::endl;
+    source << "    std::vector<One<Node>> nodes{};" << std::endl;
+    source << "    nodes.reserve(records.size());" << std::endl;
+    source << std::endl;
+    source << "    // Construct the nodes and their primitive fields first, so edges" << std::endl;
+    source << "    // and links can refer to nodes in any order." << std::endl;
+    source << "    for (auto &record : records) {" << std::endl;
+    source << "        switch (record.type) {" << std::endl;
+    for (auto &node : nodes) {
+        if (!node->derived.empty()) {
+            continue;
+        }
+        source << "            case NodeType::" << node->title_case_name << ": {" << std::endl;
+        source << "                auto node = " << support_ns << "::base::make<" << node->title_case_name << ">();" << std::endl;
+        for (auto &field : node->all_fields()) {
+            if (field.type == Prim) {
+                source << "                node->" << field.name << " = " << node->snake_case_name;
+                source << "_rows." << field.name << "[record.row];" << std::endl;
+            }
+        }
+        source << "                nodes.push_back(std::move(node));" << std::endl;
+        source << "                break;" << std::endl;
+        source << "            }" << std::endl;
+    }
+    source << "        }" << std::endl;
+    source << "    }" << std::endl;
+    source << std::endl;
+    source << "    // Connect the edges and links. Records that are the child of more" << std::endl;
+    source << "    // than one edge were shared frozen subtrees." << std::endl;
+    source << "    std::vector<bool> owned(records.size(), false);" << std::endl;
+    source << "    std::vector<uint32_t> shared{};" << std::endl;
+    source << "    auto child = [&](uint32_t index) -> const One<Node>& {" << std::endl;
+    source << "        if (owned[index]) {" << std::endl;
+    source << "            shared.push_back(index);" << std::endl;
+    source << "        }" << std::endl;
+    source << "        owned[index] = true;" << std::endl;
+    source << "        return nodes[index];" << std::endl;
+    source << "    };" << std::endl;
+    source << "    for (size_t index = 0; index < records.size(); index++) {" << std::endl;
+    source << "        auto &record = records[index];" << std::endl;
+    source << "        switch (record.type) {" << std::endl;
+    bool any_children = false;
+    for (auto &node : nodes) {
+        if (!node->derived.empty()) {
+            continue;
+        }
+        source << "            case NodeType::" << node->title_case_name << ": {" << std::endl;
+        bool any_edges = false;
+        for (auto &field : node->all_fields()) {
+            if (field.type != Prim) {
+                any_edges = true;
+            }
+        }
+        if (any_edges) {
+            source << "                auto &rows = " << node->snake_case_name << "_rows;" << std::endl;
+            source << "                auto &node = static_cast<" << node->title_case_name << "&>(*nodes[index]);" << std::endl;
+        }
+        for (auto &field : node->all_fields()) {
+            switch (field.type) {
+                case Maybe:
+                case One:
+                    source << "                if (rows." << field.name << "[record.row] != NONE) {" << std::endl;
+                    source << "                    node." << field.name << ".set(child(rows." << field.name << "[record.row]));" << std::endl;
+                    source << "                }" << std::endl;
+                    any_children = true;
+                    break;
+                case OptLink:
+                case Link:
+                    source << "                if (rows." << field.name << "[record.row] != NONE) {" << std::endl;
+                    source << "                    node." << field.name << ".set(nodes[rows." << field.name << "[record.row]]);" << std::endl;
+                    source << "                }" << std::endl;
+                    break;
+                case Any:
+                case Many:
+                    source << "                {" << std::endl;
+                    source << "                    auto range = rows." << field.name << "[record.row];" << std::endl;
+                    source << "                    auto &vec = node." << field.name << ".get_vec();" << std::endl;
+                    source << "                    vec.reserve(range.size);" << std::endl;
+                    source << "                    for (uint32_t i = range.begin; i < range.begin + range.size; i++) {" << std::endl;
+                    source << "                        if (lists[i] == NONE) {" << std::endl;
+                    source << "                            vec.emplace_back();" << std::endl;
+                    source << "                        } else {" << std::endl;
+                    source << "                            vec.emplace_back(child(lists[i]));" << std::endl;
+                    source << "                        }" << std::endl;
+                    source << "                    }" << std::endl;
+                    source << "                }" << std::endl;
+                    any_children = true;
+                    break;
+                case Prim:
+                    break;
+            }
+        }
+        source << "                break;" << std::endl;
+        source << "            }" << std::endl;
+    }
+    source << "        }" << std::endl;
+    source << "    }" << std::endl;
+    if (!any_children) {
+        source << "    (void) child;" << std::endl;
+    }
+    source << "    for (auto index : shared) {" << std::endl;
+    source << "        nodes[index].freeze();" << std::endl;
+    source << "    }" << std::endl;
+    source << "    if (nodes.empty()) {" << std::endl;
+    source << "        return One<Node>();" << std::endl;
+    source << "    }" << std::endl;
+    source << "    return nodes.front();" << std::endl;
+    source << "}" << std::endl << std::endl;
+
+    header << "};" << std::endl << std::endl;
+
+    // Print the class header for the visitor.
+    format_doc(
+        header,
+        "Base class for visitors over a `FlatTree`.\n\n"
+        "This works like `StaticVisitor`, except that the visit functions "
+        "take the tree and the index of the node record instead of a node "
+        "reference; use `FlatRecord::row` to look up the fields of the node "
+        "in the columns for its type. `walk()` visits all nodes in pre-order "
+        "with a linear scan over the records."
+    );
+    header << "template <class Derived, typename R = void>" << std::endl;
+    header << "class FlatVisitor {" << std::endl;
+    header << "protected:" << std::endl << std::endl;
+
+    format_doc(header, "Returns a reference to the derived visitor.", "    ");
+    header << "    Derived &derived() {" << std::endl;
+    header << "        return static_cast<Derived&>(*this);" << std::endl;
+    header << "    }" << std::endl << std::endl;
+
+    header << "public:" << std::endl << std::endl;
+
+    format_doc(header, "Visits the node at the given index with the visit function of `Derived` for its type.", "    ");
+    header << "    R visit(const FlatTree &tree, uint32_t index) {" << std::endl;
+    header << "        switch (tree.records[index].type) {" << std::endl;
+    for (auto &node : nodes) {
+        if (node->derived.empty()) {
+            header << "            case NodeType::" << node->title_case_name << ":" << std::endl;
+            header << "                return derived().visit_" << node->snake_case_name << "(tree, index);" << std::endl;
+        }
+    }
+    header << "        }" << std::endl;
+    header << "        return derived().visit_node(tree, index);" << std::endl;
+    header << "    }" << std::endl << std::endl;
+
+    format_doc(header, "Visits all nodes of the given tree in pre-order, discarding the results.", "    ");
+    header << "    void walk(const FlatTree &tree) {" << std::endl;
+    header << "        for (uint32_t index = 0; index < tree.records.size(); index++) {" << std::endl;
+    header << "            visit(tree, index);" << std::endl;
+    header << "        }" << std::endl;
+    header << "    }" << std::endl << std::endl;
+
+    for (auto &node : nodes) {
+        std::string node_doc;
+        if (node->derived.empty()) {
+            node_doc = "Visitor function for `" + node->title_case_name + "` nodes.";
+        } else {
+            node_doc = "Fallback function for `" + node->title_case_name + "` nodes.";
+        }
+        format_doc(header, node_doc, "    ");
+        header << "    R visit_" << node->snake_case_name << "(const FlatTree &tree, uint32_t index) {" << std::endl;
+        if (node->parent) {
+            header << "        return derived().visit_" << node->parent->snake_case_name << "(tree, index);" << std::endl;
+        } else {
+            header << "        return derived().visit_node(tree, index);" << std::endl;
+        }
+        header << "    }" << std::endl << std::endl;
+    }
+
+    header << "};" << std::endl << std::endl;
+}
+
+/**
+ * Generate the memory_usage() and stats() instrumentation functions.
+ */
+void generate_stats_functions(
+    std::ostream &header,
+    std::ostream &source,
+    Nodes &nodes,
+    const std::string &support_ns
+) {
+    size_t node_types = 0;
+    for (auto &node : nodes) {
+        if (node->derived.empty()) {
+            node_types++;
+        }
+    }
+
+    auto doc = "Measures the memory used by the tree starting at the given node or "
+               "edge, per node type, along with the occupancy of its Any/Many edges "
+               "and its annotations.";
+    format_doc(header, doc);
+    header << support_ns << "::base::MemoryUsage memory_usage(const " << support_ns;
+    header << "::base::Completable &tree);" << std::endl << std::endl;
+    format_doc(source, doc);
+    source << support_ns << "::base::MemoryUsage memory_usage(const " << support_ns;
+    source << "::base::Completable &tree) {" << std::endl;
+    source << "    " << support_ns << "::base::MemoryUsage usage{Node::TYPE_NAMES, " << node_types << "};" << std::endl;
+    source << "    tree.measure(usage);" << std::endl;
+    source << "    return usage;" << std::endl;
+    source << "}" << std::endl << std::endl;
+
+    doc = "Returns a snapshot of the live and peak allocation counts of the node "
+          "types, and of the time spent in the support library entry points. "
+          "These are only counted when the support library is configured with "
+          "`TREE_STATS`.";
+    format_doc(header, doc);
+    header << support_ns << "::base::StatsSnapshot stats();" << std::endl << std::endl;
+    format_doc(source, doc);
+    source << support_ns << "::base::StatsSnapshot stats() {" << std::endl;
+    source << "    " << support_ns << "::base::StatsSnapshot snapshot{};" << std::endl;
+    for (auto &node : nodes) {
+        if (node->derived.empty()) {
+            source << "    snapshot.add_node(\"" << node->title_case_name << "\", ";
+            source << support_ns << "::base::AllocationCounter::of<" << node->title_case_name << ">());" << std::endl;
+        }
+    }
+    source << "    return snapshot;" << std::endl;
+    source << "}" << std::endl << std::endl;
+}
+
+/**
+ * Returns the given filename with the given suffix inserted in front of its
+ * extension, which starts at the first period of the file's basename.
+ */
+std::string insert_suffix(const std::string &filename, const std::string &suffix) {
+    auto sep_pos = filename.find_last_of("/\\");
+    auto base_pos = (sep_pos == std::string::npos) ? 0 : sep_pos + 1;
+    auto ext_pos = filename.find('.', base_pos);
+    if (ext_pos == std::string::npos) {
+        return filename + suffix;
+    }
+    return filename.substr(0, ext_pos) + suffix + filename.substr(ext_pos);
+}
+
+/**
+ * Returns the filename of the given shard of the source file.
+ */
+std::string shard_filename(const std::string &source_filename, size_t shard) {
+    if (!shard) {
+        return source_filename;
+    }
+    return insert_suffix(source_filename, "-" + std::to_string(shard));
+}
+
+/**
+ * Returns the shard that the source file section with the given name is
+ * written to, based on its FNV-1a hash.
+ */
+size_t shard_of(const std::string &name, size_t shards) {
+    uint32_t hash = 2166136261u;
+    for (unsigned char c : name) {
+        hash ^= c;
+        hash *= 16777619u;
+    }
+    return hash % shards;
+}
+
 /**
  * Generate the complete C++ code (source and header).
  */
 void generate(
     const std::string &header_filename,
     const std::string &source_filename,
-    Specification &specification
+    Specification &specification,
+    size_t shards
 ) {
     auto nodes = specification.nodes;
 
-    // Open the output files.
-    auto header = std::ofstream(header_filename);
-    if (!header.is_open()) {
-        std::cerr << "Failed to open header file for writing" << std::endl;
-        std::exit(1);
-    }
-    auto source = std::ofstream(source_filename);
-    if (!source.is_open()) {
-        std::cerr << "Failed to open source file for writing" << std::endl;
-        std::exit(1);
-    }
+    // The files are generated in memory, such that they are only written when
+    // their contents change. The source file is generated as a sequence of
+    // named sections, which are distributed over the shards in sharded mode.
+    std::ostringstream header;
+    std::ostringstream forward;
+    std::ostringstream source;
+    std::ostringstream source_head;
+    std::vector<std::pair<std::string, std::string>> sections;
+    auto end_section = [&](const std::string &name) {
+        sections.emplace_back(name, source.str());
+        source.str("");
+    };
 
     // Strip the path from the header filename such that it can be used for the
     // include guard and the #include directive in the source file.
@@ -1290,6 +3577,7 @@ void generate(
         sep_pos = backslash_pos;
     }
     auto header_basename = header_filename.substr(sep_pos + 1);
+    auto forward_basename = insert_suffix(header_basename, "-fwd");
 
     // Generate the include guard name.
     std::string include_guard = header_basename;
@@ -1316,6 +3604,9 @@ void generate(
     for (auto &include : specification.includes) {
         header << "#" << include << std::endl;
     }
+    if (shards) {
+        header << "#include \"" << forward_basename << "\"" << std::endl;
+    }
     header << std::endl;
     for (size_t i = 0; i < specification.namespaces.size(); i++) {
         if (i == specification.namespaces.size() - 1 && !specification.namespace_doc.empty()) {
@@ -1419,41 +3710,75 @@ void generate(
         header << std::endl;
     }
 
-    // Header for the source file.
+    // Header for the source file(s).
     if (!specification.source_doc.empty()) {
-        format_doc(source, specification.source_doc, "", "\\file");
-        source << std::endl;
+        format_doc(source_head, specification.source_doc, "", "\\file");
+        source_head << std::endl;
     }
     for (auto &include : specification.src_includes) {
-        source << "#" << include << std::endl;
+        source_head << "#" << include << std::endl;
     }
     if (!specification.header_fname.empty()) {
-        source << "#include \"" << specification.header_fname << "\"" << std::endl;
+        source_head << "#include \"" << specification.header_fname << "\"" << std::endl;
     } else {
-        source << "#include \"" << header_basename << "\"" << std::endl;
+        source_head << "#include \"" << header_basename << "\"" << std::endl;
     }
-    source << std::endl;
+    source_head << std::endl;
     for (auto &name : specification.namespaces) {
-        source << "namespace " << name << " {" << std::endl;
+        source_head << "namespace " << name << " {" << std::endl;
+    }
+    source_head << std::endl;
+
+    // In sharded mode, the forward declarations and the NodeType enum go in a
+    // separate header that does not depend on anything else, so code that
+    // only passes nodes around need not include the complete header.
+    std::ostream &declarations = shards ? static_cast<std::ostream&>(forward) : header;
+    if (shards) {
+        format_doc(forward, "Forward declarations for the classes in " + header_basename + ".", "", "\\file");
+        forward << std::endl;
+        forward << "#pragma once" << std::endl;
+        forward << std::endl;
+        forward << "#include <cstdint>" << std::endl;
+        forward << std::endl;
+        for (auto &name : specification.namespaces) {
+            forward << "namespace " << name << " {" << std::endl;
+        }
+        forward << std::endl;
     }
-    source << std::endl;
 
     // Generate forward references for all the classes.
-    header << "// Forward declarations for all classes." << std::endl;
-    header << "class Node;" << std::endl;
+    declarations << "// Forward declarations for all classes." << std::endl;
+    declarations << "class Node;" << std::endl;
     for (auto &node : nodes) {
-        header << "class " << node->title_case_name << ";" << std::endl;
-    }
-    header << "class VisitorBase;" << std::endl;
-    header << "template <typename T = void>" << std::endl;
-    header << "class Visitor;" << std::endl;
-    header << "class RecursiveVisitor;" << std::endl;
-    header << "class Dumper;" << std::endl;
-    header << "class JsonDumper;" << std::endl;
-    header << std::endl;
+        declarations << "class " << node->title_case_name << ";" << std::endl;
+    }
+    declarations << "class VisitorBase;" << std::endl;
+    declarations << "template <typename T = void>" << std::endl;
+    declarations << "class Visitor;" << std::endl;
+    declarations << "class RecursiveVisitor;" << std::endl;
+    declarations << "template <typename T>" << std::endl;
+    declarations << "class MemoVisitor;" << std::endl;
+    declarations << "template <typename T>" << std::endl;
+    declarations << "class ParallelReduceVisitor;" << std::endl;
+    declarations << "template <class Derived, typename R>" << std::endl;
+    declarations << "class StaticVisitor;" << std::endl;
+    declarations << "class Walker;" << std::endl;
+    declarations << "class ParentIndex;" << std::endl;
+    declarations << "class Dumper;" << std::endl;
+    declarations << "class JsonDumper;" << std::endl;
+    declarations << "class FlatTree;" << std::endl;
+    declarations << std::endl;
 
     // Generate the NodeType enum.
-    generate_enum(header, nodes);
+    generate_enum(declarations, nodes);
+    if (shards) {
+        for (auto name_it = specification.namespaces.rbegin(); name_it != specification.namespaces.rend(); name_it++) {
+            forward << "} // namespace " << *name_it << std::endl;
+        }
+    }
+
+    // Generate the work item types for the iterative walker.
+    generate_walk_types(header);
 
     // Generate the base class.
     generate_base_class(
@@ -1463,8 +3788,10 @@ void generate(
         !specification.serialize_fn.empty(),
         specification.support_namespace
     );
+    end_section("base");
 
     // Generate the node classes.
+    auto ranges = compute_type_ranges(nodes);
     std::unordered_set<std::string> generated;
     for (auto node : nodes) {
         if (generated.count(node->snake_case_name)) {
@@ -1481,16 +3808,39 @@ void generate(
                 continue;
             }
             generated.insert(node->snake_case_name);
-            generate_node_class(header, source, specification, *node);
+            generate_node_class(header, source, specification, *node, ranges);
+            end_section(node->snake_case_name);
         }
     }
 
+    // Generate the typecast functions, now that all node types are complete.
+    generate_typecast_definitions(header, nodes);
+
     // Generate the visitor classes.
     generate_visitor_base_class(header, source, nodes);
+    end_section("@visitor_base");
     generate_visitor_class(header, source, nodes);
+    end_section("@visitor");
     generate_recursive_visitor_class(header, source, nodes);
+    end_section("@recursive_visitor");
+    generate_memo_visitor_class(header, specification.support_namespace);
+    generate_parallel_reduce_visitor_class(header, specification.support_namespace);
+    generate_walker_class(header, source);
+    end_section("@walker");
+    generate_parent_index_class(header, source, specification.support_namespace);
+    end_section("@parent_index");
     generate_dumper_class(header, source, nodes, specification.source_location, specification.support_namespace);
-    generate_json_dumper_class(header, source, nodes, specification.source_location);
+    end_section("@dumper");
+    generate_json_dumper_class(header, source, nodes, specification.source_location, specification.support_namespace);
+    end_section("@json_dumper");
+
+    // Generate the flattened tree representation.
+    generate_flat_classes(header, source, nodes, specification.namespaces, specification.support_namespace);
+    end_section("@flat_tree");
+
+    // Generate the instrumentation functions.
+    generate_stats_functions(header, source, nodes, specification.support_namespace);
+    end_section("@stats");
 
     // Generate the templated visit method and its specialization for void
     // return type.
@@ -1520,20 +3870,43 @@ void generate(
     source << "    const_cast<Node&>(object).dump(os);" << std::endl;
     source << "    return os;" << std::endl;
     source << "}" << std::endl << std::endl;
+    end_section("@node");
 
     // Close the namespaces.
+    std::ostringstream source_tail;
     for (auto name_it = specification.namespaces.rbegin(); name_it != specification.namespaces.rend(); name_it++) {
         header << "} // namespace " << *name_it << std::endl;
-        source << "} // namespace " << *name_it << std::endl;
+        source_tail << "} // namespace " << *name_it << std::endl;
     }
     header << std::endl;
-    source << std::endl;
+    source_tail << std::endl;
 
     format_doc(header, "std::ostream support via fmt (uses operator<<).");
     auto namespaces = fmt::format("{}::", fmt::join(specification.namespaces, "::"));
     for (auto &node : nodes) {
         header << "template <> struct fmt::formatter<" << namespaces << node->title_case_name << "> : ostream_formatter {};" << std::endl;
     }
+
+    // Write the files. In sharded mode, each section goes to the shard
+    // selected by a hash of its name, so adding or removing nodes does not
+    // move the other sections to different shards.
+    write_file(header_filename, header.str());
+    if (!shards) {
+        std::string contents = source_head.str();
+        for (auto &section : sections) {
+            contents += section.second;
+        }
+        write_file(source_filename, contents + source_tail.str());
+        return;
+    }
+    write_file(insert_suffix(header_filename, "-fwd"), forward.str());
+    std::vector<std::string> shard_contents(shards, source_head.str());
+    for (auto &section : sections) {
+        shard_contents[shard_of(section.first, shards)] += section.second;
+    }
+    for (size_t shard = 0; shard < shards; shard++) {
+        write_file(shard_filename(source_filename, shard), shard_contents[shard] + source_tail.str());
+    }
 }
 
 } // namespace tree_gen::cpp
@@ -17,12 +17,20 @@
 namespace tree_gen::cpp {
 
 /**
- * Generate the complete C++ code (source and header).
+ * Generate the complete C++ code (source and header). If shards is nonzero,
+ * the source code is split over that many translation units, which can be
+ * compiled in parallel, and the forward declarations go in a separate header.
+ * The first shard is written to source_filename, and shard i > 0 to
+ * source_filename with -i inserted in front of its extension (the part of its
+ * basename from the first period onward). The forward declaration header is
+ * named after header_filename in the same way, with -fwd inserted. Files of
+ * which the contents do not change are not rewritten.
  */
 void generate(
     const std::string &header_filename,
     const std::string &source_filename,
-    Specification &specification
+    Specification &specification,
+    size_t shards = 0
 );
 
 } // namespace tree_gen::cpp
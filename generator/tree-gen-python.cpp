@@ -2,8 +2,10 @@
  * Python generation source file for \ref tree-gen.
  */
 
-#include <fstream>
-#include <iostream>
+#include <algorithm>
+#include <cctype>
+#include <ostream>
+#include <sstream>
 #include <unordered_set>
 #include "tree-gen-python.hpp"
 
@@ -14,7 +16,7 @@ namespace python {
  * Formats a Python docstring.
  */
 void format_doc(
-    std::ofstream &stream,
+    std::ostream &stream,
     const std::string &doc,
     const std::string &indent = ""
 ) {
@@ -67,7 +69,7 @@ void format_doc(
  * derived from the given node class.
  */
 void generate_deserialize_mux(
-    std::ofstream &output,
+    std::ostream &output,
     Node &node
 ) {
     if (node.derived.empty()) {
@@ -80,11 +82,170 @@ void generate_deserialize_mux(
     }
 }
 
+/**
+ * Returns the @T code of the CBOR serialization of the given edge type.
+ */
+const char *edge_type_code(EdgeType type) {
+    switch (type) {
+        case Maybe:   return "?";
+        case One:     return "1";
+        case Any:     return "*";
+        case Many:    return "+";
+        case OptLink: return "@";
+        case Link:    return "$";
+        case Prim:    break;
+    }
+    throw std::runtime_error("internal error, should be unreachable");
+}
+
+/**
+ * Returns the contents of a Python bytes literal for the CBOR serialization of
+ * the given UTF-8 string.
+ */
+std::string cbor_text_literal(const std::string &text) {
+    std::string bytes;
+    if (text.size() < 24) {
+        bytes += static_cast<char>(0x60 | text.size());
+    } else if (text.size() < 0x100) {
+        bytes += static_cast<char>(0x78);
+        bytes += static_cast<char>(text.size());
+    } else {
+        throw std::runtime_error("internal error, string too long for a CBOR key literal");
+    }
+    auto head_size = bytes.size();
+    bytes += text;
+    std::ostringstream literal;
+    for (size_t i = 0; i < bytes.size(); i++) {
+        auto byte = static_cast<unsigned char>(bytes[i]);
+        if (i >= head_size && (std::isalnum(byte) || byte == '_' || byte == '@')) {
+            literal << bytes[i];
+        } else {
+            literal << "\\x" << "0123456789abcdef"[byte >> 4] << "0123456789abcdef"[byte & 15];
+        }
+    }
+    return literal.str();
+}
+
+/**
+ * Prints the code that deserializes the given field from its Python
+ * representation in the local variable named field into the local variable
+ * f_<name>, as used by both _deserialize() and _read(). For links, the
+ * sequence number of the target is stored in l_<name> instead.
+ */
+void generate_field_deserialize(
+    std::ostream &output,
+    Specification &spec,
+    const Field &field,
+    const std::string &indent
+) {
+    output << indent << "if not isinstance(field, dict):" << std::endl;
+    output << indent << "    raise ValueError('missing or invalid serialization of field " << field.name << "')" << std::endl;
+    auto type = (field.type == Prim) ? field.ext_type : field.type;
+    auto type_name = (field.type == Prim) ? field.py_prim_type : field.node_type->title_case_name;
+    auto multi_name = (field.type == Prim) ? field.py_multi_type : ("Multi" + field.node_type->title_case_name);
+    if (type != Prim) {
+        output << indent << "if field.get('@T') != '" << edge_type_code(type) << "':" << std::endl;
+        output << indent << "    raise ValueError('unexpected edge type for field " << field.name << "')" << std::endl;
+    }
+    switch (type) {
+        case Maybe:
+        case One:
+            output << indent << "if '@l' in field and '@t' not in field:" << std::endl;
+            output << indent << "    f_" << field.name << " = _read_shared(None, field['@l'], " << type_name << ", seq_to_ob, links)" << std::endl;
+            output << indent << "elif field.get('@t', None) is None:" << std::endl;
+            output << indent << "    f_" << field.name << " = None" << std::endl;
+            output << indent << "else:" << std::endl;
+            output << indent << "    f_" << field.name << " = " << type_name << "._deserialize(field, seq_to_ob, links)" << std::endl;
+            break;
+        case Any:
+        case Many:
+            output << indent << "data = field.get('@d', None)" << std::endl;
+            output << indent << "if not isinstance(data, list):" << std::endl;
+            output << indent << "    raise ValueError('missing serialization of Any/Many contents')" << std::endl;
+            output << indent << "f_" << field.name << " = " << multi_name << "()" << std::endl;
+            output << indent << "for element in data:" << std::endl;
+            output << indent << "    if element.get('@T') != '1':" << std::endl;
+            output << indent << "        raise ValueError('unexpected edge type for Any/Many element')" << std::endl;
+            output << indent << "    if '@l' in element and '@t' not in element:" << std::endl;
+            output << indent << "        f_" << field.name << ".append(_read_shared(None, element['@l'], " << type_name << ", seq_to_ob, links))" << std::endl;
+            output << indent << "    else:" << std::endl;
+            output << indent << "        f_" << field.name << ".append(" << type_name << "._deserialize(element, seq_to_ob, links))" << std::endl;
+            break;
+        case Link:
+        case OptLink:
+            output << indent << "f_" << field.name << " = None" << std::endl;
+            output << indent << "l_" << field.name << " = field.get('@l', None)" << std::endl;
+            break;
+        case Prim:
+            output << indent << "if hasattr(" << field.py_prim_type << ", 'deserialize_cbor'):" << std::endl;
+            output << indent << "    f_" << field.name << " = " << field.py_prim_type << ".deserialize_cbor(field)" << std::endl;
+            output << indent << "else:" << std::endl;
+            if (spec.py_deserialize_fn.empty()) {
+                output << indent << "    raise ValueError('no deserialization function seems to exist for field type " << field.py_prim_type << "')" << std::endl;
+            } else {
+                output << indent << "    f_" << field.name << " = " << spec.py_deserialize_fn << "(" << field.py_prim_type << ", field)" << std::endl;
+            }
+            break;
+    }
+}
+
+/**
+ * Prints the code that serializes the given field of self to its Python
+ * representation in cbor['<name>'], as used by both _serialize() and
+ * _write().
+ */
+void generate_field_serialize(
+    std::ostream &output,
+    Specification &spec,
+    const Field &field
+) {
+    auto type = (field.type == Prim) ? field.ext_type : field.type;
+    if (type == Prim) {
+        output << "        if hasattr(self._attr_" << field.name << ", 'serialize_cbor'):" << std::endl;
+        output << "            cbor['" << field.name << "'] = self._attr_" << field.name << ".serialize_cbor()" << std::endl;
+        output << "        else:" << std::endl;
+        if (spec.py_serialize_fn.empty()) {
+            output << "            raise ValueError('no serialization function seems to exist for field type " << field.py_prim_type << "')" << std::endl;
+        } else {
+            output << "            cbor['" << field.name << "'] = " << spec.py_serialize_fn << "(" << field.py_prim_type << ", self._attr_" << field.name << ")" << std::endl;
+        }
+    } else {
+        output << "        field = {'@T': '" << edge_type_code(type) << "'}" << std::endl;
+        switch (type) {
+            case Maybe:
+            case One:
+                output << "        if self._attr_" << field.name << " is None:" << std::endl;
+                output << "            field['@t'] = None" << std::endl;
+                output << "        else:" << std::endl;
+                output << "            field.update(self._attr_" << field.name << "._serialize(id_map))" << std::endl;
+                break;
+            case Any:
+            case Many:
+                output << "        lst = []" << std::endl;
+                output << "        for el in self._attr_" << field.name << ":" << std::endl;
+                output << "            el = el._serialize(id_map)" << std::endl;
+                output << "            el['@T'] = '1'" << std::endl;
+                output << "            lst.append(el)" << std::endl;
+                output << "        field['@d'] = lst" << std::endl;
+                break;
+            case Link:
+            case OptLink:
+                output << "        if self._attr_" << field.name << " is None:" << std::endl;
+                output << "            field['@l'] = None" << std::endl;
+                output << "        else:" << std::endl;
+                output << "            field['@l'] = id_map[id(self._attr_" << field.name << ")]" << std::endl;
+                break;
+            case Prim:    throw std::runtime_error("internal error, should be unreachable");
+        }
+        output << "        cbor['" << field.name << "'] = field" << std::endl;
+    }
+}
+
 /**
  * Generates the class for the given node.
  */
 void generate_node_class(
-    std::ofstream &output,
+    std::ostream &output,
     Specification &spec,
     Node &node
 ) {
@@ -504,60 +665,10 @@ void generate_node_class(
                 output << std::endl;
                 output << "        # Deserialize the " << field.name << " field." << std::endl;
                 output << "        field = cbor.get('" << field.name << "', None)" << std::endl;
-                output << "        if not isinstance(field, dict):" << std::endl;
-                output << "            raise ValueError('missing or invalid serialization of field " << field.name << "')" << std::endl;
+                generate_field_deserialize(output, spec, field, "        ");
                 auto type = (field.type == Prim) ? field.ext_type : field.type;
-                auto type_name = (field.type == Prim) ? field.py_prim_type : field.node_type->title_case_name;
-                auto multi_name = (field.type == Prim) ? field.py_multi_type : ("Multi" + field.node_type->title_case_name);
-                if (type != Prim) {
-                    output << "        if field.get('@T') != '";
-                    switch (type) {
-                        case Maybe:   output << "?"; break;
-                        case One:     output << "1"; break;
-                        case Any:     output << "*"; break;
-                        case Many:    output << "+"; break;
-                        case OptLink: output << "@"; break;
-                        case Link:    output << "$"; break;
-                        case Prim:    throw std::runtime_error("internal error, should be unreachable");
-                    }
-                    output << "':" << std::endl;
-                    output << "            raise ValueError('unexpected edge type for field " << field.name << "')" << std::endl;
-                }
-                switch (type) {
-                    case Maybe:
-                    case One:
-                        output << "        if field.get('@t', None) is None:" << std::endl;
-                        output << "            f_" << field.name << " = None" << std::endl;
-                        output << "        else:" << std::endl;
-                        output << "            f_" << field.name << " = " << type_name << "._deserialize(field, seq_to_ob, links)" << std::endl;
-                        break;
-                    case Any:
-                    case Many:
-                        output << "        data = field.get('@d', None)" << std::endl;
-                        output << "        if not isinstance(data, list):" << std::endl;
-                        output << "            raise ValueError('missing serialization of Any/Many contents')" << std::endl;
-                        output << "        f_" << field.name << " = " << multi_name << "()" << std::endl;
-                        output << "        for element in data:" << std::endl;
-                        output << "            if element.get('@T') != '1':" << std::endl;
-                        output << "                raise ValueError('unexpected edge type for Any/Many element')" << std::endl;
-                        output << "            f_" << field.name << ".append(" << type_name << "._deserialize(element, seq_to_ob, links))" << std::endl;
-                        break;
-                    case Link:
-                    case OptLink:
-                        output << "        f_" << field.name << " = None" << std::endl;
-                        output << "        l_" << field.name << " = field.get('@l', None)" << std::endl;
-                        links.push_back(field.name);
-                        break;
-                    case Prim:
-                        output << "        if hasattr(" << field.py_prim_type << ", 'deserialize_cbor'):" << std::endl;
-                        output << "            f_" << field.name << " = " << field.py_prim_type << ".deserialize_cbor(field)" << std::endl;
-                        output << "        else:" << std::endl;
-                        if (spec.py_deserialize_fn.empty()) {
-                            output << "            raise ValueError('no deserialization function seems to exist for field type " << field.py_prim_type << "')" << std::endl;
-                        } else {
-                            output << "            f_" << field.name << " = " << spec.py_deserialize_fn << "(" << field.py_prim_type << ", field)" << std::endl;
-                        }
-                        break;
+                if (type == Link || type == OptLink) {
+                    links.push_back(field.name);
                 }
             }
             output << std::endl;
@@ -599,7 +710,10 @@ void generate_node_class(
         output << "            raise ValueError('sequence number field (@i) is not an integer or missing from node serialization')" << std::endl;
         output << "        if seq in seq_to_ob:" << std::endl;
         output << "            raise ValueError('duplicate sequence number %d' % seq)" << std::endl;
-        output << "        seq_to_ob[seq] = node" << std::endl << std::endl;
+        output << "        seq_to_ob[seq] = node" << std::endl;
+        output << "        sources = getattr(seq_to_ob, 'sources', None)" << std::endl;
+        output << "        if sources is not None:" << std::endl;
+        output << "            sources[seq] = cbor" << std::endl << std::endl;
         output << "        return node" << std::endl;
     } else {
         generate_deserialize_mux(output, node);
@@ -620,71 +734,190 @@ void generate_node_class(
     for (const auto &field : all_fields) {
         output << std::endl;
         output << "        # Serialize the " << field.name << " field." << std::endl;
-        auto type = (field.type == Prim) ? field.ext_type : field.type;
-        auto type_name = (field.type == Prim) ? field.py_prim_type : field.node_type->title_case_name;
-        if (type == Prim) {
-            output << "        if hasattr(self._attr_" << field.name << ", 'serialize_cbor'):" << std::endl;
-            output << "            cbor['" << field.name << "'] = self._attr_" << field.name << ".serialize_cbor()" << std::endl;
-            output << "        else:" << std::endl;
-            if (spec.py_serialize_fn.empty()) {
-                output << "            raise ValueError('no serialization function seems to exist for field type " << field.py_prim_type << "')" << std::endl;
+        generate_field_serialize(output, spec, field);
+    }
+    output << std::endl;
+    output << "        # Serialize annotations." << std::endl;
+    output << "        for key, val in self._annot.items():" << std::endl;
+    if (spec.py_serialize_fn.empty()) {
+        output << "            try:" << std::endl;
+        output << "                cbor['{%s}' % key] = _py_to_cbor(val)" << std::endl;
+        output << "            except TypeError:" << std::endl;
+        output << "                pass" << std::endl;
+    } else {
+        output << "            cbor['{%s}' % key] = _py_to_cbor(" << spec.py_serialize_fn << "(key, val))" << std::endl;
+    }
+    output << std::endl;
+    output << "        return cbor" << std::endl << std::endl;
+
+    // Print the _read() and _write() functions, which (de)serialize straight
+    // from/to the CBOR representation without going through the Python
+    // representation of _deserialize() and _serialize().
+    if (node.derived.empty()) {
+        std::vector<const Field*> links;
+        bool has_fallback = false;
+        output << "    @staticmethod" << std::endl;
+        output << "    def _read(cbor, offset, remaining, seq, seq_to_ob, links):" << std::endl;
+        format_doc(output,
+                   "Deserializes a node of this type from the remaining "
+                   "key-value pairs of its CBOR map, which start at "
+                   "cbor[offset], following its @t entry. remaining is the "
+                   "number of pairs left (negative for an indefinite-length "
+                   "map), seq is the sequence number of the node if it has "
+                   "been read already, and seq_to_ob and links are as for "
+                   "the _deserialize() function. Returns the node and the "
+                   "offset immediately following the map.",
+                   "        ");
+        for (const auto &field : all_fields) {
+            output << "        f_" << field.name << " = _MISSING" << std::endl;
+        }
+        output << "        annotations = []" << std::endl;
+        output << "        while remaining:" << std::endl;
+        output << "            if remaining < 0 and cbor[offset] == 0xFF:" << std::endl;
+        output << "                offset += 1" << std::endl;
+        output << "                break" << std::endl;
+        output << "            remaining -= 1" << std::endl;
+        output << "            key, offset = _cbor_read_key(cbor, offset)" << std::endl;
+        for (const auto &field : all_fields) {
+            output << "            if key == '" << field.name << "':" << std::endl;
+            if (field.type == Maybe || field.type == One) {
+                output << "                f_" << field.name << ", offset = _read_node(cbor, offset, ";
+                output << field.node_type->title_case_name << ", '" << edge_type_code(field.type);
+                output << "', seq_to_ob, links)" << std::endl;
+            } else if (field.type == Any || field.type == Many) {
+                output << "                f_" << field.name << ", offset = _read_nodes(cbor, offset, Multi";
+                output << field.node_type->title_case_name << ", '" << edge_type_code(field.type);
+                output << "', seq_to_ob, links)" << std::endl;
             } else {
-                output << "            cbor['" << field.name << "'] = " << spec.py_serialize_fn << "(" << field.py_prim_type << ", self._attr_" << field.name << ")" << std::endl;
+                output << "                field, offset = _sub_cbor_to_py(cbor, offset)" << std::endl;
+                generate_field_deserialize(output, spec, field, "                ");
             }
+            output << "                continue" << std::endl;
+        }
+        output << "            value, offset = _sub_cbor_to_py(cbor, offset)" << std::endl;
+        output << "            if key == '@i':" << std::endl;
+        output << "                seq = value" << std::endl;
+        output << "            elif key.startswith('{') and key.endswith('}'):" << std::endl;
+        output << "                annotations.append((key[1:-1], value))" << std::endl;
+        output << std::endl;
+        output << "        # Construct the " << node.title_case_name << " node." << std::endl;
+        output << "        node = " << node.title_case_name << ".__new__(" << node.title_case_name << ")" << std::endl;
+        output << "        node._annot = {}" << std::endl;
+        for (const auto &field : all_fields) {
+            auto type = (field.type == Prim) ? field.ext_type : field.type;
+            output << "        if f_" << field.name << " is _MISSING:" << std::endl;
+            output << "            raise ValueError('missing or invalid serialization of field " << field.name << "')" << std::endl;
+            if (type == Link || type == OptLink) {
+                output << "        node._attr_" << field.name << " = None" << std::endl;
+                links.push_back(&field);
+            } else if (field.type != Prim) {
+                output << "        node._attr_" << field.name << " = f_" << field.name << std::endl;
+            } else if (type == Prim) {
+                output << "        if isinstance(f_" << field.name << ", " << field.py_prim_type << "):" << std::endl;
+                output << "            node._attr_" << field.name << " = f_" << field.name << std::endl;
+                output << "        else:" << std::endl;
+                output << "            node." << field.name << " = f_" << field.name << std::endl;
+            } else {
+                output << "        node." << field.name << " = f_" << field.name << std::endl;
+            }
+        }
+        for (const auto link : links) {
+            output << "        links.append((lambda val: " << node.title_case_name << "." << link->name << ".fset(node, val), l_" << link->name << "))" << std::endl;
+        }
+        output << "        for key, val in annotations:" << std::endl;
+        if (spec.py_deserialize_fn.empty()) {
+            output << "            node[key] = val" << std::endl;
         } else {
-            output << "        field = {'@T': '";
-            switch (type) {
-                case Maybe:   output << "?"; break;
-                case One:     output << "1"; break;
-                case Any:     output << "*"; break;
-                case Many:    output << "+"; break;
-                case OptLink: output << "@"; break;
-                case Link:    output << "$"; break;
-                case Prim:    throw std::runtime_error("internal error, should be unreachable");
+            output << "            node[key] = " << spec.py_deserialize_fn << "(key, val)" << std::endl;
+        }
+        output << std::endl;
+        output << "        # Register node in sequence number lookup." << std::endl;
+        output << "        if not isinstance(seq, int):" << std::endl;
+        output << "            raise ValueError('sequence number field (@i) is not an integer or missing from node serialization')" << std::endl;
+        output << "        if seq in seq_to_ob:" << std::endl;
+        output << "            raise ValueError('duplicate sequence number %d' % seq)" << std::endl;
+        output << "        seq_to_ob[seq] = node" << std::endl;
+        output << "        return node, offset" << std::endl << std::endl;
+
+        // The CBOR maps are written with sorted keys, just like _py_to_cbor()
+        // does for the result of _serialize(). Annotation keys always sort
+        // after the field names, since those cannot contain '{'.
+        auto sorted_fields = all_fields;
+        std::sort(sorted_fields.begin(), sorted_fields.end(), [](const Field &a, const Field &b) {
+            return a.name < b.name;
+        });
+        output << "    def _write(self, out, id_map, edge):" << std::endl;
+        format_doc(output,
+                   "Appends the CBOR serialization of this node to the "
+                   "bytearray out, byte-for-byte equal to "
+                   "_py_to_cbor(self._serialize(id_map)). edge optionally "
+                   "specifies the CBOR serialization of the @T entry to add "
+                   "to the map, if the node is written as part of an edge.",
+                   "        ");
+        output << "        annotations = []" << std::endl;
+        output << "        for key, val in self._annot.items():" << std::endl;
+        if (spec.py_serialize_fn.empty()) {
+            output << "            try:" << std::endl;
+            output << "                annotations.append(('{%s}' % key, _py_to_cbor(val)))" << std::endl;
+            output << "            except TypeError:" << std::endl;
+            output << "                pass" << std::endl;
+        } else {
+            output << "            annotations.append(('{%s}' % key, _py_to_cbor(" << spec.py_serialize_fn << "(key, val))))" << std::endl;
+        }
+        output << "        if edge is None:" << std::endl;
+        output << "            out += _cbor_write_intlike(" << (all_fields.size() + 2) << " + len(annotations), 5)" << std::endl;
+        output << "        else:" << std::endl;
+        output << "            out += _cbor_write_intlike(" << (all_fields.size() + 3) << " + len(annotations), 5)" << std::endl;
+        output << "            out += edge" << std::endl;
+        output << "        out += b'" << cbor_text_literal("@i") << "'" << std::endl;
+        output << "        out += _cbor_write_intlike(id_map[id(self)])" << std::endl;
+        output << "        out += b'" << cbor_text_literal("@t") << cbor_text_literal(node.title_case_name) << "'" << std::endl;
+        for (const auto &field : sorted_fields) {
+            if (field.type == Prim) {
+                if (!has_fallback) {
+                    output << "        cbor = {}" << std::endl;
+                    has_fallback = true;
+                }
+                generate_field_serialize(output, spec, field);
             }
-            output << "'}" << std::endl;
-            switch (type) {
+        }
+        for (const auto &field : sorted_fields) {
+            auto edge = field.type == Prim ? std::string() : cbor_text_literal("@T") + cbor_text_literal(edge_type_code(field.type));
+            output << "        out += b'" << cbor_text_literal(field.name);
+            switch (field.type) {
                 case Maybe:
                 case One:
+                    output << "'" << std::endl;
                     output << "        if self._attr_" << field.name << " is None:" << std::endl;
-                    output << "            field['@t'] = None" << std::endl;
+                    output << "            out += b'\\xa2" << edge << cbor_text_literal("@t") << "\\xf6'" << std::endl;
                     output << "        else:" << std::endl;
-                    output << "            field.update(self._attr_" << field.name << "._serialize(id_map))" << std::endl;
+                    output << "            self._attr_" << field.name << "._write(out, id_map, b'" << edge << "')" << std::endl;
                     break;
                 case Any:
                 case Many:
-                    output << "        lst = []" << std::endl;
+                    output << "\\xa2" << edge << cbor_text_literal("@d") << "'" << std::endl;
+                    output << "        out += _cbor_write_intlike(len(self._attr_" << field.name << "), 4)" << std::endl;
                     output << "        for el in self._attr_" << field.name << ":" << std::endl;
-                    output << "            el = el._serialize(id_map)" << std::endl;
-                    output << "            el['@T'] = '1'" << std::endl;
-                    output << "            lst.append(el)" << std::endl;
-                    output << "        field['@d'] = lst" << std::endl;
+                    output << "            el._write(out, id_map, b'" << cbor_text_literal("@T") << cbor_text_literal("1") << "')" << std::endl;
                     break;
                 case Link:
                 case OptLink:
+                    output << "\\xa2" << edge << cbor_text_literal("@l") << "'" << std::endl;
                     output << "        if self._attr_" << field.name << " is None:" << std::endl;
-                    output << "            field['@l'] = None" << std::endl;
+                    output << "            out += b'\\xf6'" << std::endl;
                     output << "        else:" << std::endl;
-                    output << "            field['@l'] = id_map[id(self._attr_" << field.name << ")]" << std::endl;
+                    output << "            out += _cbor_write_intlike(id_map[id(self._attr_" << field.name << ")])" << std::endl;
+                    break;
+                case Prim:
+                    output << "'" << std::endl;
+                    output << "        out += _py_to_cbor(cbor['" << field.name << "'])" << std::endl;
                     break;
-                case Prim:    throw std::runtime_error("internal error, should be unreachable");
             }
-            output << "        cbor['" << field.name << "'] = field" << std::endl;
         }
+        output << "        for key, val in sorted(annotations):" << std::endl;
+        output << "            out += _py_to_cbor(key)" << std::endl;
+        output << "            out += val" << std::endl << std::endl;
     }
-    output << std::endl;
-    output << "        # Serialize annotations." << std::endl;
-    output << "        for key, val in self._annot.items():" << std::endl;
-    if (spec.py_serialize_fn.empty()) {
-        output << "            try:" << std::endl;
-        output << "                cbor['{%s}' % key] = _py_to_cbor(val)" << std::endl;
-        output << "            except TypeError:" << std::endl;
-        output << "                pass" << std::endl;
-    } else {
-        output << "            cbor['{%s}' % key] = _py_to_cbor(" << spec.py_serialize_fn << "(key, val))" << std::endl;
-    }
-    output << std::endl;
-    output << "        return cbor" << std::endl << std::endl;
 
     output << std::endl;
 
@@ -710,12 +943,9 @@ void generate(
 ) {
     auto nodes = specification.nodes;
 
-    // Open the output file.
-    auto output = std::ofstream(python_filename);
-    if (!output.is_open()) {
-        std::cerr << "Failed to open Python file for writing" << std::endl;
-        std::exit(1);
-    }
+    // Generate the file in memory, such that it is only written when its
+    // contents change.
+    std::ostringstream output;
 
     // Generate header.
     if (!specification.python_doc.empty()) {
@@ -733,6 +963,11 @@ void generate(
     output << R"PY(
 _typemap = {}
 
+_unpack_uint16 = struct.Struct('>H').unpack_from
+_unpack_uint32 = struct.Struct('>I').unpack_from
+_unpack_uint64 = struct.Struct('>Q').unpack_from
+_unpack_float64 = struct.Struct('>d').unpack_from
+
 
 def _cbor_read_intlike(cbor, offset, info):
     """Parses the additional information and reads any additional bytes it
@@ -750,17 +985,17 @@ def _cbor_read_intlike(cbor, offset, info):
 
     # 25 is 16-bit following the info byte.
     if info == 25:
-        val, = struct.unpack('>H', cbor[offset:offset+2])
+        val, = _unpack_uint16(cbor, offset)
         return val, offset + 2
 
     # 26 is 32-bit following the info byte.
     if info == 26:
-        val, = struct.unpack('>I', cbor[offset:offset+4])
+        val, = _unpack_uint32(cbor, offset)
         return val, offset + 4
 
     # 27 is 64-bit following the info byte.
     if info == 27:
-        val, = struct.unpack('>Q', cbor[offset:offset+8])
+        val, = _unpack_uint64(cbor, offset)
         return val, offset + 8
 
     # Info greater than or equal to 28 is illegal. Note that 31 is used for
@@ -791,8 +1026,14 @@ def _sub_cbor_to_py(cbor, offset):
     objects (strings, arrays, maps). A ValueError is thrown if the CBOR is
     invalid or contains unsupported structures."""
 
-    # Read the initial byte.
+    # Read the initial byte. Small unsigned integers and short UTF-8 strings
+    # make up most of a tree, so these are handled right away.
     initial = cbor[offset]
+    if initial < 0x18:
+        return initial, offset + 1
+    if 0x60 <= initial < 0x78:
+        end = offset + initial - 0x5F
+        return cbor[offset + 1:end].decode('UTF-8'), end
     typ = initial >> 5
     info = initial & 0x1F
     offset += 1
@@ -921,7 +1162,7 @@ def _sub_cbor_to_py(cbor, offset):
 
     if info == 27:
         # Double-precision float.
-        value, = struct.unpack('>d', cbor[offset:offset+8])
+        value, = _unpack_float64(cbor, offset)
         return value, offset + 8
 
     if info == 31:
@@ -1041,6 +1282,191 @@ def _py_to_cbor(value, type_converter=None):
 
     raise TypeError('unsupported type for conversion to cbor: %r' % (value,))
 
+)PY" << R"PY(
+def _cbor_read_key(cbor, offset):
+    """Reads the UTF-8 string starting at cbor[offset], as used for map keys.
+    Returns the string and the offset immediately following it."""
+    initial = cbor[offset]
+    if 0x60 <= initial < 0x78:
+        end = offset + initial - 0x5F
+        return cbor[offset + 1:end].decode('UTF-8'), end
+    key, offset = _sub_cbor_to_py(cbor, offset)
+    if not isinstance(key, str):
+        raise ValueError('invalid CBOR: map key is not a UTF-8 string')
+    return key, offset
+
+
+def _cbor_read_size(cbor, offset, typ):
+    """Reads the initial byte and length of the array (4) or map (5) starting
+    at cbor[offset]. Returns the number of elements or key-value pairs, which
+    is -1 for indefinite-length objects, and the offset of the first one."""
+    initial = cbor[offset]
+    if initial >> 5 != typ:
+        raise ValueError('invalid CBOR: expected ' + ('an array' if typ == 4 else 'a map'))
+    info = initial & 0x1F
+    if info == 31:
+        return -1, offset + 1
+    return _cbor_read_intlike(cbor, offset + 1, info)
+
+
+_MISSING = object()
+
+
+class _SeqMap(dict):
+    """Sequence number to node dict used while deserializing, which also
+    records where the serialization of each node can be found in the sources
+    dict, such that back-references to shared subtrees can be expanded into
+    copies. The sources are either dicts or offsets into the CBOR data."""
+
+    __slots__ = ['sources']
+
+    def __init__(self, sources):
+        super().__init__()
+        self.sources = sources
+
+
+def _ran_off_end(error):
+    """Returns whether the given IndexError or struct.error was raised by
+    the CBOR reader of this module indexing or unpacking past the end of the
+    data, as opposed to by a primitive deserialization function."""
+    tb = error.__traceback__
+    while tb.tb_next is not None:
+        tb = tb.tb_next
+    return tb.tb_frame.f_globals is globals()
+
+
+def _read_shared(cbor, seq, cls, seq_to_ob, links):
+    """Deserializes a copy of the node with sequence number seq of type cls,
+    for a back-reference to a subtree that is shared in the serialized tree.
+    Python trees can't share nodes, so the serialization of the subtree is
+    read again. Links within the subtree are registered with links as usual.
+    Returns the copy."""
+    sources = getattr(seq_to_ob, 'sources', None)
+    source = sources.get(seq, None) if isinstance(seq, int) and sources is not None else None
+    if source is None:
+        raise ValueError('back-reference to unknown node in node serialization')
+    copies = _SeqMap(sources)
+    if isinstance(source, dict):
+        return cls._deserialize(source, copies, links)
+    node, _ = _read_node(cbor, source, cls, None, copies, links)
+    return node
+
+
+def _read_node(cbor, offset, cls, edge, seq_to_ob, links):
+    """Deserializes the CBOR map starting at cbor[offset] into a node of type
+    cls, without first converting it to its Python representation. This is
+    done by the _read() function of the node class named by the @t entry
+    of the map. edge is the expected @T edge type of the map, or None for the
+    root node, which does not need one. Maps that do not start with their @T,
+    @i, and @t entries are converted to their Python representation and passed
+    to cls._deserialize() instead. Returns the node, or None for an empty edge,
+    and the offset immediately following the map."""
+    start = offset
+    remaining, offset = _cbor_read_size(cbor, offset, 5)
+    seq = None
+    found = edge is None
+    while remaining:
+        if remaining < 0 and cbor[offset] == 0xFF:
+            break
+        remaining -= 1
+        key, offset = _cbor_read_key(cbor, offset)
+        value, offset = _sub_cbor_to_py(cbor, offset)
+        if key == '@t':
+            if not found or (value is None and edge is None):
+                break
+            if isinstance(seq, int) and value is not None:
+                sources = getattr(seq_to_ob, 'sources', None)
+                if sources is not None:
+                    sources[seq] = start
+            if value is None:
+                while remaining:
+                    if remaining < 0 and cbor[offset] == 0xFF:
+                        offset += 1
+                        break
+                    remaining -= 1
+                    _, offset = _sub_cbor_to_py(cbor, offset)
+                    _, offset = _sub_cbor_to_py(cbor, offset)
+                return None, offset
+            node_type = _typemap.get(value, None) if isinstance(value, str) else None
+            if node_type is None or node_type._read is None or not issubclass(node_type, cls):
+                break
+            return node_type._read(cbor, offset, remaining, seq, seq_to_ob, links)
+        if key == '@i':
+            seq = value
+        elif key == '@T':
+            found = edge is None or value == edge
+        elif key == '@l' and found and edge is not None:
+            typed = False
+            while remaining:
+                if remaining < 0 and cbor[offset] == 0xFF:
+                    offset += 1
+                    break
+                remaining -= 1
+                key, offset = _sub_cbor_to_py(cbor, offset)
+                _, offset = _sub_cbor_to_py(cbor, offset)
+                typed = typed or key == '@t'
+            if not typed:
+                return _read_shared(cbor, value, cls, seq_to_ob, links), offset
+            break
+        else:
+            break
+
+    # Fall back to the Python representation.
+    value, offset = _sub_cbor_to_py(cbor, start)
+    if edge is None:
+        if isinstance(value, dict) and '@v' in value:
+            raise ValueError('the compact serialization format is not supported')
+        if isinstance(value, dict) and '@c' in value:
+            raise ValueError('the chunked serialization format is not supported')
+    else:
+        if not isinstance(value, dict) or value.get('@T') != edge:
+            raise ValueError('unexpected edge type in node serialization')
+        if '@l' in value and '@t' not in value:
+            return _read_shared(cbor, value['@l'], cls, seq_to_ob, links), offset
+        if value.get('@t', None) is None:
+            return None, offset
+    return cls._deserialize(value, seq_to_ob, links), offset
+
+
+def _read_nodes(cbor, offset, multi, edge, seq_to_ob, links):
+    """Deserializes the CBOR map of an Any or Many edge starting at
+    cbor[offset] into a new object of the given _Multiple class, using
+    _read_node() for the nodes. edge is the expected @T edge type of the map.
+    Returns the object and the offset immediately following the map."""
+    remaining, offset = _cbor_read_size(cbor, offset, 5)
+    found = False
+    nodes = None
+    while remaining:
+        if remaining < 0 and cbor[offset] == 0xFF:
+            offset += 1
+            break
+        remaining -= 1
+        key, offset = _cbor_read_key(cbor, offset)
+        if key == '@T':
+            value, offset = _sub_cbor_to_py(cbor, offset)
+            found = value == edge
+        elif key == '@d':
+            size, offset = _cbor_read_size(cbor, offset, 4)
+            nodes = []
+            while size:
+                if size < 0 and cbor[offset] == 0xFF:
+                    offset += 1
+                    break
+                size -= 1
+                node, offset = _read_node(cbor, offset, multi._T, '1', seq_to_ob, links)
+                if node is None:
+                    raise ValueError('type (@t) field is missing from node serialization')
+                nodes.append(node)
+        else:
+            _, offset = _sub_cbor_to_py(cbor, offset)
+    if not found:
+        raise ValueError('unexpected edge type in node serialization')
+    if nodes is None:
+        raise ValueError('missing serialization of Any/Many contents')
+    result = multi.__new__(multi)
+    result._l = nodes
+    return result, offset
+
 )PY" << R"PY(
 class NotWellFormed(ValueError):
     """Exception class for well-formedness checks."""
@@ -1148,13 +1574,30 @@ class Node(object):
 
     @classmethod
     def deserialize(cls, cbor):
-        """Attempts to deserialize the given cbor object (either as bytes or as
-        its Python primitive representation) into a node of this type."""
-        if isinstance(cbor, bytes):
-            cbor = _cbor_to_py(cbor)
-        seq_to_ob = {}
+        """Attempts to deserialize the given cbor object (either as a
+        bytes-like object or as its Python primitive representation) into a
+        node of this type. CBOR data is read straight into the nodes, without
+        converting it to its Python primitive representation first."""
+        seq_to_ob = _SeqMap({})
         links = []
-        root = cls._deserialize(cbor, seq_to_ob, links)
+        if isinstance(cbor, (bytes, bytearray, memoryview)):
+            cbor = bytes(cbor)
+            try:
+                root, offset = _read_node(cbor, 0, cls, None, seq_to_ob, links)
+            except (IndexError, struct.error) as e:
+                if not _ran_off_end(e):
+                    raise
+                offset = len(cbor) + 1
+            if offset > len(cbor):
+                raise ValueError('invalid CBOR: unexpected end of data')
+            if offset < len(cbor):
+                raise ValueError('invalid CBOR: garbage at the end')
+        else:
+            if isinstance(cbor, dict) and '@v' in cbor:
+                raise ValueError('the compact serialization format is not supported')
+            if isinstance(cbor, dict) and '@c' in cbor:
+                raise ValueError('the chunked serialization format is not supported')
+            root = cls._deserialize(cbor, seq_to_ob, links)
         for link_setter, seq in links:
             ob = seq_to_ob.get(seq, None)
             if ob is None:
@@ -1167,7 +1610,11 @@ class Node(object):
         bytes object."""
         id_map = self.find_reachable()
         self.check_complete(id_map)
-        return _py_to_cbor(self._serialize(id_map))
+        cbor = bytearray()
+        self._write(cbor, id_map, None)
+        return _Cbor(cbor)
+
+    _read = None
 
     @staticmethod
     def _deserialize(cbor, seq_to_ob, links):
@@ -1339,6 +1786,7 @@ def _cloned(obj):
         }
     }
 
+    write_file(python_filename, output.str());
 }
 
 } // namespace python
@@ -8,6 +8,10 @@
 #include "parser.hpp"
 #include "lexer.hpp"
 
+#include <fstream>
+#include <iostream>
+#include <stdexcept>
+
 namespace tree_gen {
 
 /**
@@ -305,6 +309,34 @@ void Specification::build() {
     }
 }
 
+/**
+ * Writes the given contents to the given file, unless the file already has
+ * exactly these contents.
+ */
+void write_file(const std::string &filename, const std::string &contents) {
+    {
+        auto existing = std::ifstream(filename);
+        if (existing.is_open()) {
+            std::ostringstream buffer;
+            buffer << existing.rdbuf();
+            if (buffer.str() == contents) {
+                return;
+            }
+        }
+    }
+    auto output = std::ofstream(filename);
+    if (!output.is_open()) {
+        std::cerr << "Failed to open " << filename << " for writing" << std::endl;
+        std::exit(1);
+    }
+    output << contents;
+    output.close();
+    if (output.fail()) {
+        std::cerr << "Failed to write " << filename << std::endl;
+        std::exit(1);
+    }
+}
+
 }
 
 /**
@@ -316,9 +348,29 @@ int main(
 ) {
     using namespace tree_gen;
 
-    // Check command line and open files.
-    if (argc < 4 || argc > 5) {
-        std::cerr << "Usage: tree-gen <spec-file> <header-file> <source-file> [python-file]" << std::endl;
+    // Check command line and open files. The options may appear anywhere.
+    std::vector<std::string> args;
+    size_t shards = 0;
+    for (int i = 1; i < argc; i++) {
+        auto arg = std::string(argv[i]);
+        if (arg.rfind("--shards=", 0) == 0) {
+            try {
+                size_t end = 0;
+                auto value = std::stoul(arg.substr(9), &end);
+                if (end != arg.size() - 9 || value == 0) {
+                    throw std::invalid_argument(arg);
+                }
+                shards = value;
+            } catch (std::exception &) {
+                std::cerr << "Invalid shard count: " << arg << std::endl;
+                return 1;
+            }
+        } else {
+            args.push_back(arg);
+        }
+    }
+    if (args.size() < 3 || args.size() > 4) {
+        std::cerr << "Usage: tree-gen [--shards=<count>] <spec-file> <header-file> <source-file> [python-file]" << std::endl;
         return 1;
     }
 
@@ -331,7 +383,7 @@ int main(
     }
 
     // Try to open the file and read it to an internal string.
-    auto filename = std::string(argv[1]);
+    auto filename = args[0];
     FILE *fptr = fopen(filename.c_str(), "r");
     if (!fptr) {
         std::cerr << "Failed to open input file " << filename << ": " << strerror(errno) << std::endl;
@@ -361,11 +413,11 @@ int main(
     fclose(fptr);
 
     // Generate C++ code.
-    cpp::generate(argv[2], argv[3], specification);
+    cpp::generate(args[1], args[2], specification, shards);
 
     // Generate Python code if requested.
-    if (argc >= 5) {
-        python::generate(argv[4], specification);
+    if (args.size() >= 4) {
+        python::generate(args[3], specification);
     }
 
     return 0;
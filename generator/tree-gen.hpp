@@ -74,7 +74,8 @@
  * node.
  *
  * Maybe and One are based on std::shared_ptr<T>, Any and Many are based on
- * std::vector<One<T>>, and OptLink and Link are based on std::weak_ptr<T>, but
+ * std::vector<One<T>>, and OptLink and Link are based on std::weak_ptr<T>
+ * (or base::Handle<T> and base::WeakHandle<T> with TREE_INTRUSIVE_HANDLES), but
  * these types are abstracted away from the user almost entirely. Notably, all
  * exposed dereference operations are null- and range-checked, throwing
  * exceptions if there's a problem, rather than causing a segmentation fault
@@ -1030,6 +1031,14 @@ public:
 
 };
 
+/**
+ * Writes the given contents to the given file, unless the file already has
+ * exactly these contents. In that case the file is left alone, so its
+ * timestamp does not change and build systems do not rebuild anything that
+ * depends on it. Exits with an error message if the file cannot be written.
+ */
+void write_file(const std::string &filename, const std::string &contents);
+
 } // namespace tree_gen
 
 #endif
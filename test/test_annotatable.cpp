@@ -77,3 +77,63 @@ TEST(annotatable, main) {
 
     std::cout << "Test passed" << std::endl;
 }
+
+TEST(annotatable, storage) {
+    struct Small { int value; };
+    struct Large { char data[256]; };
+    using MoveOnly = std::unique_ptr<int>;
+
+    tree::annotatable::Annotatable a;
+    a.set_annotation(Small{1});
+    a.set_annotation(Large{"large"});
+    a.set_annotation(std::string("string"));
+    EXPECT_EQ(a.get_annotation<Small>().value, 1);
+    EXPECT_STREQ(a.get_annotation<Large>().data, "large");
+    EXPECT_EQ(a.get_annotation<std::string>(), "string");
+    EXPECT_FALSE(a.has_annotation<int>());
+
+    // Setting an annotation of an existing type replaces it.
+    a.set_annotation(Small{2});
+    EXPECT_EQ(a.get_annotation<Small>().value, 2);
+
+    // Copies don't share annotations with the original.
+    tree::annotatable::Annotatable b{a};
+    b.get_annotation<Small>().value = 3;
+    b.get_annotation<std::string>() += "!";
+    EXPECT_EQ(a.get_annotation<Small>().value, 2);
+    EXPECT_EQ(a.get_annotation<std::string>(), "string");
+    EXPECT_EQ(b.get_annotation<Small>().value, 3);
+    EXPECT_STREQ(b.get_annotation<Large>().data, "large");
+
+    // Erasing one annotation leaves the others alone.
+    b.erase_annotation<Large>();
+    EXPECT_FALSE(b.has_annotation<Large>());
+    EXPECT_TRUE(a.has_annotation<Large>());
+    EXPECT_EQ(b.get_annotation<std::string>(), "string!");
+    b.copy_annotations(a);
+    EXPECT_TRUE(b.has_annotation<Large>());
+    EXPECT_EQ(b.get_annotation<Small>().value, 2);
+
+    // Large annotations are shared by copies until either modifies them.
+    tree::annotatable::Annotatable d{a};
+    const auto &const_a = a;
+    const auto &const_d = d;
+    EXPECT_EQ(const_d.get_annotation_ptr<Large>(), const_a.get_annotation_ptr<Large>());
+    d.get_annotation<Large>().data[0] = 'L';
+    EXPECT_NE(const_d.get_annotation_ptr<Large>(), const_a.get_annotation_ptr<Large>());
+    EXPECT_STREQ(a.get_annotation<Large>().data, "large");
+    EXPECT_STREQ(d.get_annotation<Large>().data, "Large");
+
+    // Move-only annotations can be used, and are shared by copies.
+    a.set_annotation(std::make_unique<int>(42));
+    EXPECT_EQ(*a.get_annotation<MoveOnly>(), 42);
+    tree::annotatable::Annotatable c{std::move(a)};
+    EXPECT_EQ(*c.get_annotation<MoveOnly>(), 42);
+    tree::annotatable::Annotatable e{c};
+    EXPECT_EQ(&e.get_annotation<MoveOnly>(), &c.get_annotation<MoveOnly>());
+    d.copy_annotation<MoveOnly>(c);
+    *d.get_annotation<MoveOnly>() = 43;
+    EXPECT_EQ(*c.get_annotation<MoveOnly>(), 43);
+    c.erase_annotation<MoveOnly>();
+    EXPECT_EQ(*e.get_annotation<MoveOnly>(), 43);
+}
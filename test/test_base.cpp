@@ -0,0 +1,993 @@
+#include "tree-base.hpp"
+#include "test_tree.hpp"
+
+#include <atomic>
+#include <cstdint>
+#include <gtest/gtest.h>
+#include <thread>
+#include <vector>
+
+
+TEST(base, arena) {
+    tree::base::Arena arena{64};
+    EXPECT_EQ(arena.bytes_used(), 0u);
+
+    // Allocations are aligned as requested, also when they don't fit in a
+    // single block.
+    auto a = arena.allocate(3, 1);
+    auto b = arena.allocate(8, 8);
+    auto c = arena.allocate(200, 16);
+    EXPECT_NE(a, b);
+    EXPECT_EQ(reinterpret_cast<uintptr_t>(b) % 8, 0u);
+    EXPECT_EQ(reinterpret_cast<uintptr_t>(c) % 16, 0u);
+    EXPECT_EQ(arena.bytes_used(), 211u);
+}
+
+TEST(base, arena_allocator) {
+    struct Counted {
+        int &count;
+        explicit Counted(int &count) : count(count) { count++; }
+        ~Counted() { count--; }
+    };
+    int count = 0;
+
+    // Without an active arena, the allocator falls back to the heap.
+    EXPECT_EQ(tree::base::Arena::current(), nullptr);
+    EXPECT_EQ(tree::base::ArenaAllocator<Counted>().arena, nullptr);
+    std::allocate_shared<Counted>(tree::base::ArenaAllocator<Counted>(), count);
+    EXPECT_EQ(count, 0);
+
+    tree::base::Arena outer{};
+    tree::base::Arena inner{};
+    {
+        tree::base::Arena::Scope outer_scope{outer};
+        EXPECT_EQ(tree::base::Arena::current(), &outer);
+        {
+            tree::base::Arena::Scope inner_scope{inner};
+            EXPECT_EQ(tree::base::Arena::current(), &inner);
+        }
+        EXPECT_EQ(tree::base::Arena::current(), &outer);
+
+        // Objects allocated from an arena are still destroyed when the last
+        // reference goes away; only the memory stays with the arena.
+        auto ob = std::allocate_shared<Counted>(tree::base::ArenaAllocator<Counted>(), count);
+        EXPECT_EQ(count, 1);
+        EXPECT_GE(outer.bytes_used(), sizeof(Counted));
+        EXPECT_EQ(inner.bytes_used(), 0u);
+        ob.reset();
+        EXPECT_EQ(count, 0);
+    }
+    EXPECT_EQ(tree::base::Arena::current(), nullptr);
+}
+
+TEST(base, pointer_map) {
+    std::vector<int> obs(1000);
+    tree::base::PointerMap map{};
+
+    // Sequence numbers are assigned in order of registration, also across
+    // rehashes of the table.
+    for (size_t i = 0; i < obs.size(); i++) {
+        EXPECT_EQ(map.add_ref(obs[i]), i);
+    }
+    EXPECT_EQ(map.size(), obs.size());
+    for (size_t i = 0; i < obs.size(); i++) {
+        EXPECT_EQ(map.get_ref(obs[i]), i);
+    }
+
+    // Duplicates and unknown nodes throw, unless exceptions are disabled.
+    int other = 0;
+    EXPECT_THROW(map.add_ref(obs[10]), tree::base::NotWellFormed);
+    EXPECT_THROW(map.get_ref(other), tree::base::NotWellFormed);
+    map.enable_exceptions = false;
+    EXPECT_EQ(map.add_ref(obs[10]), 10u);
+    size_t invalid = tree::base::PointerMap::INVALID;
+    EXPECT_EQ(map.get_ref(other), invalid);
+    EXPECT_EQ(map.size(), obs.size());
+}
+
+TEST(base, identifier_map) {
+    auto a = std::make_shared<int>(1);
+    auto b = std::make_shared<int>(2);
+    auto c = std::make_shared<int>(3);
+
+    // Identifiers far beyond the number of registered nodes don't grow the
+    // dense table, but can still be looked up.
+    tree::base::IdentifierMap ids{};
+    ids.register_node(0, a);
+    ids.register_node(1000000000, b);
+    ids.register_node(0, c);
+    EXPECT_EQ(ids.get_node(0), a);
+    EXPECT_EQ(ids.get_node(1000000000), b);
+    EXPECT_THROW(ids.get_node(1), tree::base::RuntimeError);
+
+    // Merging keeps the nodes that were registered first.
+    tree::base::IdentifierMap other{};
+    other.register_node(0, c);
+    other.register_node(5, c);
+    ids.merge(std::move(other));
+    EXPECT_EQ(ids.get_node(0), a);
+    EXPECT_EQ(ids.get_node(5), c);
+}
+
+TEST(base, hash) {
+    struct Opaque {};
+    EXPECT_EQ(tree::base::Hash<int>()(42), std::hash<int>()(42));
+    EXPECT_EQ(tree::base::Hash<Opaque>()(Opaque{}), 0u);
+
+    // Combining is order-sensitive.
+    size_t a = 0, b = 0;
+    tree::base::hash_combine(a, 1);
+    tree::base::hash_combine(a, 2);
+    tree::base::hash_combine(b, 2);
+    tree::base::hash_combine(b, 1);
+    EXPECT_NE(a, b);
+}
+
+TEST(base, symbols) {
+    using tree::base::Symbol;
+    EXPECT_EQ(sizeof(Symbol), sizeof(void*));
+
+    // Equal texts are interned once.
+    auto count = Symbol::count();
+    Symbol a{"symbols-test"};
+    Symbol b{std::string("symbols-") + "test"};
+    EXPECT_EQ(a, b);
+    EXPECT_EQ(&a.str(), &b.str());
+    EXPECT_EQ(Symbol::count(), count + 1);
+    EXPECT_EQ(tree::base::Hash<Symbol>()(a), tree::base::Hash<Symbol>()(b));
+    EXPECT_EQ(Symbol::find("symbols-test"), a);
+    EXPECT_TRUE(Symbol::find("symbols-missing").empty());
+    EXPECT_EQ(Symbol::count(), count + 1);
+    EXPECT_TRUE(Symbol().empty());
+    EXPECT_EQ(Symbol(""), Symbol());
+    EXPECT_TRUE(Symbol("a") < Symbol("b"));
+    EXPECT_FALSE(a < b);
+
+    // Within a symbol table, only the first occurrence carries the text.
+    std::string cbor{};
+    {
+        tree::base::SymbolTable symbols{};
+        tree::cbor::Writer writer{cbor};
+        auto map = writer.start();
+        const char *keys[] = {"a", "b", "c", "d"};
+        const Symbol order[] = {a, Symbol("other"), b, Symbol()};
+        for (size_t i = 0; i < 4; i++) {
+            auto submap = map.append_map(keys[i]);
+            order[i].serialize(submap);
+            submap.close();
+        }
+        map.close();
+    }
+    tree::cbor::Reader reader{cbor};
+    auto map = reader.as_map();
+    std::vector<tree::cbor::Reader> values{};
+    for (const auto &it : map) {
+        values.push_back(it.second);
+    }
+    ASSERT_EQ(values.size(), 4u);
+    EXPECT_TRUE(values[1].as_map().at("val").is_string());
+    EXPECT_EQ(values[2].as_map().at("val").as_int(), 0);
+    {
+        tree::base::SymbolTable symbols{};
+        EXPECT_EQ(Symbol::deserialize(values[0].as_map()), a);
+        EXPECT_EQ(Symbol::deserialize(values[1].as_map()), Symbol("other"));
+        EXPECT_EQ(Symbol::deserialize(values[2].as_map()), a);
+        EXPECT_EQ(Symbol::deserialize(values[3].as_map()), Symbol());
+    }
+
+    // References can't be resolved without the table.
+    EXPECT_THROW(Symbol::deserialize(values[2].as_map()), tree::base::OutOfRange);
+}
+
+/**
+ * Minimal hand-written node type, with the traversal steps that the generator
+ * would emit for a Maybe child edge and an OptLink back edge.
+ */
+struct Chain : public tree::base::Base {
+    tree::base::Maybe<Chain> next;
+    tree::base::OptLink<Chain> back;
+
+    tree::base::One<Chain> copy() const {
+        return tree::base::make<Chain>(*this);
+    }
+
+    void find_reachable_step(tree::base::PointerMap &map, ConstWorkStack &stack) const override {
+        (void) map;
+        stack.push_back(&back);
+        stack.push_back(&next);
+    }
+
+    void check_complete_step(const tree::base::PointerMap &map, ConstWorkStack &stack) const override {
+        (void) map;
+        stack.push_back(&back);
+        stack.push_back(&next);
+    }
+
+    void validate_step(tree::base::PointerMap &map, ConstWorkStack &stack) const override {
+        (void) map;
+        stack.push_back(&back);
+        stack.push_back(&next);
+    }
+
+    void clone_step(WorkStack &stack, tree::base::CloneMap *copies) override {
+        stack.push_back(&next);
+        if (copies) {
+            copies->register_link(back);
+        }
+    }
+};
+
+TEST(base, traversal) {
+    // Build a long chain in which every node links back to its parent.
+    const size_t depth = 10000;
+    auto root = tree::base::make<Chain>();
+    auto node = root;
+    for (size_t i = 1; i < depth; i++) {
+        node->next = tree::base::make<Chain>();
+        node->next->back = node;
+        node = node->next;
+    }
+
+    // Nodes are numbered in depth-first pre-order.
+    tree::base::PointerMap map{};
+    root.validate(map);
+    map.check_links();
+    EXPECT_EQ(map.size(), depth);
+    EXPECT_EQ(map.get(root), 0u);
+    EXPECT_EQ(map.get(node), depth - 1);
+    EXPECT_TRUE(root.is_well_formed());
+
+    // A deep copy shares no nodes, so its links point into the original.
+    auto copy = root->copy();
+    copy.clone_edges();
+    EXPECT_NE(copy->next, root->next);
+    EXPECT_EQ(copy->next->back, root);
+    EXPECT_FALSE(copy.is_well_formed());
+
+    // Break the chain up iteratively, so destruction doesn't recurse either.
+    for (auto *chain : {&root, &copy}) {
+        while (!chain->empty()) {
+            auto next = (*chain)->next;
+            (*chain)->next.reset();
+            *chain = next;
+        }
+    }
+}
+
+/**
+ * Wide node type for the parallel traversal tests, where every node links to
+ * its parent.
+ */
+struct Fan : public tree::base::Base {
+    tree::base::Any<Fan> children;
+    tree::base::OptLink<Fan> back;
+
+    tree::base::One<Fan> copy() const {
+        return tree::base::make<Fan>(*this);
+    }
+
+    bool equals(const Fan &rhs) const {
+        return children.equals(rhs.children) && back.equals(rhs.back);
+    }
+
+    size_t hash() const {
+        return children.hash() * 31 + back.hash();
+    }
+
+    void find_reachable_step(tree::base::PointerMap &map, ConstWorkStack &stack) const override {
+        (void) map;
+        stack.push_back(&back);
+        stack.push_back(&children);
+    }
+
+    void check_complete_step(const tree::base::PointerMap &map, ConstWorkStack &stack) const override {
+        (void) map;
+        stack.push_back(&back);
+        stack.push_back(&children);
+    }
+
+    void validate_step(tree::base::PointerMap &map, ConstWorkStack &stack) const override {
+        (void) map;
+        stack.push_back(&back);
+        stack.push_back(&children);
+    }
+
+    void clone_step(WorkStack &stack, tree::base::CloneMap *copies) override {
+        stack.push_back(&children);
+        if (copies) {
+            copies->register_link(back);
+        }
+    }
+
+    // Counts the nodes scanned by incremental checks.
+    static size_t tracked;
+
+    void track_step(tree::base::IncrementalValidator &validator) const override {
+        tracked++;
+        tree::base::Completable::track_step(validator);
+    }
+
+    void measure_step(tree::base::MemoryUsage &usage, ConstWorkStack &stack) const override {
+        usage.add_node(0, sizeof(Fan), *this);
+        stack.push_back(&children);
+    }
+};
+
+size_t Fan::tracked = 0;
+
+TEST(base, parallel) {
+    // Build a tree that's large enough to be split up between threads.
+    auto root = tree::base::make<Fan>();
+    for (size_t i = 0; i < 64; i++) {
+        auto child = tree::base::make<Fan>();
+        child->back = root;
+        for (size_t j = 0; j < 256; j++) {
+            auto grandchild = tree::base::make<Fan>();
+            grandchild->back = child;
+            child->children.add(grandchild);
+        }
+        root->children.add(child);
+    }
+    EXPECT_NO_THROW(root.check_well_formed_parallel(4));
+    EXPECT_NO_THROW(root.check_well_formed_parallel(1));
+
+    // Links within the subtree are redirected to the copies.
+    auto copy = root.clone_parallel(4);
+    EXPECT_NO_THROW(copy.check_well_formed_parallel(4));
+    ASSERT_EQ(copy->children.size(), 64u);
+    for (size_t i = 0; i < 64; i++) {
+        auto &child = copy->children[i];
+        EXPECT_NE(child, root->children[i]);
+        EXPECT_EQ(child->back, copy);
+        ASSERT_EQ(child->children.size(), 256u);
+        EXPECT_EQ(child->children[255]->back, child);
+    }
+
+    // Links to nodes outside the subtree are left alone.
+    auto subtree = root->children[3].clone_parallel(4);
+    EXPECT_EQ(subtree->back, root);
+    EXPECT_EQ(subtree->children[0]->back, subtree);
+
+    // Nodes that appear more than once are detected, even when they're
+    // handled by different threads.
+    root->children.add(root->children[0]->children[0]);
+    EXPECT_THROW(root.check_well_formed_parallel(4), tree::base::NotWellFormed);
+    root->children.remove();
+
+    // So are links to nodes that aren't part of the tree.
+    auto orphan = tree::base::make<Fan>();
+    root->children[63]->children[0]->back = orphan;
+    EXPECT_THROW(root.check_well_formed_parallel(4), tree::base::NotWellFormed);
+}
+
+TEST(base, work_pool) {
+    tree::base::WorkPool pool{4};
+    EXPECT_EQ(pool.size(), 4u);
+
+    // Ranges cover all indices exactly once, also when the calls fork more
+    // work themselves.
+    std::vector<std::atomic<int>> hits(1000);
+    pool.parallel_for(100, 3, [&](size_t begin, size_t end) {
+        EXPECT_LE(end - begin, 3u);
+        for (size_t i = begin; i < end; i++) {
+            pool.parallel_for(10, 2, [&](size_t inner_begin, size_t inner_end) {
+                for (size_t j = inner_begin; j < inner_end; j++) {
+                    hits[i * 10 + j]++;
+                }
+            });
+        }
+    });
+    for (const auto &hit : hits) {
+        EXPECT_EQ(hit, 1);
+    }
+
+    // Exceptions are rethrown in the calling thread.
+    EXPECT_THROW(pool.parallel_for(100, 1, [](size_t begin, size_t) {
+        if (begin == 42) {
+            throw tree::base::RuntimeError("oops");
+        }
+    }), tree::base::RuntimeError);
+
+    // Without workers, the ranges are visited in order.
+    tree::base::WorkPool serial{1};
+    std::vector<size_t> begins{};
+    serial.parallel_for(10, 4, [&](size_t begin, size_t) {
+        begins.push_back(begin);
+    });
+    EXPECT_EQ(begins, (std::vector<size_t>{0, 4, 8}));
+}
+
+TEST(base, snapshots) {
+    // Build a small tree without links and take a snapshot of it.
+    auto root = tree::base::make<Fan>();
+    for (size_t i = 0; i < 4; i++) {
+        auto child = tree::base::make<Fan>();
+        for (size_t j = 0; j < 4; j++) {
+            child->children.add(tree::base::make<Fan>());
+        }
+        root->children.add(child);
+    }
+    root.freeze();
+    EXPECT_TRUE(root.is_frozen());
+    EXPECT_TRUE(root->children[2]->children[3].is_frozen());
+
+    // Editing through mutate() copies only the path to the edited node.
+    auto snapshot = root;
+    auto &child = snapshot.mutate().children.mutate_at(1);
+    child.children.add(tree::base::make<Fan>());
+    EXPECT_FALSE(snapshot.is_frozen());
+    EXPECT_NE(snapshot, root);
+    EXPECT_NE(snapshot->children[1], root->children[1]);
+    EXPECT_FALSE(snapshot->children[1].is_frozen());
+    EXPECT_EQ(snapshot->children[0], root->children[0]);
+    EXPECT_EQ(snapshot->children[1]->children[0], root->children[1]->children[0]);
+    EXPECT_EQ(snapshot->children[1]->children.size(), 5u);
+    EXPECT_EQ(root->children[1]->children.size(), 4u);
+
+    // Mutable nodes are returned as is.
+    EXPECT_EQ(&snapshot.mutate(), snapshot.get_ptr().get());
+
+    // Frozen nodes may appear more than once in a tree.
+    snapshot->children.add(root->children[0]);
+    EXPECT_NO_THROW(snapshot.check_well_formed());
+    EXPECT_NO_THROW(snapshot.check_well_formed_parallel(4));
+    EXPECT_TRUE(snapshot.is_well_formed());
+
+    // Mutable ones still may not.
+    snapshot->children.add(snapshot->children[1]);
+    EXPECT_THROW(snapshot.check_well_formed(), tree::base::NotWellFormed);
+    EXPECT_THROW(snapshot.check_well_formed_parallel(4), tree::base::NotWellFormed);
+}
+
+TEST(base, interner) {
+    // Build a tree with four identical subtrees, and link to the last leaf of
+    // the last one.
+    auto root = tree::base::make<Fan>();
+    for (size_t i = 0; i < 4; i++) {
+        auto child = tree::base::make<Fan>();
+        child->children.add(tree::base::make<Fan>());
+        child->children.add(tree::base::make<Fan>());
+        root->children.add(child);
+    }
+    auto target = root->children[3]->children[1];
+    root->back = target;
+
+    // Identical subtrees are shared, except the ones containing the target.
+    tree::base::Interner interner{};
+    interner.intern(root);
+    EXPECT_TRUE(root.is_frozen());
+    EXPECT_EQ(root->children[0], root->children[1]);
+    EXPECT_EQ(root->children[0], root->children[2]);
+    EXPECT_EQ(root->children[0]->children[0], root->children[0]->children[1]);
+    EXPECT_NE(root->children[0], root->children[3]);
+    EXPECT_EQ(root->children[3]->children[0], root->children[0]->children[0]);
+    EXPECT_EQ(root->children[3]->children[1], target);
+    EXPECT_EQ(root->back, target);
+    EXPECT_EQ(interner.size(), 2u);
+    EXPECT_NO_THROW(root.check_well_formed());
+
+    // Equal subtrees of other trees are shared with the canonical ones.
+    auto other = tree::base::make<Fan>();
+    other->children.add(tree::base::make<Fan>());
+    other->children[0]->children.add(tree::base::make<Fan>());
+    other->children[0]->children.add(tree::base::make<Fan>());
+    interner.intern(other);
+    EXPECT_EQ(other->children[0], root->children[0]);
+    EXPECT_EQ(interner.size(), 3u);
+
+    // Ill-formed trees are rejected.
+    auto orphan = tree::base::make<Fan>();
+    auto outside = tree::base::make<Fan>();
+    orphan->back = outside;
+    EXPECT_THROW(interner.intern(orphan), tree::base::NotWellFormed);
+    EXPECT_FALSE(orphan.is_frozen());
+}
+
+TEST(base, incremental) {
+    auto root = tree::base::make<Fan>();
+    for (size_t i = 0; i < 16; i++) {
+        auto child = tree::base::make<Fan>();
+        child->back = root;
+        for (size_t j = 0; j < 16; j++) {
+            auto grandchild = tree::base::make<Fan>();
+            grandchild->back = child;
+            child->children.add(grandchild);
+        }
+        root->children.add(child);
+    }
+
+    // The first check records the whole tree.
+    tree::base::IncrementalValidator validator{};
+    Fan::tracked = 0;
+    EXPECT_NO_THROW(root.check_well_formed(validator));
+    EXPECT_EQ(validator.size(), 1u + 16u + 16u * 16u);
+    EXPECT_EQ(Fan::tracked, validator.size());
+
+    // Afterwards, only modified nodes and new subtrees are scanned.
+    Fan::tracked = 0;
+    EXPECT_NO_THROW(root.check_well_formed(validator));
+    EXPECT_EQ(Fan::tracked, 0u);
+    auto grandchild = tree::base::make<Fan>();
+    grandchild->back = root->children[3];
+    root->children[3]->children.add(grandchild);
+    EXPECT_NO_THROW(root.check_well_formed(validator));
+    EXPECT_EQ(Fan::tracked, 2u);
+    EXPECT_EQ(validator.size(), 1u + 16u + 16u * 16u + 1u);
+
+    // Subtrees can be moved around.
+    auto moved = root->children[5];
+    root->children.remove(5);
+    root->children[0]->children.add(moved);
+    EXPECT_NO_THROW(root.check_well_formed(validator));
+    EXPECT_EQ(validator.size(), 1u + 16u + 16u * 16u + 1u);
+
+    // Nodes replaced at the same address are rescanned.
+    auto &edge = root->children[1]->children[0];
+    edge.reset();
+    edge = tree::base::make<Fan>();
+    edge->back = root->children[2];
+    EXPECT_NO_THROW(root.check_well_formed(validator));
+
+    // Links into removed subtrees are detected, even when the nodes that
+    // hold them weren't modified. Links to removed nodes that no longer
+    // exist have expired, however.
+    root->children[2]->children.reset();
+    EXPECT_NO_THROW(root.check_well_formed(validator));
+    auto detached = root->children[2];
+    root->children.remove(2);
+    EXPECT_THROW(root.check_well_formed(validator), tree::base::NotWellFormed);
+    EXPECT_FALSE(root.is_well_formed());
+    detached.reset();
+    EXPECT_TRUE(root.is_well_formed());
+
+    // After a failed check, the next one starts over.
+    Fan::tracked = 0;
+    EXPECT_NO_THROW(root.check_well_formed(validator));
+    EXPECT_EQ(Fan::tracked, validator.size());
+    auto size = validator.size();
+    root->children.remove(3);
+    EXPECT_NO_THROW(root.check_well_formed(validator));
+    EXPECT_EQ(validator.size(), size - 17u);
+
+    // So are new links to nodes outside the tree, and duplicate nodes.
+    auto orphan = tree::base::make<Fan>();
+    root->children[7]->back = orphan;
+    EXPECT_THROW(root.check_well_formed(validator), tree::base::NotWellFormed);
+    root->children[7]->back = root;
+    EXPECT_NO_THROW(root.check_well_formed(validator));
+    root->children[8]->children.add(root->children[9]->children[0]);
+    EXPECT_THROW(root.check_well_formed(validator), tree::base::NotWellFormed);
+    root->children[8]->children.remove();
+    EXPECT_NO_THROW(root.check_well_formed(validator));
+
+    // Frozen subtrees may still be shared.
+    root->children[10].freeze();
+    root->children[11]->children.add(root->children[10]);
+    EXPECT_NO_THROW(root.check_well_formed(validator));
+    root->children.remove(11);
+    EXPECT_NO_THROW(root.check_well_formed(validator));
+    EXPECT_TRUE(root.is_well_formed());
+}
+
+TEST(base, edge_tracker) {
+    auto root = tree::base::make<Fan>();
+    root->children.add(tree::base::make<Fan>());
+    tree::base::EdgeTracker tracker{};
+    auto generation = tracker.generation();
+
+    // Reading the tree doesn't count as a modification.
+    EXPECT_TRUE(root.is_well_formed());
+    EXPECT_EQ(root->children.size(), 1u);
+    EXPECT_EQ(tracker.generation(), generation);
+
+    // Modifying edges does, also when the tracker is copied.
+    root->children.add(tree::base::make<Fan>());
+    EXPECT_GT(tracker.generation(), generation);
+    generation = tracker.generation();
+    {
+        auto copy = tracker;
+        root->back = root->children[0];
+        EXPECT_GT(copy.generation(), generation);
+    }
+    generation = tracker.generation();
+    root->children.remove(0);
+    EXPECT_GT(tracker.generation(), generation);
+
+    // Edits of unrelated trees on other threads aren't counted, but those
+    // made by the workers of parallel calls of this thread are, also for
+    // validators.
+    generation = tracker.generation();
+    std::thread other{[] {
+        auto other_root = tree::base::make<Fan>();
+        other_root->children.add(tree::base::make<Fan>());
+    }};
+    other.join();
+    EXPECT_EQ(tracker.generation(), generation);
+    tree::base::IncrementalValidator validator{};
+    EXPECT_NO_THROW(root.check_well_formed(validator));
+    auto orphan = tree::base::make<Fan>();
+    tree::base::run_parallel(2, [&](size_t thread) {
+        if (thread == 1) {
+            root->back = orphan;
+        }
+    });
+    EXPECT_GT(tracker.generation(), generation);
+    EXPECT_THROW(root.check_well_formed(validator), tree::base::NotWellFormed);
+}
+
+TEST(base, any_moves) {
+    tree::base::Any<Fan> a{};
+    for (size_t i = 0; i < 4; i++) {
+        a.emplace_at(-1);
+    }
+    std::vector<const Fan*> nodes{};
+    for (const auto &ob : a.get_vec()) {
+        nodes.push_back(ob.get_ptr().get());
+    }
+
+    // Adding a temporary moves the reference into the Any.
+    tree::base::Any<Fan> b{};
+    b.add(tree::base::make<Fan>());
+    b.emplace_at(0);
+    EXPECT_EQ(b.get_vec()[0].get_ptr().use_count(), 1);
+    EXPECT_EQ(b.get_vec()[1].get_ptr().use_count(), 1);
+
+    // Splicing and taking move the references as well.
+    b.splice(1, a, 1, 2);
+    ASSERT_EQ(a.size(), 2u);
+    ASSERT_EQ(b.size(), 4u);
+    EXPECT_EQ(b.get_vec()[1].get_ptr().get(), nodes[1]);
+    EXPECT_EQ(b.get_vec()[2].get_ptr().get(), nodes[2]);
+    EXPECT_EQ(b.get_vec()[1].get_ptr().use_count(), 1);
+    auto taken = a.take(0);
+    EXPECT_EQ(taken.get_ptr().get(), nodes[0]);
+    EXPECT_EQ(taken.get_ptr().use_count(), 1);
+    ASSERT_EQ(a.size(), 1u);
+    EXPECT_TRUE(b.take(100).get_ptr().get());
+    EXPECT_EQ(b.size(), 3u);
+    EXPECT_TRUE(tree::base::Any<Fan>().take().empty());
+
+    // Range insertion with move iterators leaves the source elements empty.
+    b.insert(0, std::make_move_iterator(a.begin()), std::make_move_iterator(a.end()));
+    ASSERT_EQ(b.size(), 4u);
+    EXPECT_EQ(b.get_vec()[0].get_ptr().get(), nodes[3]);
+    EXPECT_TRUE(a.get_vec()[0].empty());
+    EXPECT_EQ(a.erase_if([](const tree::base::One<Fan> &ob) { return ob.empty(); }), 1u);
+    EXPECT_TRUE(a.empty());
+
+    // erase_if() retains the order of the remaining elements.
+    EXPECT_EQ(b.erase_if([&](const tree::base::One<Fan> &ob) { return ob.get_ptr().get() == nodes[1]; }), 1u);
+    ASSERT_EQ(b.size(), 3u);
+    EXPECT_EQ(b.get_vec()[0].get_ptr().get(), nodes[3]);
+    EXPECT_EQ(b.get_vec()[2].get_ptr().get(), nodes[2]);
+
+    // Moving extend() empties the source.
+    a.extend(std::move(b));
+    EXPECT_EQ(a.size(), 3u);
+    EXPECT_TRUE(b.empty());
+    a.reserve(16);
+    EXPECT_GE(a.get_vec().capacity(), 16u);
+    EXPECT_THROW(a.splice(0, a), tree::base::RuntimeError);
+    EXPECT_EQ(a.copy().size(), 3u);
+}
+
+TEST(base, text_writer) {
+    std::string text{};
+    {
+        tree::base::TextWriter out{text};
+        out << "a" << ':' << 42 << ' ' << static_cast<int64_t>(-7) << ' ' << static_cast<size_t>(0);
+        out.end_line();
+        out.indent(3);
+        out << static_cast<const void*>(nullptr) << ' ' << reinterpret_cast<const void*>(uintptr_t(0x1f));
+        out.end_line();
+        out << out.format(std::string("s")) << out.format(123u) << out.format('c') << out.format(true) << out.format(1.5);
+    }
+    EXPECT_EQ(text, "a:42 -7 0\n      0x0 0x1f\ns123c11.5");
+
+    // Deep indentation is written in chunks.
+    text.clear();
+    tree::base::TextWriter(text).indent(100);
+    EXPECT_EQ(text, std::string(200, ' '));
+
+    EXPECT_EQ(tree::base::TextWriter::trim("x \n\t"), "x");
+    EXPECT_EQ(tree::base::TextWriter::trim(" \n"), " \n");
+
+    // Stream output is buffered until the writer is flushed or destroyed.
+    std::ostringstream ss{};
+    {
+        tree::base::TextWriter out{ss};
+        out << "line";
+        out.end_line();
+        EXPECT_TRUE(ss.str().empty());
+        out.flush();
+        EXPECT_EQ(ss.str(), "line\n");
+        out << "more";
+    }
+    EXPECT_EQ(ss.str(), "line\nmore");
+}
+
+TEST(base, instrumentation) {
+    struct Large {
+        char data[64];
+    };
+
+    // Frozen subtrees that appear more than once are measured once.
+    auto root = tree::base::make<Fan>();
+    auto shared = tree::base::make<Fan>();
+    shared.freeze();
+    root->children.add(shared);
+    root->children.add(shared);
+    root->children.add(tree::base::make<Fan>());
+    root->set_annotation<int>(3);
+    root->set_annotation(Large{});
+    const char *const names[] = {"Fan"};
+    tree::base::MemoryUsage usage{names, 1};
+    root.measure(usage);
+    ASSERT_EQ(usage.nodes.size(), 1u);
+    EXPECT_EQ(usage.nodes[0].count, 3u);
+    EXPECT_EQ(usage.nodes[0].bytes, 3 * sizeof(Fan));
+    EXPECT_EQ(usage.edges.count, 3u);
+    EXPECT_EQ(usage.edges.size, 3u);
+    EXPECT_GE(usage.edges.capacity, 3u);
+    ASSERT_EQ(usage.annotations.size(), 2u);
+    EXPECT_EQ(usage.annotations[0].bytes, sizeof(int));
+    EXPECT_EQ(usage.annotation_vectors.size, 2u);
+    EXPECT_EQ(usage.annotation_heap_bytes, sizeof(Large));
+    EXPECT_EQ(usage.node_count(), 3u);
+    std::ostringstream ss{};
+    usage.dump(ss);
+    EXPECT_NE(ss.str().find("Fan: 3"), std::string::npos);
+
+    // Allocations are counted until the control block is freed.
+    tree::base::AllocationCounter counter{};
+    {
+        tree::base::CountingAllocator<std::allocator<Fan>> alloc{std::allocator<Fan>(), counter};
+        auto a = std::allocate_shared<Fan>(alloc);
+        auto b = std::allocate_shared<Fan>(alloc);
+        EXPECT_EQ(counter.get_live_count(), 2u);
+        EXPECT_GE(counter.get_live_bytes(), 2 * sizeof(Fan));
+    }
+    EXPECT_EQ(counter.get_live_count(), 0u);
+    EXPECT_EQ(counter.get_live_bytes(), 0u);
+    EXPECT_EQ(counter.get_peak_count(), 2u);
+    counter.reset_peak();
+    EXPECT_EQ(counter.get_peak_count(), 0u);
+
+    // Nested timers for the same operation are counted once.
+    tree::base::OperationTimer::reset();
+    {
+        tree::base::OperationTimer outer{tree::base::Operation::CLONE};
+        tree::base::OperationTimer inner{tree::base::Operation::CLONE};
+    }
+    EXPECT_EQ(tree::base::OperationTimer::calls(tree::base::Operation::CLONE), 1u);
+    tree::base::StatsSnapshot snapshot{};
+    ASSERT_EQ(snapshot.timers.size(), 4u);
+    EXPECT_EQ(snapshot.timers[3].name, "clone");
+    EXPECT_EQ(snapshot.timers[3].calls, 1u);
+    EXPECT_EQ(snapshot.timers[0].calls, 0u);
+}
+
+namespace {
+
+/**
+ * Returns a leaf of the generated test tree with the given name.
+ */
+tree::base::One<test_tree::Expr> patch_leaf(const char *name) {
+    return tree::base::make<test_tree::Leaf>(test_primitives::Name{name});
+}
+
+/**
+ * Returns a test tree with leaves of the given names.
+ */
+tree::base::One<test_tree::Root> patch_tree(const std::vector<const char*> &names) {
+    auto root = tree::base::make<test_tree::Root>();
+    for (auto name : names) {
+        root->exprs.add(patch_leaf(name));
+    }
+    return root;
+}
+
+/**
+ * Returns the operations of the given patch, as their PatchOperation.
+ */
+std::vector<tree::base::PatchOperation> patch_operations(const std::string &patch) {
+    std::vector<tree::base::PatchOperation> operations{};
+    tree::cbor::Reader reader{patch};
+    for (const auto &op : reader.as_map().at("@o").as_array()) {
+        operations.push_back(static_cast<tree::base::PatchOperation>(op.as_array().at(0).as_int()));
+    }
+    return operations;
+}
+
+/**
+ * Returns a patch with the given schema hash and a single operation of the
+ * given kind at the given path, without further items.
+ */
+std::string handmade_patch(int64_t schema, tree::base::PatchOperation operation, const std::vector<int64_t> &path) {
+    std::string output{};
+    tree::cbor::Writer writer{output};
+    auto map = writer.start(3);
+    map.append_int("@p", tree::base::PATCH_FORMAT_VERSION);
+    map.append_int("@s", schema);
+    auto ops = map.append_array("@o");
+    auto op = ops.append_array(2);
+    op.append_int(static_cast<int64_t>(operation));
+    auto steps = op.append_array(path.size());
+    for (auto step : path) {
+        steps.append_int(step);
+    }
+    steps.close();
+    op.close();
+    ops.close();
+    map.close();
+    return output;
+}
+
+} // namespace
+
+TEST(base, patch_alignment) {
+    using tree::base::PatchOperation;
+
+    // Elements are aligned by value, so removing or inserting a single
+    // element of an Any edge is a single operation, also when the trees
+    // don't share nodes.
+    auto old_tree = patch_tree({"a", "b", "c", "d"});
+    auto new_tree = patch_tree({"a", "c", "d"});
+    auto patch = tree::base::diff(old_tree, new_tree);
+    EXPECT_EQ(patch_operations(patch), std::vector<PatchOperation>{PatchOperation::REMOVE});
+    tree::base::apply_patch(old_tree, patch);
+    EXPECT_TRUE(old_tree.equals(new_tree));
+
+    new_tree = patch_tree({"x", "a", "c", "y", "d"});
+    patch = tree::base::diff(old_tree, new_tree);
+    EXPECT_EQ(patch_operations(patch), std::vector<PatchOperation>({PatchOperation::INSERT, PatchOperation::INSERT}));
+    tree::base::apply_patch(old_tree, patch);
+    EXPECT_TRUE(old_tree.equals(new_tree));
+
+    // Changed elements in place are replaced, and surplus is removed.
+    new_tree = patch_tree({"x", "b", "c"});
+    patch = tree::base::diff(old_tree, new_tree);
+    tree::base::apply_patch(old_tree, patch);
+    EXPECT_TRUE(old_tree.equals(new_tree));
+    EXPECT_TRUE(patch_operations(tree::base::diff(old_tree, new_tree)).empty());
+}
+
+TEST(base, patch_links) {
+
+    // Links into a replaced subtree are retargeted to the replacement, and
+    // links to kept nodes keep referring to the patched tree.
+    auto old_tree = tree::base::make<test_tree::Root>();
+    old_tree->exprs.add(tree::base::make<test_tree::Pair>(patch_leaf("a"), patch_leaf("b")));
+    old_tree->exprs.add(tree::base::make<test_tree::Ref>(old_tree->exprs[0]->as_pair()->left));
+    old_tree->exprs.add(tree::base::make<test_tree::Ref>(old_tree->exprs[0]->as_pair()->right));
+    auto new_tree = tree::base::make<test_tree::Root>();
+    new_tree->exprs.add(tree::base::make<test_tree::Pair>(
+        tree::base::make<test_tree::Pair>(patch_leaf("x"), patch_leaf("y")), patch_leaf("b")));
+    new_tree->exprs.add(tree::base::make<test_tree::Ref>(new_tree->exprs[0]->as_pair()->left->as_pair()->right));
+    new_tree->exprs.add(tree::base::make<test_tree::Ref>(new_tree->exprs[0]->as_pair()->right));
+
+    auto patch = tree::base::diff(old_tree, new_tree);
+    tree::base::apply_patch(old_tree, patch);
+    ASSERT_NO_THROW(old_tree.check_well_formed());
+    auto pair = old_tree->exprs[0]->as_pair();
+    auto replaced = pair->left->as_pair();
+    ASSERT_TRUE(replaced);
+    EXPECT_EQ(old_tree->exprs[1]->as_ref()->target, replaced->right);
+    EXPECT_EQ(old_tree->exprs[2]->as_ref()->target, pair->right);
+    EXPECT_EQ(replaced->right->as_leaf()->name.str(), "y");
+}
+
+TEST(base, patch_frozen_snapshot) {
+
+    // Patching a tree that shares its nodes with a frozen snapshot copies
+    // only the path to the changes, and leaves the snapshot as it was.
+    auto snapshot = patch_tree({"a", "b", "c"});
+    snapshot->exprs.add(tree::base::make<test_tree::Ref>(snapshot->exprs[1]));
+    snapshot.freeze();
+    auto before = tree::base::serialize(snapshot);
+    tree::base::Maybe<test_tree::Root> working = snapshot;
+    auto new_tree = patch_tree({"a", "x", "c"});
+    new_tree->exprs.add(tree::base::make<test_tree::Ref>(new_tree->exprs[0]));
+
+    tree::base::apply_patch(working, tree::base::diff(snapshot, new_tree));
+    ASSERT_EQ(working->exprs.size(), 4u);
+    EXPECT_EQ(tree::base::serialize(snapshot), before);
+    EXPECT_NE(working.get_ptr(), snapshot.get_ptr());
+    EXPECT_FALSE(working.is_frozen());
+    EXPECT_EQ(working->exprs[0], snapshot->exprs[0]);
+    EXPECT_EQ(working->exprs[1]->as_leaf()->name.str(), "x");
+    EXPECT_EQ(working->exprs[3]->as_ref()->target, working->exprs[0]);
+    EXPECT_EQ(snapshot->exprs[3]->as_ref()->target, snapshot->exprs[1]);
+    EXPECT_NO_THROW(snapshot.check_well_formed());
+    EXPECT_NO_THROW(working.check_well_formed());
+}
+
+TEST(base, patch_frozen_link_targets) {
+
+    // Links that refer to a node on the path to a change are redirected to
+    // its copy, also when they are in frozen nodes of their own, which are
+    // then copied along with the path to them.
+    auto make = [](const char *name) {
+        auto root = tree::base::make<test_tree::Root>();
+        root->exprs.add(tree::base::make<test_tree::Pair>(patch_leaf("a"), patch_leaf(name)));
+        root->exprs.add(tree::base::make<test_tree::Ref>(root->exprs[0]));
+        root->exprs.add(tree::base::make<test_tree::Pair>(
+            tree::base::make<test_tree::Ref>(root->exprs[0]), patch_leaf("c")));
+        return root;
+    };
+    auto snapshot = make("b");
+    snapshot.freeze();
+    auto before = tree::base::serialize(snapshot);
+    tree::base::Maybe<test_tree::Root> working = snapshot;
+    auto new_tree = make("x");
+
+    ASSERT_NO_THROW(tree::base::apply_patch(working, tree::base::diff(snapshot, new_tree)));
+    EXPECT_EQ(tree::base::serialize(snapshot), before);
+    EXPECT_NO_THROW(snapshot.check_well_formed());
+    EXPECT_NO_THROW(working.check_well_formed());
+    EXPECT_EQ(tree::base::serialize(working), tree::base::serialize(new_tree));
+    EXPECT_NE(working->exprs[0], snapshot->exprs[0]);
+    EXPECT_EQ(working->exprs[0]->as_pair()->right->as_leaf()->name.str(), "x");
+    EXPECT_EQ(working->exprs[1]->as_ref()->target, working->exprs[0]);
+    EXPECT_EQ(working->exprs[2]->as_pair()->left->as_ref()->target, working->exprs[0]);
+    EXPECT_EQ(working->exprs[2]->as_pair()->right, snapshot->exprs[2]->as_pair()->right);
+    EXPECT_EQ(snapshot->exprs[1]->as_ref()->target, snapshot->exprs[0]);
+    EXPECT_EQ(snapshot->exprs[2]->as_pair()->left->as_ref()->target, snapshot->exprs[0]);
+}
+
+TEST(base, patch_deep) {
+
+    // Equal subtrees are matched once at the top, and their elements are
+    // only paired up below that, so deep chains of Any edges are compared
+    // in linear time. A change at the bottom still results in a single
+    // operation.
+    auto chain = [](const char *name) {
+        auto root = patch_tree({});
+        tree::base::One<test_tree::Expr> node = patch_leaf(name);
+        for (size_t depth = 0; depth < 5000; depth++) {
+            auto item = tree::base::make<test_tree::Item>();
+            item->elements.add(node);
+            item->elements.add(patch_leaf("a"));
+            node = item;
+        }
+        root->exprs.add(node);
+        return root;
+    };
+    auto old_tree = chain("a");
+    auto patch = tree::base::diff(old_tree, chain("a"));
+    EXPECT_TRUE(patch_operations(patch).empty());
+    auto new_tree = chain("b");
+    patch = tree::base::diff(old_tree, new_tree);
+    EXPECT_EQ(patch_operations(patch), std::vector<tree::base::PatchOperation>{tree::base::PatchOperation::SET});
+    tree::base::apply_patch(old_tree, patch);
+    EXPECT_TRUE(old_tree.equals(new_tree));
+}
+
+TEST(base, patch_rejected) {
+    using tree::base::PatchOperation;
+    auto root = patch_tree({"a", "b"});
+    auto before = tree::base::serialize(root);
+    auto schema = static_cast<int64_t>(test_tree::Root::SCHEMA_HASH);
+
+    // Patches for another schema are rejected before anything is modified.
+    auto patch = handmade_patch(schema + 1, PatchOperation::REMOVE, {0, 0});
+    EXPECT_THROW(tree::base::apply_patch(root, patch), tree::base::RuntimeError);
+    EXPECT_EQ(tree::base::serialize(root), before);
+
+    // So are paths that don't exist in the tree or are malformed.
+    patch = handmade_patch(schema, PatchOperation::REMOVE, {0, 2});
+    EXPECT_THROW(tree::base::apply_patch(root, patch), tree::base::OutOfRange);
+    patch = handmade_patch(schema, PatchOperation::REMOVE, {0, 0, 0, 0});
+    EXPECT_THROW(tree::base::apply_patch(root, patch), std::runtime_error);
+    patch = handmade_patch(schema, PatchOperation::REMOVE, {5, 0});
+    EXPECT_THROW(tree::base::apply_patch(root, patch), tree::base::OutOfRange);
+    patch = handmade_patch(schema, PatchOperation::REMOVE, {0});
+    EXPECT_THROW(tree::base::apply_patch(root, patch), tree::base::RuntimeError);
+    EXPECT_EQ(tree::base::serialize(root), before);
+
+    // A valid handmade patch applies.
+    patch = handmade_patch(schema, PatchOperation::REMOVE, {0, 0});
+    tree::base::apply_patch(root, patch);
+    ASSERT_EQ(root->exprs.size(), 1u);
+    EXPECT_EQ(root->exprs[0]->as_leaf()->name.str(), "b");
+}
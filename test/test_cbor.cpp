@@ -1,5 +1,8 @@
 #include "tree-cbor.hpp"
 
+#include <cstdio>
+#include <filesystem>
+#include <fstream>
 #include <gtest/gtest.h>
 #include <sstream>
 
@@ -158,3 +161,272 @@ TEST(cbor, main) {
 
     std::cout << "Test passed" << std::endl;
 }
+
+
+TEST(cbor, borrowed) {
+    // A reader over a borrowed buffer must decode the same way as one that
+    // owns a copy of the data.
+    auto reader = tree::cbor::Reader(TEST_CBOR, sizeof(TEST_CBOR));
+    auto ar = reader.as_array();
+    EXPECT_EQ(ar.size(), 9u);
+    EXPECT_EQ(ar.at(3).as_array().at(10).as_int(), 9223372036854775807);
+    EXPECT_EQ(ar.at(6).as_string(), "hello");
+    EXPECT_EQ(ar.at(8).as_map().at("c").as_string(), "d");
+    EXPECT_EQ(ar.at(7).get_contents(), std::string("\x45world"));
+
+    // Empty and invalid buffers are rejected just like strings are.
+    EXPECT_THROW(tree::cbor::Reader(TEST_CBOR, 0), std::runtime_error);
+    EXPECT_THROW(tree::cbor::Reader(TEST_CBOR, sizeof(TEST_CBOR) - 1), std::runtime_error);
+}
+
+TEST(cbor, stream) {
+    std::istringstream ss{std::string((const char*)TEST_CBOR, sizeof(TEST_CBOR))};
+    auto reader = tree::cbor::Reader(ss);
+    EXPECT_EQ(reader.as_array().at(6).as_string(), "hello");
+}
+
+TEST(cbor, mapped_file) {
+    auto path = (std::filesystem::temp_directory_path() / "tree-gen-test-mapped-file.cbor").string();
+    {
+        std::ofstream f(path, std::ios::out | std::ios::trunc | std::ios::binary);
+        f.write((const char*)TEST_CBOR, sizeof(TEST_CBOR));
+    }
+
+    // The reader must keep the mapping alive after the last external
+    // reference to it is dropped.
+    auto reader = tree::cbor::Reader(std::make_shared<const tree::cbor::MappedFile>(path));
+    auto ar = reader.as_array();
+    EXPECT_EQ(ar.size(), 9u);
+    EXPECT_EQ(ar.at(6).as_string(), "hello");
+    EXPECT_EQ(ar.at(8).as_map().at("a").as_string(), "b");
+    std::remove(path.c_str());
+
+    EXPECT_THROW(tree::cbor::MappedFile{path}, std::runtime_error);
+}
+
+TEST(cbor, lazy_map) {
+    // Indefinite-length map with a definite-length and an indefinite-length
+    // key, followed by an indefinite-length array.
+    const uint8_t data[] = {
+        0xBF,                                                       // map(*)
+            0x61, 0x61,                                             // "a"
+            0x01,                                                   // unsigned(1)
+            0x7F, 0x61, 0x62, 0x61, 0x63, 0xFF,                     // "b" "c"
+            0x02,                                                   // unsigned(2)
+            0x61, 0x64,                                             // "d"
+            0x9F, 0x03, 0x04, 0xFF,                                 // [3, 4]
+            0xFF                                                    // primitive(*)
+    };
+    auto reader = tree::cbor::Reader(data, sizeof(data));
+    auto map = reader.as_map();
+    EXPECT_EQ(map.size(), 3u);
+    EXPECT_FALSE(map.empty());
+
+    // Iteration yields the entries in order of appearance.
+    std::vector<std::string> keys;
+    for (const auto &it : map) {
+        keys.emplace_back(it.first);
+    }
+    EXPECT_EQ(keys, (std::vector<std::string>{"a", "bc", "d"}));
+
+    // Copies of an iterator keep a valid key after the original is advanced.
+    auto it = map.find("bc");
+    ASSERT_NE(it, map.end());
+    auto copy = it;
+    ++it;
+    EXPECT_EQ(copy->first, "bc");
+    EXPECT_EQ(it->first, "d");
+
+    // Lookups with a hint wrap around.
+    auto hint = map.begin();
+    EXPECT_EQ(map.at("d", hint).as_array().at(1).as_int(), 4);
+    EXPECT_EQ(hint, map.end());
+    EXPECT_EQ(map.at("a", hint).as_int(), 1);
+    EXPECT_EQ(map.at("bc", hint).as_int(), 2);
+    EXPECT_EQ(map.count("a"), 1u);
+    EXPECT_EQ(map.count("b"), 0u);
+    EXPECT_EQ(map.find("b"), map.end());
+    EXPECT_THROW(map.at("b"), std::out_of_range);
+
+    auto ar = map.at("d").as_array();
+    EXPECT_EQ(ar.size(), 2u);
+    int64_t sum = 0;
+    for (const auto &item : ar) {
+        sum += item.as_int();
+    }
+    EXPECT_EQ(sum, 7);
+    EXPECT_THROW(ar.at(2), std::out_of_range);
+}
+
+TEST(cbor, writer) {
+    // Definite-length structures get a length header instead of a break.
+    std::string encoded;
+    {
+        tree::cbor::Writer writer{encoded};
+        auto map = writer.start(2);
+        auto ar = map.append_array("a", 2);
+        ar.append_int(1);
+        ar.append_map(0).close();
+        ar.close();
+        auto sub = map.append_map("b");
+        sub.append_null("c");
+        sub.close();
+        map.close();
+    }
+    EXPECT_EQ(encoded, std::string(
+        "\xA2"
+            "\x61" "a" "\x82" "\x01" "\xA0"
+            "\x61" "b" "\xBF" "\x61" "c" "\xF6" "\xFF",
+        13
+    ));
+    auto map = tree::cbor::Reader(encoded).as_map();
+    EXPECT_EQ(map.at("a").as_array().at(0).as_int(), 1);
+    EXPECT_TRUE(map.at("b").as_map().at("c").is_null());
+
+    // Writing to a stream buffers until the toplevel structure is closed.
+    std::ostringstream ss;
+    {
+        tree::cbor::Writer writer{ss};
+        auto outer = writer.start();
+        outer.append_string("x", "y");
+        EXPECT_TRUE(ss.str().empty());
+        outer.close();
+        EXPECT_EQ(ss.str(), "\xBF\x61x\x61y\xFF");
+    }
+
+    // Nesting and length violations are detected.
+    std::string ignored;
+    tree::cbor::Writer writer{ignored};
+    auto outer = writer.start();
+    auto inner = outer.append_array("i", 1);
+    EXPECT_THROW(outer.append_int("x", 1), std::runtime_error);
+    EXPECT_THROW(inner.close(), std::runtime_error);
+    inner.append_int(1);
+    EXPECT_THROW(inner.append_int(2), std::runtime_error);
+    inner.close();
+    EXPECT_THROW(writer.start(), std::runtime_error);
+    outer.close();
+
+    // Structures that are left incomplete by an exception are closed without
+    // throwing from the destructors.
+    std::string partial;
+    EXPECT_THROW({
+        tree::cbor::Writer writer{partial};
+        auto map = writer.start(2);
+        auto ar = map.append_array("a", 3);
+        ar.append_int(1);
+        throw std::runtime_error("oops");
+    }, std::runtime_error);
+}
+
+TEST(cbor, event_reader) {
+    using tree::cbor::Event;
+
+    // Pull the known-good data event by event.
+    tree::cbor::EventReader reader{TEST_CBOR, sizeof(TEST_CBOR)};
+    EXPECT_EQ(reader.read_array(), 9u);
+    EXPECT_TRUE(reader.at_null());
+    reader.read_null();
+    EXPECT_FALSE(reader.read_bool());
+    EXPECT_TRUE(reader.read_bool());
+    EXPECT_EQ(reader.read_array(), 11u);
+    EXPECT_EQ(reader.read_int(), 0);
+    for (size_t i = 1; i < 10; i++) {
+        reader.skip();
+    }
+    EXPECT_EQ(reader.read_int(), 9223372036854775807);
+    EXPECT_TRUE(reader.at_end());
+    reader.read_end();
+    EXPECT_EQ(reader.read_array(), tree::cbor::INDEFINITE);
+    EXPECT_EQ(reader.read_int(), -1);
+    EXPECT_EQ(reader.read_int(), -24);
+    EXPECT_EQ(reader.depth(), 2u);
+    auto skipped = 0;
+    while (!reader.at_end()) {
+        reader.skip();
+        skipped++;
+    }
+    EXPECT_EQ(skipped, 8);
+    reader.read_end();
+    EXPECT_EQ(reader.read_float(), 3.14159265359);
+    EXPECT_EQ(reader.read_string(), "hello");
+    EXPECT_EQ(reader.read_binary(), "world");
+    EXPECT_EQ(reader.read_map(), 2u);
+    EXPECT_TRUE(reader.at_key());
+    EXPECT_EQ(reader.read_key(), "a");
+    EXPECT_FALSE(reader.at_key());
+    EXPECT_THROW(reader.read_key(), std::runtime_error);
+    EXPECT_EQ(reader.read_string(), "b");
+    EXPECT_EQ(reader.read_key(), "c");
+    EXPECT_EQ(reader.next(), Event::STRING);
+    EXPECT_EQ(reader.get_string(), "d");
+    EXPECT_EQ(reader.next(), Event::END);
+    EXPECT_EQ(reader.next(), Event::END);
+    EXPECT_EQ(reader.depth(), 0u);
+    reader.finish();
+    EXPECT_THROW(reader.next(), std::runtime_error);
+
+    // Streams are read in chunks without knowing the total size, and items
+    // can be extracted into a Reader.
+    std::istringstream ss{std::string((const char*)TEST_CBOR, sizeof(TEST_CBOR))};
+    tree::cbor::EventReader stream_reader{ss};
+    EXPECT_EQ(stream_reader.read_array(), 9u);
+    for (size_t i = 0; i < 4; i++) {
+        stream_reader.skip();
+    }
+    auto item = stream_reader.read_item();
+    EXPECT_EQ(item.as_array().at(8).as_int(), -4294967297);
+    stream_reader.skip();
+    EXPECT_EQ(stream_reader.read_item().as_string(), "hello");
+    stream_reader.skip();
+    EXPECT_EQ(stream_reader.read_item().as_map().at("c").as_string(), "d");
+    stream_reader.read_end();
+    stream_reader.finish();
+
+    // Declared lengths are not trusted: a huge string in a short stream
+    // fails at the end of the data rather than allocating up front, and a
+    // length that collides with INDEFINITE is rejected.
+    std::istringstream huge{std::string("\x5B\x00\x00\x01\x00\x00\x00\x00\x00" "abc", 12)};
+    tree::cbor::EventReader huge_reader{huge};
+    EXPECT_THROW(huge_reader.next(), std::runtime_error);
+    const std::string max_length("\x9B\xFF\xFF\xFF\xFF\xFF\xFF\xFF\xFF", 9);
+    tree::cbor::EventReader max_reader{max_length};
+    EXPECT_THROW(max_reader.next(), std::runtime_error);
+
+    // Push events to a handler.
+    struct Recorder : tree::cbor::EventHandler {
+        std::string log;
+        void null_value() override { log += "N"; }
+        void int_value(int64_t value) override { log += std::to_string(value); }
+        void string_value(std::string_view value) override { log += "s" + std::string(value); }
+        void begin_array(size_t) override { log += "["; }
+        void end_array() override { log += "]"; }
+        void begin_map(size_t) override { log += "{"; }
+        void key(std::string_view value) override { log += "k" + std::string(value); }
+        void end_map() override { log += "}"; }
+    };
+    const uint8_t data[] = {
+        0xBF,                                                       // map(*)
+            0x61, 0x61,                                             // "a"
+            0x9F, 0x01, 0xF6, 0xFF,                                 // [1, null]
+            0x7F, 0x61, 0x62, 0x61, 0x63, 0xFF,                     // "b" "c"
+            0x61, 0x64,                                             // "d"
+            0xFF                                                    // primitive(*)
+    };
+    Recorder recorder;
+    tree::cbor::EventReader push_reader{data, sizeof(data)};
+    push_reader.read(recorder);
+    push_reader.finish();
+    EXPECT_EQ(recorder.log, "{ka[1N]kbcsd}");
+
+    // Errors are reported as they are encountered.
+    tree::cbor::EventReader truncated{TEST_CBOR, sizeof(TEST_CBOR) - 1};
+    EXPECT_THROW(truncated.skip(), std::runtime_error);
+    tree::cbor::EventReader garbage{TEST_CBOR, 2};
+    EXPECT_EQ(garbage.next(), Event::BEGIN_ARRAY);
+    EXPECT_THROW(garbage.read_int(), std::runtime_error);
+    EXPECT_THROW(garbage.finish(), std::runtime_error);
+    const uint8_t bad_key[] = {0xA1, 0x01, 0x02};
+    tree::cbor::EventReader bad_key_reader{bad_key, sizeof(bad_key)};
+    EXPECT_THROW(bad_key_reader.read(recorder), std::runtime_error);
+}
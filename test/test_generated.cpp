@@ -0,0 +1,214 @@
+#include "test_tree.hpp"
+
+#include <gtest/gtest.h>
+
+using test_primitives::Name;
+
+namespace {
+
+/**
+ * Returns a leaf with the given name.
+ */
+tree::base::One<test_tree::Leaf> leaf(const char *name) {
+    return tree::base::make<test_tree::Leaf>(Name{name});
+}
+
+/**
+ * Returns the name of the given leaf expression.
+ */
+std::string name_of(const tree::base::One<test_tree::Expr> &expr) {
+    return expr->as_leaf()->name.str();
+}
+
+} // namespace
+
+TEST(generated, deserialize_field_order) {
+
+    // Symbols are numbered in the order they are read, so the fields of a
+    // node must be read in the order they were written, also through the
+    // map-based cbor::Reader entry point.
+    auto root = tree::base::make<test_tree::Root>();
+    root->exprs.add(tree::base::make<test_tree::Pair>(
+        tree::base::make<test_tree::Pair>(leaf("a"), leaf("a")), leaf("b")));
+    root->exprs.add(tree::base::make<test_tree::Pair>(
+        tree::base::make<test_tree::Pair>(leaf("a"), leaf("b")), leaf("a")));
+    auto cbor = tree::base::serialize(root);
+    for (auto compact : {false, true}) {
+        if (compact) {
+            cbor = tree::base::serialize_compact(root);
+        }
+        auto copy = tree::base::deserialize<test_tree::Root>(tree::cbor::Reader{cbor});
+        ASSERT_EQ(copy->exprs.size(), 2u);
+        auto first = copy->exprs[0]->as_pair();
+        EXPECT_EQ(name_of(first->left->as_pair()->left), "a");
+        EXPECT_EQ(name_of(first->left->as_pair()->right), "a");
+        EXPECT_EQ(name_of(first->right), "b");
+        auto second = copy->exprs[1]->as_pair();
+        EXPECT_EQ(name_of(second->left->as_pair()->left), "a");
+        EXPECT_EQ(name_of(second->left->as_pair()->right), "b");
+        EXPECT_EQ(name_of(second->right), "a");
+        EXPECT_TRUE(copy.equals(root));
+        EXPECT_EQ(tree::base::serialize(copy), tree::base::serialize(root));
+    }
+}
+
+TEST(generated, shared_subtrees) {
+
+    // Back-references to frozen subtrees refer to the first occurrence, which
+    // must thus be read first, also when it is in a different field of the
+    // same node.
+    tree::base::One<test_tree::Expr> shared = tree::base::make<test_tree::Pair>(leaf("a"), leaf("b"));
+    shared.freeze();
+    auto root = tree::base::make<test_tree::Root>();
+    root->exprs.add(tree::base::make<test_tree::Pair>(shared, shared));
+    root->exprs.add(tree::base::make<test_tree::Pair>(leaf("c"), leaf("c")));
+    tree::base::Interner interner{};
+    interner.intern(root);
+    ASSERT_NO_THROW(root.check_well_formed());
+    auto interned = root->exprs[1]->as_pair();
+    ASSERT_EQ(interned->left, interned->right);
+
+    auto check = [&](const tree::base::Maybe<test_tree::Root> &copy) {
+        ASSERT_EQ(copy->exprs.size(), 2u);
+        for (size_t i = 0; i < 2; i++) {
+            auto pair = copy->exprs[i]->as_pair();
+            EXPECT_EQ(pair->left, pair->right);
+            EXPECT_TRUE(pair->left.is_frozen());
+        }
+        EXPECT_TRUE(copy.equals(root));
+        EXPECT_NO_THROW(copy.check_well_formed());
+    };
+    auto cbor = tree::base::serialize(root);
+    check(tree::base::deserialize<test_tree::Root>(tree::cbor::Reader{cbor}));
+    check(tree::base::deserialize<test_tree::Root>(cbor));
+    cbor = tree::base::serialize_compact(root);
+    check(tree::base::deserialize<test_tree::Root>(tree::cbor::Reader{cbor}));
+    check(tree::base::deserialize<test_tree::Root>(cbor));
+}
+
+TEST(generated, serialize_failure) {
+
+    // Serializing a link to a node outside the tree fails halfway through
+    // the definite-length array of an Any edge, which must not terminate the
+    // process.
+    auto root = tree::base::make<test_tree::Root>();
+    tree::base::One<test_tree::Expr> orphan = leaf("a");
+    root->exprs.add(leaf("b"));
+    root->exprs.add(tree::base::make<test_tree::Ref>(orphan));
+    root->exprs.add(leaf("c"));
+    EXPECT_THROW(tree::base::serialize(root, tree::base::Validation::SKIP), std::runtime_error);
+    EXPECT_THROW(tree::base::serialize_compact(root, tree::base::Validation::SKIP), std::runtime_error);
+    EXPECT_THROW(tree::base::serialize(root), tree::base::NotWellFormed);
+}
+
+TEST(generated, flatten_shared_subtrees) {
+
+    // Frozen subtrees that appear more than once are flattened once, with
+    // every parent referring to the same record, and are shared again after
+    // unflattening.
+    tree::base::One<test_tree::Expr> shared = tree::base::make<test_tree::Pair>(leaf("a"), leaf("b"));
+    shared.freeze();
+    auto item = tree::base::make<test_tree::Item>();
+    item->elements.add(shared);
+    item->elements.add(tree::base::make<test_tree::Ref>(shared));
+    item->elements.add(shared);
+    auto root = tree::base::make<test_tree::Root>();
+    root->exprs.add(tree::base::make<test_tree::Pair>(shared, leaf("c")));
+    root->exprs.add(item);
+    ASSERT_NO_THROW(root.check_well_formed());
+
+    auto flat = test_tree::FlatTree::flatten(root);
+    EXPECT_EQ(flat.size(), 8u);
+    EXPECT_EQ(flat.records[0].end, 8u);
+    EXPECT_EQ(flat.records[1].end, 6u);
+    auto &lists = flat.lists;
+    auto elements = flat.item_rows.elements[0];
+    ASSERT_EQ(elements.size, 3u);
+    EXPECT_EQ(lists[elements.begin], lists[elements.begin + 2]);
+    EXPECT_EQ(flat.ref_rows.target[0], lists[elements.begin]);
+    EXPECT_EQ(flat.pair_rows.left[0], lists[elements.begin]);
+
+    auto copy = flat.unflatten().as<test_tree::Root>();
+    EXPECT_NO_THROW(copy.check_well_formed());
+    auto copy_item = copy->exprs[1]->as_item();
+    EXPECT_EQ(copy_item->elements[1]->as_ref()->target, copy_item->elements[0]);
+    EXPECT_EQ(copy_item->elements[0], copy_item->elements[2]);
+    EXPECT_EQ(copy_item->elements[0], copy->exprs[0]->as_pair()->left);
+    EXPECT_TRUE(copy_item->elements[0].is_frozen());
+    EXPECT_FALSE(copy_item->is_frozen());
+
+    // Other nodes still may not appear more than once.
+    auto leaf_c = root->exprs[0]->as_pair()->right;
+    item->elements.add(leaf_c);
+    EXPECT_THROW(test_tree::FlatTree::flatten(root), tree::base::NotWellFormed);
+}
+
+TEST(generated, chunked) {
+
+    // The elements of the outermost Any edge are written as separate chunks,
+    // which are loaded on demand or all at once, restoring the links between
+    // them.
+    auto root = tree::base::make<test_tree::Root>();
+    root->exprs.add(tree::base::make<test_tree::Pair>(leaf("a"), leaf("b")));
+    root->exprs.add(tree::base::make<test_tree::Ref>(root->exprs[0]->as_pair()->left));
+    auto item = tree::base::make<test_tree::Item>();
+    item->elements.add(leaf("c"));
+    item->elements.add(leaf("d"));
+    root->exprs.add(item);
+    auto cbor = tree::base::serialize_chunked(root, 2);
+
+    tree::base::ChunkedTree<test_tree::Root> chunked{cbor};
+    const auto &copy = chunked.get();
+    ASSERT_EQ(chunked.size(), 3u);
+    EXPECT_EQ(chunked.pending(), 3u);
+    ASSERT_EQ(copy->exprs.size(), 3u);
+    EXPECT_TRUE(copy->exprs[0].empty());
+    EXPECT_THROW(copy.check_well_formed(), tree::base::NotWellFormed);
+
+    // The link is restored once the chunk with its target is loaded.
+    chunked.load(1);
+    EXPECT_TRUE(chunked.is_loaded(1));
+    EXPECT_FALSE(chunked.is_loaded(0));
+    EXPECT_TRUE(copy->exprs[1]->as_ref()->target.empty());
+    chunked.load(copy->exprs);
+    EXPECT_EQ(chunked.pending(), 0u);
+    EXPECT_EQ(copy->exprs[1]->as_ref()->target, copy->exprs[0]->as_pair()->left);
+    EXPECT_EQ(copy->exprs[2]->as_item()->elements.size(), 2u);
+    EXPECT_NO_THROW(copy.check_well_formed());
+    EXPECT_EQ(tree::base::serialize(copy), tree::base::serialize(root));
+    EXPECT_THROW(chunked.load(3), tree::base::OutOfRange);
+
+    // Loading everything in parallel gives the same tree, also for deeply
+    // nested chunks, which are decoded in a single sequential pass.
+    for (size_t i = 0; i < 2000; i++) {
+        auto outer = tree::base::make<test_tree::Item>();
+        outer->elements.add(root->exprs[2]);
+        root->exprs[2] = outer;
+    }
+    cbor = tree::base::serialize_chunked(root, 2);
+    for (size_t threads : {1, 4}) {
+        tree::base::ChunkedTree<test_tree::Root> all{cbor};
+        all.load_all(threads);
+        EXPECT_EQ(all.pending(), 0u);
+        EXPECT_EQ(tree::base::serialize(all.get()), tree::base::serialize(root));
+    }
+    auto parallel = tree::base::deserialize_chunked<test_tree::Root>(cbor, 2);
+    EXPECT_EQ(tree::base::serialize(parallel), tree::base::serialize(root));
+
+    // Truncated chunk data is rejected.
+    EXPECT_THROW(tree::base::deserialize_chunked<test_tree::Root>(cbor.substr(0, cbor.size() - 4), 1), std::runtime_error);
+}
+
+TEST(generated, clone_move_only_annotation) {
+
+    // Cloning copies the annotations of every node, which must not fail for
+    // annotations that are not copy-constructible; the copies share them.
+    auto root = tree::base::make<test_tree::Root>();
+    root->exprs.add(leaf("a"));
+    root->exprs[0]->set_annotation(std::make_unique<int>(42));
+    tree::base::Maybe<test_tree::Root> copy;
+    ASSERT_NO_THROW(copy = root.clone());
+    auto &annotation = copy->exprs[0]->get_annotation<std::unique_ptr<int>>();
+    EXPECT_EQ(annotation, root->exprs[0]->get_annotation<std::unique_ptr<int>>());
+    EXPECT_EQ(*annotation, 42);
+}
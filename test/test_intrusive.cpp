@@ -0,0 +1,146 @@
+// Instantiates a second copy of the support library in its own namespace, with
+// intrusive node handles and arena allocation. test_intrusive_generated.cpp
+// tests a generated tree that uses it.
+#include "test_intrusive_config.hpp.inc"
+#include "tree-all.cpp.inc"
+
+#include <gtest/gtest.h>
+
+namespace base = intrusive_tree::base;
+
+/**
+ * Node type for the intrusive handle tests, which counts the live instances.
+ */
+struct Node : public base::Base {
+    base::Any<Node> children;
+    base::OptLink<Node> back;
+
+    static size_t live;
+
+    Node() {
+        live++;
+    }
+
+    Node(const Node &other) : base::Base(other), children(other.children), back(other.back) {
+        live++;
+    }
+
+    ~Node() override {
+        live--;
+    }
+
+    base::One<Node> copy() const {
+        return base::make<Node>(*this);
+    }
+
+    bool equals(const Node &rhs) const {
+        return children.equals(rhs.children) && back.equals(rhs.back);
+    }
+
+    void find_reachable_step(base::PointerMap &map, ConstWorkStack &stack) const override {
+        (void) map;
+        stack.push_back(&back);
+        stack.push_back(&children);
+    }
+
+    void check_complete_step(const base::PointerMap &map, ConstWorkStack &stack) const override {
+        (void) map;
+        stack.push_back(&back);
+        stack.push_back(&children);
+    }
+
+    void validate_step(base::PointerMap &map, ConstWorkStack &stack) const override {
+        (void) map;
+        stack.push_back(&back);
+        stack.push_back(&children);
+    }
+
+    void clone_step(WorkStack &stack, base::CloneMap *copies) override {
+        stack.push_back(&children);
+        if (copies) {
+            copies->register_link(back);
+        }
+    }
+};
+
+size_t Node::live = 0;
+
+TEST(intrusive, handles) {
+    static_assert(std::is_same<base::NodePtr<Node>, base::Handle<Node>>::value, "");
+    EXPECT_EQ(sizeof(base::Handle<Node>), sizeof(void*));
+    {
+        auto root = base::make<Node>();
+        EXPECT_EQ(root.get_ptr().use_count(), 1);
+        root->children.emplace<Node>();
+        root->children[0]->back = root;
+        EXPECT_EQ(Node::live, 2u);
+
+        // Copies share the count stored in the node; links don't add to it.
+        auto copy = root.get_ptr();
+        EXPECT_EQ(root.get_ptr().use_count(), 2);
+        copy.reset();
+        EXPECT_EQ(root.get_ptr().use_count(), 1);
+
+        // Type-erased handles keep the node alive and cast back.
+        base::NodePtr<const void> erased = root->children[0].get_ptr();
+        root->children.remove();
+        EXPECT_EQ(Node::live, 2u);
+        auto child = base::static_pointer_cast<const Node>(erased);
+        EXPECT_EQ(child->back.get_ptr(), root.get_ptr());
+        erased.reset();
+        child.reset();
+        EXPECT_EQ(Node::live, 1u);
+
+        // A handle can be made from a node that has them already.
+        auto again = base::NodePtr<Node>(root.get_ptr().get());
+        EXPECT_EQ(again, root.get_ptr());
+        EXPECT_EQ(again.use_count(), 2);
+        EXPECT_TRUE(base::dynamic_pointer_cast<Node>(base::NodePtr<base::Base>(again)));
+    }
+    EXPECT_EQ(Node::live, 0u);
+
+    // Links expire when their target is destroyed.
+    auto root = base::make<Node>();
+    {
+        auto target = base::make<Node>();
+        root->back = target;
+        EXPECT_FALSE(root->back.empty());
+    }
+    EXPECT_TRUE(root->back.empty());
+    EXPECT_FALSE(root->back.get_ptr());
+}
+
+TEST(intrusive, trees) {
+    auto root = base::make<Node>();
+    for (size_t i = 0; i < 16; i++) {
+        auto child = base::make<Node>();
+        child->back = root;
+        child->children.emplace<Node>();
+        root->children.add(child);
+    }
+    EXPECT_NO_THROW(root.check_well_formed());
+
+    // The parallel entry points run on the calling thread.
+    EXPECT_EQ(base::resolve_threads(4), 1u);
+    auto copy = root.clone_parallel(4);
+    EXPECT_NO_THROW(copy.check_well_formed_parallel(4));
+    EXPECT_EQ(copy->children[3]->back, copy);
+    EXPECT_EQ(Node::live, 2 * (1 + 2 * 16u));
+    copy.reset();
+    root.reset();
+    EXPECT_EQ(Node::live, 0u);
+
+    // Nodes allocated from an arena are freed through the allocator they
+    // were allocated with, also when that arena is no longer active.
+    base::Arena arena{};
+    base::Maybe<Node> node{};
+    {
+        base::Arena::Scope scope{arena};
+        node = base::make<Node>();
+        node->children.emplace<Node>();
+    }
+    EXPECT_GE(arena.bytes_used(), 2 * sizeof(Node));
+    node->children.emplace<Node>();
+    node.reset();
+    EXPECT_EQ(Node::live, 0u);
+}
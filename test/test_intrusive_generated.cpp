@@ -0,0 +1,80 @@
+#include "test_intrusive_tree.hpp"
+
+#include <gtest/gtest.h>
+
+namespace base = intrusive_tree::base;
+namespace gen = intrusive_test_tree;
+
+using intrusive_primitives::Name;
+
+namespace {
+
+/**
+ * Returns a leaf with the given name.
+ */
+base::One<gen::Expr> leaf(const char *name) {
+    return base::make<gen::Leaf>(Name{name});
+}
+
+/**
+ * Returns a tree with a pair of leaves, a reference to the left leaf, and a
+ * frozen pair that appears twice.
+ */
+base::One<gen::Root> example() {
+    auto root = base::make<gen::Root>();
+    root->exprs.add(base::make<gen::Pair>(leaf("a"), leaf("b")));
+    root->exprs.add(base::make<gen::Ref>(root->exprs[0]->as_pair()->left));
+    base::One<gen::Expr> shared = base::make<gen::Pair>(leaf("c"), leaf("c"));
+    shared.freeze();
+    root->exprs.add(shared);
+    root->exprs.add(shared);
+    return root;
+}
+
+/**
+ * Checks that the given tree is a copy of example() of its own.
+ */
+void check_copy(const base::Maybe<gen::Root> &copy, const base::Maybe<gen::Root> &original) {
+    ASSERT_NO_THROW(copy.check_well_formed());
+    ASSERT_EQ(copy->exprs.size(), 4u);
+    EXPECT_NE(copy->exprs[0], original->exprs[0]);
+    auto pair = copy->exprs[0]->as_pair();
+    EXPECT_EQ(pair->left->as_leaf()->name.str(), "a");
+    EXPECT_EQ(pair->right->as_leaf()->name.str(), "b");
+    EXPECT_EQ(copy->exprs[1]->as_ref()->target, pair->left);
+    EXPECT_EQ(copy->exprs[3]->as_pair()->right->as_leaf()->name.str(), "c");
+}
+
+} // namespace
+
+TEST(intrusive, generated) {
+    static_assert(std::is_same<base::NodePtr<gen::Root>, base::Handle<gen::Root>>::value, "");
+    auto root = example();
+    ASSERT_NO_THROW(root.check_well_formed());
+    EXPECT_EQ(root.get_ptr().use_count(), 1);
+    EXPECT_EQ(root->exprs[2], root->exprs[3]);
+
+    // Both serialization formats round-trip, restoring the links and the
+    // shared frozen subtree.
+    for (auto compact : {false, true}) {
+        auto cbor = compact ? base::serialize_compact(root) : base::serialize(root);
+        auto copy = base::deserialize<gen::Root>(cbor);
+        check_copy(copy, root);
+        EXPECT_EQ(copy->exprs[2], copy->exprs[3]);
+        EXPECT_TRUE(copy->exprs[2].is_frozen());
+    }
+
+    // So do the flattened representation and deep copies.
+    auto flat = gen::FlatTree::flatten(root);
+    EXPECT_EQ(flat.size(), 8u);
+    check_copy(flat.unflatten().as<gen::Root>(), root);
+    auto copy = root.clone();
+    EXPECT_NE(copy->exprs[0], root->exprs[0]);
+    EXPECT_EQ(copy->exprs[0]->as_pair()->left->as_leaf()->name.str(), "a");
+
+    // Links expire along with the node they refer to.
+    auto ref = root->exprs[1]->as_ref();
+    root->exprs[0]->as_pair()->left = leaf("d");
+    EXPECT_TRUE(ref->target.empty());
+    EXPECT_THROW(root.check_well_formed(), base::NotWellFormed);
+}
@@ -0,0 +1,58 @@
+/** \file
+ * Declares the copy of the support library with intrusive node handles, which
+ * test_intrusive.cpp instantiates, and the primitives used in the generated
+ * tree that uses it.
+ */
+
+#pragma once
+
+#include "test_intrusive_config.hpp.inc"
+#include "tree-all.hpp.inc"
+
+/**
+ * Namespace with the primitives used in the generated intrusive test tree.
+ */
+namespace intrusive_primitives {
+
+/**
+ * Names, used to exercise the symbol tables of the serialization formats.
+ */
+using Name = intrusive_tree::base::Symbol;
+
+/**
+ * Initialization function.
+ */
+template <class T>
+T initialize() { return T(); };
+
+/**
+ * Serialization function. This must be specialized for any types used as
+ * primitives in a tree.
+ */
+template <typename T>
+void serialize(const T &obj, intrusive_tree::cbor::MapWriter &map);
+
+/**
+ * Serialization function for Name.
+ */
+template <>
+inline void serialize<Name>(const Name &obj, intrusive_tree::cbor::MapWriter &map) {
+    obj.serialize(map);
+}
+
+/**
+ * Deserialization function. This must be specialized for any types used as
+ * primitives in a tree.
+ */
+template <typename T>
+T deserialize(const intrusive_tree::cbor::MapReader &map);
+
+/**
+ * Deserialization function for Name.
+ */
+template <>
+inline Name deserialize<Name>(const intrusive_tree::cbor::MapReader &map) {
+    return Name::deserialize(map);
+}
+
+} // namespace intrusive_primitives
@@ -0,0 +1,88 @@
+# Checks the files written by tree-gen, as a CMake script taking the following
+# variables:
+#  - TREE_GEN: the tree-gen executable.
+#  - TREE: the tree file to generate the files for.
+#  - OUTPUT_DIR: the (scratch) directory to write the files to.
+# tree-gen must leave files of which the contents did not change alone, and
+# must generate the same definitions when it shards the source code as when
+# it does not, in the files that generate_tree() expects.
+
+cmake_minimum_required(VERSION 3.12 FATAL_ERROR)
+include("${CMAKE_CURRENT_LIST_DIR}/../cmake/generate_tree.cmake")
+
+# Runs tree-gen for the given number of shards (zero for none), writing the
+# files to OUTPUT_DIR/NAME. Sets FILES to the files generate_tree() expects in
+# the parent scope, and checks that tree-gen wrote exactly those.
+function(run_tree_gen NAME SHARDS)
+    set(DIR "${OUTPUT_DIR}/${NAME}")
+    _tree_gen_outputs("${DIR}/tree.hpp" "${DIR}/tree.cpp" "${SHARDS}")
+    set(EXPECTED ${TREE_GEN_HDRS} ${TREE_GEN_SRCS} "${DIR}/tree.py")
+    file(MAKE_DIRECTORY "${DIR}")
+    execute_process(
+        COMMAND "${TREE_GEN}" ${TREE_GEN_ARGS} "${TREE}" "${DIR}/tree.hpp" "${DIR}/tree.cpp" "${DIR}/tree.py"
+        RESULT_VARIABLE RESULT
+    )
+    if(NOT RESULT EQUAL 0)
+        message(FATAL_ERROR "tree-gen ${TREE_GEN_ARGS} failed")
+    endif()
+    file(GLOB ACTUAL "${DIR}/*")
+    list(SORT EXPECTED)
+    list(SORT ACTUAL)
+    if(NOT ACTUAL STREQUAL EXPECTED)
+        message(FATAL_ERROR "tree-gen ${TREE_GEN_ARGS} wrote ${ACTUAL}, expected ${EXPECTED}")
+    endif()
+    set(FILES "${EXPECTED}" PARENT_SCOPE)
+endfunction()
+
+# Sets VAR to the sorted top-level lines of the given files that start a
+# definition or declaration.
+function(read_definitions VAR)
+    set(LINES "")
+    foreach(FILE ${ARGN})
+        file(STRINGS "${FILE}" CONTENTS REGEX "^[A-Za-z_]")
+        list(FILTER CONTENTS EXCLUDE REGEX "^namespace ")
+        list(APPEND LINES ${CONTENTS})
+    endforeach()
+    list(SORT LINES)
+    set(${VAR} "${LINES}" PARENT_SCOPE)
+endfunction()
+
+file(REMOVE_RECURSE "${OUTPUT_DIR}")
+
+# Running tree-gen again for the same tree doesn't touch any of the files.
+# Timestamps only have a resolution of a second here, so wait long enough for
+# a rewrite to be noticed.
+foreach(SHARDS 0 3)
+    run_tree_gen("rerun-${SHARDS}" ${SHARDS})
+    set(BEFORE "")
+    foreach(FILE ${FILES})
+        file(TIMESTAMP "${FILE}" TIME "%s")
+        list(APPEND BEFORE "${TIME}")
+    endforeach()
+    execute_process(COMMAND "${CMAKE_COMMAND}" -E sleep 1.1)
+    run_tree_gen("rerun-${SHARDS}" ${SHARDS})
+    set(AFTER "")
+    foreach(FILE ${FILES})
+        file(TIMESTAMP "${FILE}" TIME "%s")
+        list(APPEND AFTER "${TIME}")
+    endforeach()
+    if(NOT AFTER STREQUAL BEFORE)
+        message(FATAL_ERROR "running tree-gen again modified its outputs: ${BEFORE} became ${AFTER}")
+    endif()
+endforeach()
+
+# The sharded sources and headers contain the same definitions as the
+# unsharded ones, each exactly once.
+run_tree_gen(plain 0)
+run_tree_gen(sharded 3)
+set(DIR "${OUTPUT_DIR}/sharded")
+foreach(KIND hpp cpp)
+    read_definitions(PLAIN "${OUTPUT_DIR}/plain/tree.${KIND}")
+    file(GLOB SHARDED "${DIR}/*.${KIND}")
+    read_definitions(SHARDED ${SHARDED})
+    if(NOT SHARDED STREQUAL PLAIN)
+        message(FATAL_ERROR "sharded .${KIND} files don't contain the same definitions as the unsharded one")
+    endif()
+    list(LENGTH PLAIN COUNT)
+    message(STATUS "${COUNT} .${KIND} definitions match")
+endforeach()
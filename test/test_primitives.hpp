@@ -0,0 +1,55 @@
+/** \file
+ * Defines the primitives used in the generated trees of the tests.
+ */
+
+#pragma once
+
+#include "tree-base.hpp"
+
+/**
+ * Namespace with the primitives used in the generated trees of the tests.
+ */
+namespace test_primitives {
+
+/**
+ * Names, used to exercise the symbol tables of the serialization formats.
+ */
+using Name = tree::base::Symbol;
+
+/**
+ * Initialization function.
+ */
+template <class T>
+T initialize() { return T(); };
+
+/**
+ * Serialization function. This must be specialized for any types used as
+ * primitives in a tree.
+ */
+template <typename T>
+void serialize(const T &obj, tree::cbor::MapWriter &map);
+
+/**
+ * Serialization function for Name.
+ */
+template <>
+inline void serialize<Name>(const Name &obj, tree::cbor::MapWriter &map) {
+    obj.serialize(map);
+}
+
+/**
+ * Deserialization function. This must be specialized for any types used as
+ * primitives in a tree.
+ */
+template <typename T>
+T deserialize(const tree::cbor::MapReader &map);
+
+/**
+ * Deserialization function for Name.
+ */
+template <>
+inline Name deserialize<Name>(const tree::cbor::MapReader &map) {
+    return Name::deserialize(map);
+}
+
+} // namespace test_primitives
@@ -0,0 +1,106 @@
+// Instantiates a second copy of the support library in its own namespace, with
+// the allocation counters and operation timers enabled.
+#define TREE_NAMESPACE_BEGIN namespace stats_tree {
+#define TREE_NAMESPACE_END }
+#define TREE_STATS 1
+#include "tree-all.cpp.inc"
+
+#include <gtest/gtest.h>
+
+namespace base = stats_tree::base;
+
+namespace {
+
+/**
+ * Node type for the statistics tests.
+ */
+struct Counted : public base::Base {
+    base::Any<Counted> children;
+    base::OptLink<Counted> back;
+
+    base::One<Counted> copy() const {
+        return base::make<Counted>(*this);
+    }
+
+    bool equals(const Counted &rhs) const {
+        return children.equals(rhs.children) && back.equals(rhs.back);
+    }
+
+    void find_reachable_step(base::PointerMap &map, ConstWorkStack &stack) const override {
+        (void) map;
+        stack.push_back(&back);
+        stack.push_back(&children);
+    }
+
+    void check_complete_step(const base::PointerMap &map, ConstWorkStack &stack) const override {
+        (void) map;
+        stack.push_back(&back);
+        stack.push_back(&children);
+    }
+
+    void validate_step(base::PointerMap &map, ConstWorkStack &stack) const override {
+        (void) map;
+        stack.push_back(&back);
+        stack.push_back(&children);
+    }
+
+    void clone_step(WorkStack &stack, base::CloneMap *copies) override {
+        stack.push_back(&children);
+        if (copies) {
+            copies->register_link(back);
+        }
+    }
+};
+
+} // namespace
+
+TEST(stats, allocations) {
+    auto &counter = base::AllocationCounter::of<Counted>();
+    auto live = counter.get_live_count();
+    counter.reset_peak();
+
+    // Nodes made through make() are counted while they exist, including
+    // those made by clone_parallel().
+    {
+        auto root = base::make<Counted>();
+        for (size_t i = 0; i < 4; i++) {
+            root->children.emplace<Counted>();
+        }
+        EXPECT_EQ(counter.get_live_count(), live + 5);
+        EXPECT_GE(counter.get_live_bytes(), 5 * sizeof(Counted));
+        auto copy = root.clone_parallel(1);
+        EXPECT_EQ(counter.get_live_count(), live + 10);
+    }
+    EXPECT_EQ(counter.get_live_count(), live);
+    EXPECT_EQ(counter.get_peak_count(), live + 10);
+    EXPECT_GE(counter.get_peak_bytes(), 10 * sizeof(Counted));
+
+    // The snapshot reports the counter under the given name.
+    base::StatsSnapshot snapshot{};
+    snapshot.add_node("Counted", counter);
+    ASSERT_EQ(snapshot.nodes.size(), 1u);
+    EXPECT_EQ(snapshot.nodes[0].name, "Counted");
+    EXPECT_EQ(snapshot.nodes[0].peak_count, live + 10);
+}
+
+TEST(stats, timers) {
+    base::OperationTimer::reset();
+    auto root = base::make<Counted>();
+    root->children.emplace<Counted>();
+    root->children[0]->back = root;
+
+    // The entry points time themselves, once per outermost call.
+    root.check_well_formed();
+    root.check_well_formed();
+    EXPECT_EQ(base::OperationTimer::calls(base::Operation::CHECK_WELL_FORMED), 2u);
+    auto copy = root.clone_parallel(1);
+    EXPECT_EQ(base::OperationTimer::calls(base::Operation::CLONE), 1u);
+    EXPECT_EQ(base::OperationTimer::calls(base::Operation::SERIALIZE), 0u);
+
+    base::StatsSnapshot snapshot{};
+    ASSERT_EQ(snapshot.timers.size(), 4u);
+    EXPECT_EQ(snapshot.timers[2].name, "check_well_formed");
+    EXPECT_EQ(snapshot.timers[2].calls, 2u);
+    base::OperationTimer::reset();
+    EXPECT_EQ(base::OperationTimer::calls(base::Operation::CHECK_WELL_FORMED), 0u);
+}